@@ -0,0 +1,67 @@
+#!/bin/sh
+# Time the scorer phases over synthetic corpora and the bydataset files.
+# Prints one line per corpus: entities, total wall time, throughput,
+# peak RSS and the wall time of every phase.
+#
+# usage: bench.sh [scorer [generator [workdir]]]
+
+SCORER=${1:-./ne-scoring-gen}
+GEN=${2:-./ne-bench-gen}
+DIR=${3:-bench-data}
+CONFIG=config.lua
+
+mkdir -p $DIR || exit 1
+
+# name generator-options
+SYNTH="
+flat-1k     -n 1000 -D 1 -e 0.2
+flat-10k    -n 10000 -D 1 -e 0.2
+nested-10k  -n 10000 -D 3 -e 0.2
+dense-10k   -n 10000 -D 2 -p 0.6 -e 0.3
+long-2k     -n 2000 -w 60 -D 2 -e 0.2
+noisy-10k   -n 10000 -D 2 -e 0.6
+aref-10k    -n 10000 -D 2 -a -A 0.3 -e 0.2
+aref-alt-2k -n 2000 -D 3 -a -A 0.8 -e 0.3
+"
+
+run() {
+  name=$1; shift
+  $SCORER --profile "$@" > $DIR/$name.out 2> $DIR/$name.prof || { echo "$name: scorer failed" >&2; return; }
+  cat $DIR/$name.out $DIR/$name.prof | awk -v name=$name '
+    /entities in hypothesis/ { sub(/^.*\(/, ""); ents += $1 }
+    /entities in reference/  { sub(/^.*\(/, ""); ents += $1 }
+    /^  (load|extract|reposition|entity build|refine|miss costing|segment build|subst costing|align|output) +[0-9.]+ +[0-9.]+$/ {
+      phases = phases sprintf(" %8.4f", $(NF-1))
+    }
+    /^  total / { total = $2 }
+    /peak rss:/ { rss = $3 }
+    END {
+      printf("%-14s %9d %9.4f %12.0f %9d%s\n", name, ents, total, total > 0 ? ents/total : 0, rss, phases)
+    }'
+}
+
+printf "%-14s %9s %9s %12s %9s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n" \
+  corpus entities wall_s ents/s rss_kB load extract repos build refine miss segs subst align output
+
+# Fed by a here-document rather than a pipe so that the loop runs in
+# this shell and a generator failure stops the script
+while read name opts; do
+  [ -z "$name" ] && continue
+  case " $opts " in
+    *" -a "*) ref=$DIR/$name.aref; aref=-a ;;
+    *) ref=$DIR/$name.ref; aref= ;;
+  esac
+  [ -f $ref ] || $GEN $opts $DIR/$name || exit 1
+  run $name $aref $CONFIG $ref $DIR/$name.hyp
+done <<EOF
+$SYNTH
+EOF
+
+B=bydataset
+run all_dev   $CONFIG $B/all_data_dev.xml $B/pred_all_dev.xml
+run all_test  $CONFIG $B/all_data_test.xml $B/pred_all_test.xml
+for s in dev test; do
+  run cat_$s        $CONFIG $B/cat/give_cat_$s.xml $B/cat/pred_give_cat_$s.xml
+  run ingredient_$s $CONFIG $B/give_ingredient/give_ingredient_$s.xml $B/give_ingredient/pred_give_ingredient_$s.xml
+  run recipe_$s     $CONFIG $B/recipe/recipe_$s.xml $B/recipe/pred_recipe_$s.xml
+done
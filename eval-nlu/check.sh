@@ -0,0 +1,26 @@
+#!/bin/sh
+# Regression cases: every tests/<name>.ref is scored against
+# tests/<name>.hyp with the options in tests/<name>.opts, the output
+# and the exit status must match tests/<name>.out.
+#
+# usage: check.sh [scorer]
+# With UPDATE=1 the expected outputs are rewritten.
+
+SCORER=${1:-./ne-scoring-gen}
+failed=0
+for ref in tests/*.ref; do
+  name=${ref%.ref}
+  $SCORER $(cat $name.opts) config.lua $ref $name.hyp > $name.cur 2>&1
+  echo "exit $?" >> $name.cur
+  if [ -n "$UPDATE" ]; then
+    mv $name.cur $name.out
+  elif cmp -s $name.out $name.cur; then
+    rm -f $name.cur
+  else
+    echo "FAILED: $name"
+    diff -u $name.out $name.cur
+    failed=1
+  fi
+done
+[ $failed -eq 0 ] && echo "all cases passed"
+exit $failed
@@ -17,6 +17,15 @@ function get_component_tags()
    return component_tags
 end
 
+--   Optionally give the type hierarchy as { type = parent }, parents
+--   need not be tags.  type_cost(e1, e2), on entities or type names,
+--   then returns the path length between the types through their
+--   common ancestor over the sum of their depths, or what
+--   get_type_cost(type1, type2, up1, up2) returns if defined.
+-- function get_type_tree()
+--    return { ["neg_cat-ingredient"] = "cat-ingredient", neg_ingredient = "ingredient" }
+-- end
+
 --   Give the costs
 --     root boundary error
 --     root class error
@@ -27,7 +36,7 @@ end
 --    return 0.25, 0.5, 0.25 --, 0.5, 0.25
 -- end
 
---  Entity structure:
+--  Entity structure (read-only, fields are computed when read):
 --    type  = string,  name of the tag
 --    value = string,  text of the entity
 --    attr  = table,   { attribute = value } pairs
@@ -54,8 +54,26 @@ function get_all_tags()
    return all_tags
 end
 
+--   Give the type hierarchy as { type = parent }, the parent of a
+--   dotted type being its prefix (loc.adm.town -> loc.adm -> loc).
+--   The scorer precomputes the cost of every pair of types from it,
+--   type_cost(e1, e2) then gives 0 for the same type up to 1 for
+--   unrelated ones.
+function get_type_tree()
+   local tree = {}
+   for _,t in ipairs(all_tags) do
+      local p = string.match(t, "^(.*)%.[^.]*$")
+      while p and not tree[t] do
+	 tree[t] = p
+	 t = p
+	 p = string.match(t, "^(.*)%.[^.]*$")
+      end
+   end
+   return tree
+end
 
---   Entity structure:
+
+--   Entity structure (read-only, fields are computed when read):
 --     type  = string,  name of the tag
 --     value = string,  text of the entity
 --     attr  = table,   { attribute = value } pairs
@@ -84,7 +102,7 @@ function get_substitution_cost(e1, e2)
       err[#err+1] = "frontier"
    end
    if(e1.type ~= e2.type) then
-      c = c + 0.5
+      c = c + 0.5       -- or 0.5*type_cost(e1, e2) for a graded cost
       err[#err+1] = "type"
    end
    return c, err
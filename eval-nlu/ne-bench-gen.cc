@@ -0,0 +1,328 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include <vector>
+#include <string>
+#include <iostream>
+
+using namespace std;
+
+// Synthetic reference/hypothesis corpus generator for benchmarking
+// ne-scoring-gen.  The reference is written in xml or aref format,
+// the hypothesis in xml with errors injected in the entities.
+
+// Options
+static const char *progname;
+static bool opt_aref;
+static int opt_count, opt_words, opt_depth, opt_seed;
+static double opt_density, opt_alt, opt_errors;
+static vector<string> opt_tags;
+
+static const char *const words[] = {
+  "je", "veux", "une", "recette", "de", "tarte", "aux", "pommes", "sans", "sel",
+  "avec", "du", "poulet", "et", "des", "oeufs", "comment", "faire", "un", "gateau",
+  "au", "chocolat", "poire", "boeuf", "carpaccio", "nems", "flan", "epices", "merci", "ok"
+};
+static const int nwords = sizeof(words)/sizeof(words[0]);
+
+// Random stuff, xorshift so that corpora do not depend on the libc
+static uint64_t rng_state;
+
+static uint64_t rng()
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static int rng_int(int n)
+{
+  return rng() % n;
+}
+
+static bool rng_test(double p)
+{
+  return (rng() >> 11) * (1.0/9007199254740992.0) < p;
+}
+
+// An utterance is a tree of nodes, words at the leaves
+struct node {
+  int word;                   // Word index, -1 for an entity
+  int type;                   // Entity type
+  int id;                     // Entity id in the aref output
+  bool alt_start, alt_end;    // Alternative frontiers in the aref output
+  vector<node> children;
+
+  node() { word = -1; type = 0; id = 0; alt_start = alt_end = false; }
+};
+
+static int next_id;
+
+void build(vector<node> &nodes, int nw, int depth)
+{
+  while(nw) {
+    if(depth < opt_depth && rng_test(opt_density)) {
+      int len = 1 + rng_int(nw < 4 ? nw : 4);
+      node n;
+      n.type = rng_int(opt_tags.size());
+      n.id = next_id++;
+      build(n.children, len, depth+1);
+      if(n.children.size() >= 2) {
+	n.alt_start = n.children.front().word != -1 && rng_test(opt_alt);
+	n.alt_end = n.children.back().word != -1 && rng_test(opt_alt);
+      }
+      nodes.push_back(n);
+      nw -= len;
+    } else {
+      node n;
+      n.word = rng_int(nwords);
+      nodes.push_back(n);
+      nw--;
+    }
+  }
+}
+
+// Inject miss, false alarm, type and frontier errors in a copy of the tree
+void corrupt(vector<node> &nodes, int depth)
+{
+  for(unsigned int i = 0; i != nodes.size(); i++) {
+    node &n = nodes[i];
+    if(n.word != -1) {
+      if(depth < opt_depth && rng_test(opt_errors/4)) {
+	node e;
+	e.type = rng_int(opt_tags.size());
+	e.children.push_back(n);
+	nodes[i] = e;
+      }
+      continue;
+    }
+
+    corrupt(n.children, depth+1);
+    if(!rng_test(opt_errors))
+      continue;
+
+    switch(rng_int(3)) {
+    case 0: {
+      vector<node> c = n.children;
+      nodes.erase(nodes.begin() + i);
+      nodes.insert(nodes.begin() + i, c.begin(), c.end());
+      i += c.size();
+      i--;
+      break;
+    }
+    case 1:
+      n.type = (n.type + 1 + rng_int(opt_tags.size() > 1 ? opt_tags.size()-1 : 1)) % opt_tags.size();
+      break;
+    case 2:
+      if(n.children.size() >= 2 && n.children.front().word != -1) {
+	node w = n.children.front();
+	n.children.erase(n.children.begin());
+	nodes.insert(nodes.begin() + i, w);
+	i++;
+      }
+      break;
+    }
+  }
+}
+
+void write_xml(FILE *f, const vector<node> &nodes)
+{
+  for(unsigned int i = 0; i != nodes.size(); i++) {
+    const node &n = nodes[i];
+    if(n.word != -1) {
+      fprintf(f, " %s", words[n.word]);
+      continue;
+    }
+    fprintf(f, " <%s>", opt_tags[n.type].c_str());
+    write_xml(f, n.children);
+    fprintf(f, " </%s>", opt_tags[n.type].c_str());
+  }
+}
+
+void write_aref(FILE *f, const vector<node> &nodes, int depth, int parent)
+{
+  for(unsigned int i = 0; i != nodes.size(); i++) {
+    const node &n = nodes[i];
+    if(n.word != -1) {
+      fprintf(f, " %s", words[n.word]);
+      continue;
+    }
+    const char *type = opt_tags[n.type].c_str();
+    fprintf(f, " <annotation id=%d type=%s ftype=s depth=%d", n.id, type, depth);
+    if(parent != -1)
+      fprintf(f, " parent=%d", parent);
+    fprintf(f, "/>");
+    for(unsigned int j = 0; j != n.children.size(); j++) {
+      if(j == 1 && n.alt_start)
+	fprintf(f, " <annotation id=%d type=%s ftype=s/>", n.id, type);
+      if(j == n.children.size()-1 && n.alt_end)
+	fprintf(f, " <annotation id=%d type=%s ftype=e/>", n.id, type);
+      write_aref(f, vector<node>(1, n.children[j]), depth+1, n.id);
+    }
+    fprintf(f, " <annotation id=%d type=%s ftype=e/>", n.id, type);
+  }
+}
+
+FILE *open_out(const char *prefix, const char *ext)
+{
+  string fname = string(prefix) + ext;
+  FILE *f = fopen(fname.c_str(), "w");
+  if(!f) {
+    perror(fname.c_str());
+    exit(1);
+  }
+  return f;
+}
+
+
+// Option handling
+static void print_usage(ostream &out)
+{
+  out << "NE scoring benchmark corpus generator\n"
+      << "\n"
+      << "Usage: " << progname << " [options] prefix\n"
+      << "  Writes prefix.ref (prefix.aref with -a) and prefix.hyp\n"
+      << "  -n <count>          number of utterances (1000)\n"
+      << "  -w <words>          words per utterance (12)\n"
+      << "  -p <density>        probability for an entity to start on a word (0.3)\n"
+      << "  -D <depth>          maximum entity nesting depth (2)\n"
+      << "  -A <prob>           probability of an alternative frontier in aref (0.2)\n"
+      << "  -e <rate>           hypothesis error rate per entity (0.2)\n"
+      << "  -t <tag,...>        entity types (the config.lua ones)\n"
+      << "  -S <seed>           random seed (1)\n"
+      << "  -a                  write the reference in \"aref\" format\n"
+      << "\n"
+      << endl;
+}
+
+static void options(int argc, char ***argv)
+{
+  static option optlist[] = {
+    { "help",   0, 0, 'h' },
+    { 0,      0, 0,  0  }
+  };
+
+  int usage = 0, finish = 0, error = 0;
+
+  opt_aref = false;
+  opt_count = 1000;
+  opt_words = 12;
+  opt_depth = 2;
+  opt_seed = 1;
+  opt_density = 0.3;
+  opt_alt = 0.2;
+  opt_errors = 0.2;
+
+  for(;;) {
+    int opt = getopt_long(argc, *argv, "hn:w:p:D:A:e:t:S:a", optlist, 0);
+    if(opt == EOF)
+      break;
+    switch(opt) {
+    case 'h':
+      usage = 1;
+      finish = 1;
+      error = 0;
+      break;
+    case 'n':
+      opt_count = strtol(optarg, 0, 10);
+      break;
+    case 'w':
+      opt_words = strtol(optarg, 0, 10);
+      break;
+    case 'p':
+      opt_density = strtod(optarg, 0);
+      break;
+    case 'D':
+      opt_depth = strtol(optarg, 0, 10);
+      break;
+    case 'A':
+      opt_alt = strtod(optarg, 0);
+      break;
+    case 'e':
+      opt_errors = strtod(optarg, 0);
+      break;
+    case 't': {
+      const char *p = optarg;
+      for(;;) {
+	const char *q = strchr(p, ',');
+	opt_tags.push_back(q ? string(p, q) : string(p));
+	if(!q)
+	  break;
+	p = q+1;
+      }
+      break;
+    }
+    case 'S':
+      opt_seed = strtol(optarg, 0, 10);
+      break;
+    case 'a':
+      opt_aref = true;
+      break;
+    case '?':
+    case ':':
+      usage = 1;
+      finish = 1;
+      error = 1;
+      break;
+    default:
+      abort();
+    }
+    if(finish)
+      break;
+  }
+  if(usage)
+    print_usage(error ? cerr : cout);
+  if(finish)
+    exit(error);
+
+  if(opt_tags.empty()) {
+    opt_tags.push_back("recipe");
+    opt_tags.push_back("neg_cat-ingredient");
+    opt_tags.push_back("cat-ingredient");
+    opt_tags.push_back("ingredient");
+    opt_tags.push_back("neg_ingredient");
+  }
+
+  *argv += optind;
+}
+
+int main(int argc, char **argv)
+{
+  progname = argv[0];
+
+  options(argc, &argv);
+
+  if(!argv[0] || argv[1]) {
+    print_usage(cerr);
+    exit(1);
+  }
+
+  rng_state = 0x9e3779b97f4a7c15ULL ^ opt_seed;
+  next_id = 0;
+
+  FILE *ref = open_out(argv[0], opt_aref ? ".aref" : ".ref");
+  FILE *hyp = open_out(argv[0], ".hyp");
+
+  for(int i = 0; i != opt_count; i++) {
+    vector<node> utt;
+    build(utt, opt_words, 0);
+    vector<node> hutt = utt;
+    corrupt(hutt, 0);
+
+    if(opt_aref)
+      write_aref(ref, utt, 0, -1);
+    else
+      write_xml(ref, utt);
+    fprintf(ref, "\n");
+    write_xml(hyp, hutt);
+    fprintf(hyp, "\n");
+  }
+
+  fclose(ref);
+  fclose(hyp);
+  return 0;
+}
@@ -5,12 +5,24 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <assert.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 extern "C" {
 #include <lua.h>
@@ -24,40 +36,89 @@ extern "C" {
 #include <set>
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <new>
 
 using namespace std;
 
 // Options
 static const char *progname;
-static bool opt_summary, opt_details, opt_details_correct, opt_iag, opt_ref_aref, opt_open;
-static int opt_expected_count;
+static bool opt_summary, opt_details, opt_details_correct, opt_iag, opt_tokens, opt_conll, opt_ref_aref, opt_open, opt_profile, opt_verify;
+static int opt_expected_count, opt_resync, opt_match_above, opt_jobs, opt_pipeline;
+static const char *opt_trace, *opt_details_out, *opt_details_class;
+static list<string> opt_details_tags, opt_details_errors;
+
+enum { FORMAT_TEXT, FORMAT_JSON, FORMAT_CSV, FORMAT_BIN };
+static int opt_format;
+
+// Profiling stuff
+enum {
+  PHASE_LOAD, PHASE_EXTRACT, PHASE_REPOSITION, PHASE_ENTITIES, PHASE_REFINE, PHASE_MISS,
+  PHASE_SEGMENTS, PHASE_SUBST, PHASE_ALIGN, PHASE_PIPELINE, PHASE_OUTPUT, PHASE_COUNT
+};
+static const char *const phase_names[PHASE_COUNT] = {
+  "load", "extract", "reposition", "entity build", "refine", "miss costing",
+  "segment build", "subst costing", "align", "pipeline", "output"
+};
+static double phase_wall[PHASE_COUNT], phase_cpu[PHASE_COUNT];
+static double phase_wall_start, phase_cpu_start;
+static int current_phase = -1;
+static long lua_calls;
+
+// Trace stuff, chrome trace-event format
+static FILE *trace_file;
+static double trace_origin;
+static bool trace_first;
+static __thread int trace_tid;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Tag stuff
 static vector<string> tag_names;
 static map<string, int> tag_names_map;
 static vector<int> tag_hypcount, tag_refcount, tag_correct;
 
+// Tag names perfect hash, built once all the tags are known
+static vector<int> tag_hash_table;
+static unsigned int tag_hash_seed, tag_hash_mask;
+
+// Type substitution costs, tag x tag, from the type tree
+static vector<double> type_costs;
+
 // Error keys stuff
 static vector<string> error_names;
 static map<string, int> error_names_map;
 
+// Error types sets stuff.  A set of error types is a bit mask of the
+// error ids when they all fit, otherwise ERROR_SET_OVERFLOW or'ed with
+// an index in error_sets.
+#define ERROR_SET_OVERFLOW (uint64_t(1) << 63)
+static vector<list<int> > error_sets;
+static map<list<int>, uint64_t> error_sets_map;
+
+// Attribute keys and values stuff
+static vector<string> attr_strings;
+static map<string, int> attr_strings_map;
+
 struct error_d {
   double cost;
-  list<int> error_types;
+  uint64_t error_set;               // Error types, 0 when correct
 
-  error_d() { cost = -1; }
+  error_d() { cost = -1; error_set = 0; }
 };
 
 
+// Byte offset in a text, 64 bits for corpora above 2GB
+typedef int64_t text_pos;
+
 // A tag alone in an input file
 struct simple_tag {
   int tagid;                        // Number representing the tag name
   bool closing;                     // Is it a closing tag?
-  int pos;                          // Offset in bytes from the start of the post-extraction text
+  text_pos pos;                     // Offset in bytes from the start of the post-extraction text
   int line, col;                    // Position in the original xml (for bitching purposes)
-  list<pair<string, string> > attr; // Attribute/value pairs
+  list<pair<int, int> > attr;       // Attribute/value pairs, interned
 
-  simple_tag(int _tagid, bool _closing, int _pos, int _line, int _col, const list<pair<string, string> > &_attr) {
+  simple_tag(int _tagid, bool _closing, text_pos _pos, int _line, int _col, const list<pair<int, int> > &_attr) {
     tagid = _tagid; closing = _closing; pos = _pos; line = _line; col = _col; attr = _attr;
   }
 };
@@ -65,64 +126,234 @@ struct simple_tag {
 struct aref_tag {
   int id;
   int tagid;
-  int pos;
+  text_pos pos;
   bool opening, closing;
   int depth;
   int parent;
   int line, col;                    // Position in the original xml (for bitching purposes)
-  list<pair<string, string> > attr; // Attribute/value pairs
+  list<pair<int, int> > attr;       // Attribute/value pairs, interned
 
-  aref_tag(int _id, int _tagid, int _pos, bool _opening, bool _closing, int _depth, int _parent, int _line, int _col) {
+  aref_tag(int _id, int _tagid, text_pos _pos, bool _opening, bool _closing, int _depth, int _parent, int _line, int _col) {
     id = _id; tagid = _tagid; pos = _pos; opening = _opening; closing = _closing; depth = _depth;
     parent = _parent; line = _line; col = _col;
   }
 };
 
-// A tagged entity
-struct entity {
-  int tagid;                                              // Number representing the tag name
-  vector<int> start, end;                                 // Start and end positions
-  list<pair<string, string> > attr;                       // Attribute/value pairs
-  int line, col;                                          // Position in the source file of the starting tag
-  int depth;                                              // Depth of the entity, starts at 0
-  bool hyp;                                               // Hypothesis entity or reference ?
-  struct entity *parent;                                  // Id of the parent entity, 0 if none
-  struct entity *left_constraint;                         // Id of the entity on the left of that one with the same parent (or no parent for either), 0 if none
-
-  vector<vector<error_d> > miss_errors;                   // Miss error depending on the frontiers chosen
-  map<entity *, vector<vector<error_d> > > subst_errors;  // Substitution error depending on the frontiers chosen and the hypothesis entity - reference entities only
-  bool paired;                                            // Is this entity paired with another in the mapping
-
-  entity() { tagid = -1; }
-  entity(int _tagid, int _line, int _col, int _depth, bool _hyp, const list<pair<string, string> > &_attr) {
-    tagid = _tagid; depth = _depth; line = _line; col = _col; hyp = _hyp; attr = _attr; parent = 0; left_constraint = 0;
+// Entities are referenced by their index in the entity store
+typedef unsigned int entity_id;
+static const entity_id NO_ENTITY = ~0U;
+
+// The tagged entities of both the reference and the hypothesis, as
+// parallel arrays.  Frontiers, attributes and miss errors live in
+// shared pools, each entity keeping its offset in them.
+struct entity_store {
+  struct frontier_event {
+    entity_id e;
+    text_pos pos;
+    bool end;
+    frontier_event(entity_id _e, text_pos _pos, bool _end) { e = _e; pos = _pos; end = _end; }
+  };
+
+  vector<int> tagid;                           // Number representing the tag name
+  vector<int> line, col;                       // Position in the source file of the starting tag
+  vector<int> depth;                           // Depth of the entity, starts at 0
+  vector<bool> hyp;                            // Hypothesis entity or reference ?
+  vector<entity_id> parent;                    // Parent entity, NO_ENTITY if none
+  vector<entity_id> left_constraint;           // Entity on the left of that one with the same parent (or no parent for either), NO_ENTITY if none
+  vector<bool> paired;                         // Is this entity paired with another in the mapping
+
+  vector<unsigned int> start_ofs, end_ofs;     // Start and end positions, offsets in the frontier pool
+  vector<unsigned short> nstarts, nends;       //   and counts
+  vector<text_pos> frontier_pool;
+  vector<frontier_event> pending;              // Frontiers not yet in the pool
+
+  vector<unsigned int> attr_ofs;               // Attribute/value pairs, offset in the attribute pool
+  vector<unsigned short> nattrs;               //   and count
+  vector<pair<int, int> > attr_pool;
+
+  vector<unsigned int> miss_ofs;               // Miss error depending on the frontiers chosen, start-major grid offset in the pool
+  vector<error_d> miss_pool;
+  vector<bool> infeasible;                     // Frontier choices pruned by prune_frontiers, same grid, empty if none
+  vector<unsigned int> miss_alt;               // Grid index of the surviving choice scored when unmapped, set by prune_frontiers, empty if none
+
+  vector<unsigned int> local_idx;              // Index of the entity within its segment group reference or hypothesis list
+
+  unsigned int size() const { return tagid.size(); }
+
+  entity_id add(int _tagid, int _line, int _col, int _depth, bool _hyp, const list<pair<int, int> > &_attr) {
+    entity_id e = size();
+    resize(e+1);
+    tagid[e] = _tagid; line[e] = _line; col[e] = _col; depth[e] = _depth; hyp[e] = _hyp;
+    set_attr(e, _attr);
+    return e;
+  }
+
+  void resize(unsigned int n) {
+    tagid.resize(n, -1);
+    line.resize(n);
+    col.resize(n);
+    depth.resize(n);
+    hyp.resize(n);
+    parent.resize(n, NO_ENTITY);
+    left_constraint.resize(n, NO_ENTITY);
+    paired.resize(n);
+    start_ofs.resize(n);
+    end_ofs.resize(n);
+    nstarts.resize(n);
+    nends.resize(n);
+    attr_ofs.resize(n);
+    nattrs.resize(n);
+    local_idx.resize(n);
+  }
+
+  void set_attr(entity_id e, const list<pair<int, int> > &_attr) {
+    attr_ofs[e] = attr_pool.size();
+    nattrs[e] = _attr.size();
+    attr_pool.insert(attr_pool.end(), _attr.begin(), _attr.end());
+  }
+
+  void add_start(entity_id e, text_pos pos) { pending.push_back(frontier_event(e, pos, false)); }
+  void add_end(entity_id e, text_pos pos) { pending.push_back(frontier_event(e, pos, true)); }
+
+  // Move the pending frontiers to the pool, grouped per entity, in
+  // order of addition
+  void commit_frontiers() {
+    vector<unsigned short> ns(size()), ne(size());
+    for(vector<frontier_event>::const_iterator i = pending.begin(); i != pending.end(); i++)
+      (i->end ? ne : ns)[i->e]++;
+    unsigned int ofs = frontier_pool.size();
+    for(entity_id e = 0; e != size(); e++)
+      if(ns[e] || ne[e]) {
+	start_ofs[e] = ofs;
+	nstarts[e] = 0;
+	ofs += ns[e];
+	end_ofs[e] = ofs;
+	nends[e] = 0;
+	ofs += ne[e];
+      }
+    frontier_pool.resize(ofs);
+    for(vector<frontier_event>::const_iterator i = pending.begin(); i != pending.end(); i++) {
+      if(i->end)
+	frontier_pool[end_ofs[i->e] + nends[i->e]++] = i->pos;
+      else
+	frontier_pool[start_ofs[i->e] + nstarts[i->e]++] = i->pos;
+    }
+    pending.clear();
+  }
+
+  // Remove an entity, only valid when no other entity refers to it or
+  // to the ones after it
+  void erase(entity_id e) {
+    tagid.erase(tagid.begin() + e);
+    line.erase(line.begin() + e);
+    col.erase(col.begin() + e);
+    depth.erase(depth.begin() + e);
+    hyp.erase(hyp.begin() + e);
+    parent.erase(parent.begin() + e);
+    left_constraint.erase(left_constraint.begin() + e);
+    paired.erase(paired.begin() + e);
+    start_ofs.erase(start_ofs.begin() + e);
+    end_ofs.erase(end_ofs.begin() + e);
+    nstarts.erase(nstarts.begin() + e);
+    nends.erase(nends.begin() + e);
+    attr_ofs.erase(attr_ofs.begin() + e);
+    nattrs.erase(nattrs.begin() + e);
+    local_idx.erase(local_idx.begin() + e);
   }
+
+  unsigned int nstart(entity_id e) const { return nstarts[e]; }
+  unsigned int nend(entity_id e) const { return nends[e]; }
+  text_pos start(entity_id e, unsigned int k) const { return frontier_pool[start_ofs[e] + k]; }
+  text_pos end(entity_id e, unsigned int k) const { return frontier_pool[end_ofs[e] + k]; }
+  text_pos &start(entity_id e, unsigned int k) { return frontier_pool[start_ofs[e] + k]; }
+  text_pos &end(entity_id e, unsigned int k) { return frontier_pool[end_ofs[e] + k]; }
+  text_pos first_start(entity_id e) const { return start(e, 0); }
+  text_pos last_start(entity_id e) const { return start(e, nstarts[e]-1); }
+  text_pos first_end(entity_id e) const { return end(e, 0); }
+  text_pos last_end(entity_id e) const { return end(e, nends[e]-1); }
+
+  const pair<int, int> *attr_begin(entity_id e) const { return &attr_pool[0] + attr_ofs[e]; }
+  const pair<int, int> *attr_end(entity_id e) const { return &attr_pool[0] + attr_ofs[e] + nattrs[e]; }
+
+  error_d &miss_error(entity_id e, int sf, int ef) { return miss_pool[miss_ofs[e] + sf*nends[e] + ef]; }
+  const error_d &miss_error(entity_id e, int sf, int ef) const { return miss_pool[miss_ofs[e] + sf*nends[e] + ef]; }
+  bool feasible(entity_id e, int sf, int ef) const { return infeasible.empty() || !infeasible[miss_ofs[e] + sf*nends[e] + ef]; }
+
+  // Miss error reported for an unmapped entity
+  const error_d &unmapped_error(entity_id e) const { return miss_pool[miss_ofs[e] + (miss_alt.empty() ? 0 : miss_alt[e])]; }
 };
 
 
+// A slice of one of the segment_pool arrays
+template<class T> struct pool_range {
+  const T *first;
+  unsigned int count;
+
+  pool_range() { first = 0; count = 0; }
+  const T *begin() const { return first; }
+  const T *end() const { return first + count; }
+  unsigned int size() const { return count; }
+  bool empty() const { return !count; }
+  const T &operator[](unsigned int i) const { return first[i]; }
+};
+
 // A segment of text between two entities frontiers
 struct segment {
   struct pairinfo {
-    entity *er, *eh;
+    entity_id er, eh;
     const error_d *error;
 
-    pairinfo(entity *_er, entity *_eh, const error_d *e) { er = _er; eh = _eh; error = e; }
+    pairinfo(entity_id _er, entity_id _eh, const error_d *e) { er = _er; eh = _eh; error = e; }
   };
 
   struct ef {
-    entity *e;
+    entity_id e;
     unsigned int fid;
-    ef(entity *_e, unsigned int _fid) { e=_e; fid=_fid; }
+    ef(entity_id _e, unsigned int _fid) { e=_e; fid=_fid; }
+  };
+
+  text_pos start, end;                      // position of the start and the end of the segment
+  pool_range<entity_id> entities;           // entities present in the segment, by id
+  pool_range<ef> starting_ref_entities;     // reference entities which may start here
+  pool_range<entity_id> starting_hyp_entities;  // hypothesis entities which start here
+
+  list<pairinfo> added_pairs;               // Pairs added within the segment
+  list<entity_id> unmapped_entities;        // Entities that could have been mapped within the segment (e.g. starting there) but haven't
+};
+
+// The entity lists of all the segments, each segment holding slices
+// of these arrays
+struct segment_pool {
+  vector<entity_id> entities;
+  vector<segment::ef> starting_ref;
+  vector<entity_id> starting_hyp;
+};
+
+// A run of segments linked by the entities spanning them.  No entity
+// crosses a group limit, so groups are aligned independently.
+struct segment_group {
+  struct ref_block {
+    size_t ofs;                             // Offset of the entity costs in the tensor
+    unsigned int hstride, sstride;          // Strides for the hypothesis and the start frontier
   };
 
-  int start, end;                         // position of the start and the end of the segment
-  vector<entity *> entities;              // entities present in the segment
-  vector<ef> starting_ref_entities;       // reference entities which may start here
-  vector<ef> ending_ref_entities;         // reference entities which may stop here
-  vector<entity *> starting_hyp_entities; // hypothesis entities which start here
+  unsigned int first, last;                 // Segments range, last excluded
+  vector<entity_id> refs, hyps;             // Entities of the group, indexed by entity_store::local_idx
+  vector<ref_block> blocks;                 // Per reference entity layout of the cost tensor
+  vector<error_d> subst;                    // Substitution errors, dense over (reference, hypothesis, start frontier, end frontier)
+  const char *aligner;                      // Strategy which aligned the group, 0 for the exhaustive search
+
+  segment_group() { first = last = 0; aligner = 0; }
+
+  error_d &subst_error(unsigned int lr, unsigned int lh, int sf, int ef) {
+    const ref_block &b = blocks[lr];
+    return subst[b.ofs + size_t(lh)*b.hstride + sf*b.sstride + ef];
+  }
 
-  list<pairinfo> added_pairs;             // Pairs added within the segment
-  list<entity *> unmapped_entities;       // Entities that could have been mapped within the segment (e.g. starting there) but haven't
+  const error_d &subst_error(unsigned int lr, unsigned int lh, int sf, int ef) const {
+    const ref_block &b = blocks[lr];
+    return subst[b.ofs + size_t(lh)*b.hstride + sf*b.sstride + ef];
+  }
 };
 
 // Escape a string for printing, deduplicate spaces
@@ -145,28 +376,327 @@ void escape(char *dest, const char *src, int size)
   *dest = 0;
 }
 
-// Load a file, tack an \0 at the end
-char *file_load(const char *fname)
-{
-  char msg[512];
+// An input file read as a stream of bytes.  Gzip and zstd files,
+// recognized by their magic bytes, are decompressed by a background
+// thread which stays a few blocks ahead of the reader.
+#define INPUT_BLOCK (1 << 20)
+#define INPUT_AHEAD 4
+
+enum { INPUT_PLAIN, INPUT_GZIP, INPUT_ZSTD };
+
+class input_stream {
+  const char *fname;
+  int fd;
+  int kind;
+  unsigned char magic[4];           // Sniffed bytes, read again first
+  size_t nmagic, magic_pos;
+  bool raw_eof;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  list<string> blocks;              // Decompressed blocks not read yet
+  bool done, stop;
+  string error;
+  string cur;
+  size_t cur_pos;
+
+  size_t raw_read(void *buf, size_t n) {
+    if(magic_pos != nmagic) {
+      size_t l = nmagic - magic_pos < n ? nmagic - magic_pos : n;
+      memcpy(buf, magic + magic_pos, l);
+      magic_pos += l;
+      return l;
+    }
+    if(raw_eof)
+      return 0;
+    if(n > (1 << 30))
+      n = 1 << 30;
+    for(;;) {
+      ssize_t r = read(fd, buf, n);
+      if(r >= 0) {
+	if(!r)
+	  raw_eof = true;
+	return r;
+      }
+      if(errno != EINTR) {
+	char msg[512];
+	sprintf(msg, "Read %s", fname);
+	perror(msg);
+	exit(2);
+      }
+    }
+  }
+
+  // Hand a block to the reader, false if the reader is gone
+  bool push(string &block) {
+    pthread_mutex_lock(&lock);
+    while(blocks.size() >= INPUT_AHEAD && !stop)
+      pthread_cond_wait(&cond, &lock);
+    bool ok = !stop;
+    if(ok) {
+      blocks.push_back(string());
+      blocks.back().swap(block);
+      pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    block.clear();
+    return ok;
+  }
+
+  void finish(const string &err) {
+    pthread_mutex_lock(&lock);
+    done = true;
+    error = err;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+
+  void gzip_run() {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if(inflateInit2(&z, 15+32) != Z_OK) {
+      finish("cannot initialize zlib");
+      return;
+    }
+    unsigned char in[65536];
+    string out;
+    out.resize(INPUT_BLOCK);
+    size_t olen = 0;
+    string err;
+    for(;;) {
+      if(!z.avail_in) {
+	z.avail_in = raw_read(in, sizeof(in));
+	z.next_in = in;
+	if(!z.avail_in) {
+	  if(z.total_in)
+	    err = "truncated gzip data";
+	  break;
+	}
+      }
+      z.next_out = (Bytef *)&out[olen];
+      z.avail_out = INPUT_BLOCK - olen;
+      int r = inflate(&z, Z_NO_FLUSH);
+      olen = INPUT_BLOCK - z.avail_out;
+      if(r == Z_STREAM_END) {
+	// Concatenated members, as written by pigz or cat
+	inflateReset(&z);
+	z.total_in = 0;
+      } else if(r != Z_OK && r != Z_BUF_ERROR) {
+	err = z.msg ? z.msg : "corrupted gzip data";
+	break;
+      }
+      if(olen == INPUT_BLOCK) {
+	out.resize(olen);
+	if(!push(out))
+	  break;
+	out.resize(INPUT_BLOCK);
+	olen = 0;
+      }
+    }
+    inflateEnd(&z);
+    out.resize(olen);
+    if(olen)
+      push(out);
+    finish(err);
+  }
+
+#ifdef HAVE_ZSTD
+  void zstd_run() {
+    ZSTD_DStream *zs = ZSTD_createDStream();
+    ZSTD_initDStream(zs);
+    unsigned char in[65536];
+    ZSTD_inBuffer ib = { in, 0, 0 };
+    string out;
+    out.resize(INPUT_BLOCK);
+    ZSTD_outBuffer ob = { &out[0], INPUT_BLOCK, 0 };
+    size_t hint = 1;
+    string err;
+    for(;;) {
+      if(ib.pos == ib.size) {
+	ib.size = raw_read(in, sizeof(in));
+	ib.pos = 0;
+	if(!ib.size) {
+	  if(hint)
+	    err = "truncated zstd data";
+	  break;
+	}
+      }
+      hint = ZSTD_decompressStream(zs, &ob, &ib);
+      if(ZSTD_isError(hint)) {
+	err = ZSTD_getErrorName(hint);
+	break;
+      }
+      if(ob.pos == ob.size) {
+	if(!push(out))
+	  break;
+	out.resize(INPUT_BLOCK);
+	ob.dst = &out[0];
+	ob.pos = 0;
+      }
+    }
+    ZSTD_freeDStream(zs);
+    out.resize(ob.pos);
+    if(ob.pos)
+      push(out);
+    finish(err);
+  }
+#endif
+
+  static void *run(void *arg) {
+    input_stream *in = static_cast<input_stream *>(arg);
+#ifdef HAVE_ZSTD
+    if(in->kind == INPUT_ZSTD)
+      in->zstd_run();
+    else
+#endif
+      in->gzip_run();
+    return 0;
+  }
+
+public:
+  input_stream(const char *_fname) {
+    char msg[512];
+    fname = _fname;
+    sprintf(msg, "Open %s", fname);
+    fd = open(fname, O_RDONLY);
+    if(fd<0) {
+      perror(msg);
+      exit(2);
+    }
+    nmagic = magic_pos = 0;
+    raw_eof = false;
+    while(nmagic != 4) {
+      size_t r = raw_read(magic + nmagic, 4 - nmagic);
+      if(!r)
+	break;
+      nmagic += r;
+    }
+
+    kind = INPUT_PLAIN;
+    if(nmagic >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+      kind = INPUT_GZIP;
+    else if(nmagic == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+#ifndef HAVE_ZSTD
+      fprintf(stderr, "%s: zstd compressed, but zstd support is not compiled in\n", fname);
+      exit(2);
+#endif
+      kind = INPUT_ZSTD;
+    }
+
+    done = stop = false;
+    cur_pos = 0;
+    if(kind != INPUT_PLAIN) {
+      pthread_mutex_init(&lock, 0);
+      pthread_cond_init(&cond, 0);
+      pthread_create(&thread, 0, run, this);
+    }
+  }
 
-  sprintf(msg, "Open %s", fname);
-  int fd = open(fname, O_RDONLY);
-  if(fd<0) {
-    perror(msg);
-    exit(2);
+  ~input_stream() {
+    if(kind != INPUT_PLAIN) {
+      pthread_mutex_lock(&lock);
+      stop = true;
+      pthread_cond_broadcast(&cond);
+      pthread_mutex_unlock(&lock);
+      pthread_join(thread, 0);
+      pthread_cond_destroy(&cond);
+      pthread_mutex_destroy(&lock);
+    }
+    close(fd);
+  }
+
+  // Size of the data if known in advance, 0 otherwise
+  size_t size_hint() const {
+    struct stat st;
+    return kind == INPUT_PLAIN && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? size_t(st.st_size) : 0;
   }
 
-  int size = lseek(fd, 0, SEEK_END);
-  lseek(fd, 0, SEEK_SET);
+  // Read up to n bytes, 0 at the end of the data
+  size_t get(char *buf, size_t n) {
+    if(kind == INPUT_PLAIN)
+      return raw_read(buf, n);
+
+    if(cur_pos == cur.size()) {
+      pthread_mutex_lock(&lock);
+      while(blocks.empty() && !done)
+	pthread_cond_wait(&cond, &lock);
+      if(!blocks.empty()) {
+	cur.swap(blocks.front());
+	blocks.pop_front();
+	cur_pos = 0;
+	pthread_cond_broadcast(&cond);
+      }
+      pthread_mutex_unlock(&lock);
+      if(cur_pos == cur.size()) {
+	if(!error.empty()) {
+	  fprintf(stderr, "%s: %s\n", fname, error.c_str());
+	  exit(2);
+	}
+	return 0;
+      }
+    }
+    size_t l = cur.size() - cur_pos < n ? cur.size() - cur_pos : n;
+    memcpy(buf, cur.data() + cur_pos, l);
+    cur_pos += l;
+    return l;
+  }
+};
 
-  char *data = (char *)malloc(size+1);
-  read(fd, data, size);
-  close(fd);
+// Load a whole file, decompressing it if needed, tack an \0 at the end
+char *file_load(const char *fname)
+{
+  input_stream in(fname);
+  size_t alloc = in.size_hint();
+  if(alloc < 65536)
+    alloc = 65536;
+  char *data = (char *)malloc(alloc+1);
+  size_t size = 0;
+  for(;;) {
+    if(size == alloc) {
+      alloc *= 2;
+      data = (char *)realloc(data, alloc+1);
+    }
+    if(!data) {
+      fprintf(stderr, "%s: out of memory\n", fname);
+      exit(2);
+    }
+    size_t r = in.get(data + size, alloc - size);
+    if(!r)
+      break;
+    size += r;
+  }
   data[size] = 0;
   return data;
 }
 
+// A file loaded by a background thread
+struct background_load {
+  const char *fname;
+  char *data;
+  pthread_t thread;
+};
+
+static void *background_load_run(void *arg)
+{
+  background_load *bl = static_cast<background_load *>(arg);
+  bl->data = file_load(bl->fname);
+  return 0;
+}
+
+void background_load_start(background_load &bl, const char *fname)
+{
+  bl.fname = fname;
+  bl.data = 0;
+  pthread_create(&bl.thread, 0, background_load_run, &bl);
+}
+
+char *background_load_wait(background_load &bl)
+{
+  pthread_join(bl.thread, 0);
+  return bl.data;
+}
+
 // Get a id from a name, create it if needed
 int any_get(string t, vector<string> &vt, map<string, int> &mt)
 {
@@ -185,11 +715,61 @@ int tag_get(string t)
   return any_get(t, tag_names, tag_names_map);
 }
 
+// Seeded FNV-1a hash of a byte range
+static inline unsigned int tag_hash(const char *s, const char *e, unsigned int seed)
+{
+  unsigned int h = 2166136261U ^ seed;
+  while(s != e) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619U;
+  }
+  h ^= h >> 15;
+  return h;
+}
+
+// Find a seed and a table size with no collision between the tag names
+void build_tag_hash()
+{
+  unsigned int size = 4;
+  while(size < 2*tag_names.size())
+    size <<= 1;
+  for(;;) {
+    for(unsigned int seed = 1; seed != 256; seed++) {
+      tag_hash_table.assign(size, -1);
+      unsigned int i;
+      for(i = 0; i != tag_names.size(); i++) {
+	const string &t = tag_names[i];
+	unsigned int h = tag_hash(t.data(), t.data() + t.size(), seed) & (size-1);
+	if(tag_hash_table[h] != -1)
+	  break;
+	tag_hash_table[h] = i;
+      }
+      if(i == tag_names.size()) {
+	tag_hash_seed = seed;
+	tag_hash_mask = size-1;
+	return;
+      }
+    }
+    size <<= 1;
+  }
+}
+
+// Get a tagid from a tag name in a byte range, -1 if not a tested tag
+int tag_find(const char *s, const char *e)
+{
+  if(tag_hash_table.empty())
+    return -1;
+  int id = tag_hash_table[tag_hash(s, e, tag_hash_seed) & tag_hash_mask];
+  if(id == -1)
+    return -1;
+  const string &t = tag_names[id];
+  return t.size() == size_t(e-s) && !memcmp(t.data(), s, e-s) ? id : -1;
+}
+
 // Get a tagid from a tag name, -1 if not a tested tag
-int tag_find(string t)
+int tag_find(const string &t)
 {
-  map<string, int>::const_iterator i = tag_names_map.find(t);
-  return i != tag_names_map.end() ? i->second : -1;
+  return tag_find(t.data(), t.data() + t.size());
 }
 
 // Get an errid from an error name, create it if needed
@@ -198,6 +778,49 @@ int error_get(string t)
   return any_get(t, error_names, error_names_map);
 }
 
+// Get an error set from a sorted list of error ids, intern it if it
+// does not fit in a mask (too many error names, or repeated errors)
+uint64_t error_set_get(const list<int> &t)
+{
+  uint64_t mask = 0;
+  for(list<int>::const_iterator i = t.begin(); i != t.end(); i++) {
+    if(*i >= 63 || (mask & (uint64_t(1) << *i)))
+      goto overflow;
+    mask |= uint64_t(1) << *i;
+  }
+  return mask;
+
+ overflow:
+  map<list<int>, uint64_t>::const_iterator i = error_sets_map.find(t);
+  if(i != error_sets_map.end())
+    return i->second;
+  uint64_t id = ERROR_SET_OVERFLOW | error_sets.size();
+  error_sets.push_back(t);
+  error_sets_map[t] = id;
+  return id;
+}
+
+// Get an interned attribute key or value id, create it if needed
+// (locked, the pipeline workers extract tags concurrently)
+static pthread_mutex_t attr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int attr_get(string t)
+{
+  pthread_mutex_lock(&attr_lock);
+  int id = any_get(t, attr_strings, attr_strings_map);
+  pthread_mutex_unlock(&attr_lock);
+  return id;
+}
+
+// Get an attribute key or value from its id
+string attr_string(int id)
+{
+  pthread_mutex_lock(&attr_lock);
+  string t = attr_strings[id];
+  pthread_mutex_unlock(&attr_lock);
+  return t;
+}
+
 string lua_tocxxstring(lua_State *L, int idx)
 {
   size_t sz;
@@ -212,38 +835,96 @@ void lua_pushcxxstring(lua_State *L, string s)
   lua_pushlstring(L, s.data(), s.size());
 }
 
-void lua_pushentity(lua_State *L, const entity *e, int sf, int ef, const char *data)
+// Entities are passed to the description as userdata proxies, the
+// fields are computed when the script reads them
+struct entity_proxy {
+  const entity_store *es;
+  entity_id e;
+  int sf, ef;
+  const char *data;
+};
+
+static int entity_index(lua_State *L)
 {
-  lua_newtable(L);
-  lua_pushcxxstring(L, tag_names[e->tagid]);
-  lua_setfield(L, -2, "type");
-  lua_pushboolean(L, e->hyp);
-  lua_setfield(L, -2, "hyp");
-  lua_pushinteger(L, e->start[sf]);
-  lua_setfield(L, -2, "spos");
-  lua_pushinteger(L, e->end[ef]);
-  lua_setfield(L, -2, "epos");
+  const entity_proxy *p = static_cast<const entity_proxy *>(luaL_checkudata(L, 1, "ne.entity"));
+  const char *k = luaL_checkstring(L, 2);
+  const entity_store &es = *p->es;
+  entity_id e = p->e;
+
+  if(!strcmp(k, "type"))
+    lua_pushcxxstring(L, tag_names[es.tagid[e]]);
+
+  else if(!strcmp(k, "hyp"))
+    lua_pushboolean(L, es.hyp[e]);
+
+  else if(!strcmp(k, "spos"))
+    lua_pushinteger(L, es.start(e, p->sf));
+
+  else if(!strcmp(k, "epos"))
+    lua_pushinteger(L, es.end(e, p->ef));
+
+  else if(!strcmp(k, "value")) {
+    int len = es.end(e, p->ef) - es.start(e, p->sf);
+    char *ebuf = new char[5*len+1];
+    escape(ebuf, p->data + es.start(e, p->sf), len);
+    lua_pushstring(L, ebuf);
+    delete[] ebuf;
 
-  if(!e->attr.empty()) {
+  } else if(!strcmp(k, "attr") && es.nattrs[e]) {
     lua_newtable(L);
-    for(list<pair<string, string> >::const_iterator i = e->attr.begin(); i != e->attr.end(); i++) {
-      lua_pushcxxstring(L, i->first);
-      lua_pushcxxstring(L, i->second);
+    for(const pair<int, int> *i = es.attr_begin(e); i != es.attr_end(e); i++) {
+      lua_pushcxxstring(L, attr_string(i->first));
+      lua_pushcxxstring(L, attr_string(i->second));
       lua_rawset(L, -3);
     }
-    lua_setfield(L, -2, "attr");
-  }
 
-  char *ebuf = new char[5*(e->end[ef] - e->start[sf])];
-  escape(ebuf, data + e->start[sf], e->end[ef] - e->start[sf]);
-  lua_pushstring(L, ebuf);
-  delete[] ebuf;
-  lua_setfield(L, -2, "value");
+  } else
+    lua_pushnil(L);
+  return 1;
+}
+
+void lua_pushentity(lua_State *L, const entity_store &es, entity_id e, int sf, int ef, const char *data)
+{
+  entity_proxy *p = static_cast<entity_proxy *>(lua_newuserdata(L, sizeof(entity_proxy)));
+  p->es = &es;
+  p->e = e;
+  p->sf = sf;
+  p->ef = ef;
+  p->data = data;
+  luaL_getmetatable(L, "ne.entity");
+  lua_setmetatable(L, -2);
+}
+
+// type_cost(t1, t2) for the description, on entities or type names
+static int type_arg(lua_State *L, int idx)
+{
+  const entity_proxy *p = static_cast<const entity_proxy *>(luaL_testudata(L, idx, "ne.entity"));
+  if(p)
+    return p->es->tagid[p->e];
+  const char *t = luaL_checkstring(L, idx);
+  int tid = tag_find(t, t + strlen(t));
+  if(tid == -1)
+    luaL_error(L, "type_cost: unknown type %s", t);
+  return tid;
+}
+
+static int lua_type_cost(lua_State *L)
+{
+  int t1 = type_arg(L, 1);
+  int t2 = type_arg(L, 2);
+  lua_pushnumber(L, type_costs[t1*tag_names.size() + t2]);
+  return 1;
 }
 
 void load_lua_description(lua_State *L, const char *fname)
 {
   luaL_openlibs(L);
+  lua_register(L, "type_cost", lua_type_cost);
+
+  luaL_newmetatable(L, "ne.entity");
+  lua_pushcfunction(L, entity_index);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
 
   if(luaL_loadfile(L, fname)) {
     fprintf(stderr, "Error loading %s: %s\n", fname, lua_tostring(L, -1));
@@ -277,22 +958,39 @@ void lua_get_global_function(lua_State *L, const char *fname)
 
 void lua_do_call(lua_State *L, const char *fname, int np, int nr)
 {
+  __sync_fetch_and_add(&lua_calls, 1);
   if(lua_pcall(L, np, nr, 0)) {
     fprintf(stderr, "Error calling %s: %s\n", fname, lua_tostring(L, -1));
     exit(1);
   }
 }
 
-void lua_load_error(lua_State *L, error_d &error, const char *fname)
+// Error names returned by a worker thread, interned afterwards in
+// the serial order so that the error ids do not depend on the
+// scheduling
+struct pending_error {
+  error_d *error;
+  list<string> names;
+};
+
+void intern_error(error_d &error, const list<string> &names)
+{
+  list<int> error_types;
+  for(list<string>::const_iterator i = names.begin(); i != names.end(); i++)
+    error_types.push_back(error_get(*i));
+  error_types.sort();
+  error.error_set = error_set_get(error_types);
+}
+
+void lua_load_error(lua_State *L, error_d &error, const char *fname, vector<pending_error> *pending = 0)
 {
   error.cost = lua_tonumber(L, 1);
   if(lua_isnil(L, 2))
     return;
-  if(lua_isstring(L, 2)) {
-    error.error_types.push_back(error_get(lua_tostring(L, 2)));
-    return;
-  }
-  if(lua_istable(L, 2)) {
+  list<string> names;
+  if(lua_isstring(L, 2))
+    names.push_back(lua_tocxxstring(L, 2));
+  else if(lua_istable(L, 2)) {
     lua_pushvalue(L, 2);
     for(int i=1;;i++) {
       lua_rawgeti(L, 2, i);
@@ -303,15 +1001,121 @@ void lua_load_error(lua_State *L, error_d &error, const char *fname)
 	fprintf(stderr, "Error in lua description: %s should return an array of error names and entry %d is not a string.\n", fname, i);
 	exit(1);
       }
-      error.error_types.push_back(error_get(err));
+      names.push_back(err);
       lua_pop(L, 1);
     }
     lua_pop(L, 2);
-    error.error_types.sort();
+  } else {
+    fprintf(stderr, "Error in lua description: %s should return as a second paramter nothing, a string or an array of strings.", fname);
+    exit(1);
+  }
+
+  if(pending) {
+    pending->resize(pending->size()+1);
+    pending->back().error = &error;
+    pending->back().names.swap(names);
+  } else
+    intern_error(error, names);
+}
+
+// Precompute the type substitution costs.  The optional
+// get_type_tree of the description returns a { type = parent } table,
+// parents need not be tags.  Two types then cost the length of the
+// path between them through their lowest common ancestor over the sum
+// of their depths, unless get_type_cost(type1, type2, up1, up2) gives
+// it from the number of levels up to that ancestor.  Without a tree
+// types cost 0 when equal, 1 otherwise.
+void load_type_tree(lua_State *L)
+{
+  unsigned int nt = tag_names.size();
+  type_costs.assign(nt*nt, 1);
+  for(unsigned int i = 0; i != nt; i++)
+    type_costs[i*nt + i] = 0;
+
+  lua_getglobal(L, "get_type_tree");
+  if(!lua_isfunction(L, -1)) {
+    lua_pop(L, 1);
     return;
   }
-  fprintf(stderr, "Error in lua description: %s should return as a second paramter nothing, a string or an array of strings.", fname);
-  exit(1);
+  lua_do_call(L, "get_type_tree", 0, 1);
+  if(!lua_istable(L, -1)) {
+    fprintf(stderr, "Error in lua description: get_type_tree should return a table of type = parent type names.\n");
+    exit(1);
+  }
+
+  // Nodes are the tags, then the inner types only named as parents
+  vector<string> names = tag_names;
+  map<string, int> ids = tag_names_map;
+  vector<int> parent(nt, -1);
+  lua_pushnil(L);
+  while(lua_next(L, -2)) {
+    if(lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING) {
+      fprintf(stderr, "Error in lua description: get_type_tree should return a table of type = parent type names.\n");
+      exit(1);
+    }
+    int c = any_get(lua_tocxxstring(L, -2), names, ids);
+    int p = any_get(lua_tocxxstring(L, -1), names, ids);
+    parent.resize(names.size(), -1);
+    parent[c] = p;
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+
+  vector<int> depth(names.size());
+  for(unsigned int i = 0; i != names.size(); i++) {
+    depth[i] = 1;
+    for(int p = parent[i]; p != -1; p = parent[p])
+      if(++depth[i] > int(names.size())) {
+	fprintf(stderr, "Error in lua description: get_type_tree has a cycle through %s.\n", names[i].c_str());
+	exit(1);
+      }
+  }
+
+  lua_getglobal(L, "get_type_cost");
+  bool custom = lua_isfunction(L, -1);
+  lua_pop(L, 1);
+
+  for(unsigned int i = 0; i != nt; i++)
+    for(unsigned int j = 0; j != nt; j++) {
+      if(i == j)
+	continue;
+
+      // Climb to the lowest common ancestor, types without one meet
+      // at a virtual root above the tree
+      int a = i, b = j, ua = 0, ub = 0;
+      for(; depth[a] > depth[b]; ua++)
+	a = parent[a];
+      for(; depth[b] > depth[a]; ub++)
+	b = parent[b];
+      while(a != b) {
+	if(parent[a] == -1) {
+	  ua = depth[i];
+	  ub = depth[j];
+	  break;
+	}
+	a = parent[a];
+	b = parent[b];
+	ua++;
+	ub++;
+      }
+
+      double &c = type_costs[i*nt + j];
+      if(custom) {
+	lua_get_global_function(L, "get_type_cost");
+	lua_pushcxxstring(L, tag_names[i]);
+	lua_pushcxxstring(L, tag_names[j]);
+	lua_pushinteger(L, ua);
+	lua_pushinteger(L, ub);
+	lua_do_call(L, "get_type_cost", 4, 1);
+	if(!lua_isnumber(L, -1)) {
+	  fprintf(stderr, "Error in lua description: get_type_cost should return a number.\n");
+	  exit(1);
+	}
+	c = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+      } else
+	c = double(ua + ub)/(depth[i] + depth[j]);
+    }
 }
 
 void load_tag_list(lua_State *L)
@@ -334,6 +1138,122 @@ void load_tag_list(lua_State *L)
     lua_pop(L, 1);
   }
   lua_pop(L, 2);
+  build_tag_hash();
+  load_type_tree(L);
+}
+
+// Parallel costing, one lua state per worker thread, all loaded from
+// the same description.  Work is handed out in chunks of items, each
+// chunk keeps its own list of error names to intern.
+static vector<lua_State *> lua_pool;
+
+void lua_pool_init(lua_State *L, const char *fname)
+{
+  lua_pool.push_back(L);
+  for(int i=1; i < opt_jobs; i++) {
+    lua_State *L1 = luaL_newstate();
+    load_lua_description(L1, fname);
+    lua_pool.push_back(L1);
+  }
+}
+
+void lua_pool_close()
+{
+  for(unsigned int i=1; i < lua_pool.size(); i++)
+    lua_close(lua_pool[i]);
+  lua_pool.clear();
+}
+
+// Run fn over [0, count) in chunks, chunks are handed out to opt_jobs
+// threads.  fn gets the worker number and the chunk number.
+typedef void (*parallel_fn)(unsigned int worker, unsigned int chunk, unsigned int first, unsigned int last, void *ctx);
+
+struct parallel_job {
+  parallel_fn fn;
+  void *ctx;
+  unsigned int count, chunk, next;
+};
+
+struct parallel_worker {
+  parallel_job *job;
+  unsigned int id;
+};
+
+static void *parallel_worker_run(void *arg)
+{
+  parallel_worker *w = static_cast<parallel_worker *>(arg);
+  parallel_job *job = w->job;
+  for(;;) {
+    unsigned int c = __sync_fetch_and_add(&job->next, 1);
+    unsigned int first = c*job->chunk;
+    if(first >= job->count)
+      break;
+    unsigned int last = first + job->chunk < job->count ? first + job->chunk : job->count;
+    job->fn(w->id, c, first, last, job->ctx);
+  }
+  return 0;
+}
+
+void parallel_for(parallel_fn fn, void *ctx, unsigned int count, unsigned int chunk)
+{
+  parallel_job job;
+  job.fn = fn;
+  job.ctx = ctx;
+  job.count = count;
+  job.chunk = chunk;
+  job.next = 0;
+
+  unsigned int nw = opt_jobs;
+  if(nw > (count + chunk - 1)/chunk)
+    nw = (count + chunk - 1)/chunk;
+  vector<parallel_worker> workers(nw ? nw : 1);
+  vector<pthread_t> threads(workers.size());
+  for(unsigned int i=0; i != workers.size(); i++) {
+    workers[i].job = &job;
+    workers[i].id = i;
+  }
+  for(unsigned int i=1; i != workers.size(); i++)
+    if(pthread_create(&threads[i], 0, parallel_worker_run, &workers[i])) {
+      perror("pthread_create");
+      exit(1);
+    }
+  parallel_worker_run(&workers[0]);
+  for(unsigned int i=1; i != workers.size(); i++)
+    pthread_join(threads[i], 0);
+}
+
+// Costing on the lua pool, each chunk keeps its own list of error
+// names to intern when running in parallel
+typedef void (*cost_range_fn)(lua_State *L, unsigned int first, unsigned int last, void *ctx, vector<pending_error> *pending);
+
+struct parallel_costs_ctx {
+  cost_range_fn fn;
+  void *ctx;
+  vector<vector<pending_error> > pending;
+};
+
+static void parallel_costs_chunk(unsigned int worker, unsigned int chunk, unsigned int first, unsigned int last, void *_ctx)
+{
+  parallel_costs_ctx *ctx = static_cast<parallel_costs_ctx *>(_ctx);
+  ctx->fn(lua_pool[worker], first, last, ctx->ctx, &ctx->pending[chunk]);
+}
+
+void parallel_costs(cost_range_fn fn, void *ctx, unsigned int count, unsigned int chunk)
+{
+  if(lua_pool.size() <= 1 || count <= chunk) {
+    fn(lua_pool[0], 0, count, ctx, 0);
+    return;
+  }
+
+  parallel_costs_ctx pctx;
+  pctx.fn = fn;
+  pctx.ctx = ctx;
+  pctx.pending.resize((count + chunk - 1)/chunk);
+  parallel_for(parallel_costs_chunk, &pctx, count, chunk);
+
+  for(unsigned int c=0; c != pctx.pending.size(); c++)
+    for(vector<pending_error>::const_iterator i = pctx.pending[c].begin(); i != pctx.pending[c].end(); i++)
+      intern_error(*i->error, i->names);
 }
 
 
@@ -343,11 +1263,11 @@ void load_tag_list(lua_State *L)
 #define step_test() do { if(*p == '\n') { line++; col = 0; } else col++; } while(0)
 #define advance_on(expr) do { while(expr) { step_test(); p++; } } while(0)
 
-void xml_extract_tags(list<simple_tag> &tags, char *data, const char *fname)
+void xml_extract_tags(list<simple_tag> &tags, char *data, const char *fname, int line = 1)
 {
   const char *p = data;
   char *q = data;
-  int line = 1, col = 0;
+  int col = 0;
   while(*p) {
     while(*p && (*p != '<' || ((p[1] < 'a' || p[1] > 'z') && p[1] != '/'))) {
       step_test();
@@ -373,11 +1293,9 @@ void xml_extract_tags(list<simple_tag> &tags, char *data, const char *fname)
 
     const char *tstart = p;
     advance_on(*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '>');
-    string tag(tstart, p);
-
-    int tid = tag_find(tag);
+    int tid = tag_find(tstart, p);
     if(tid != -1) {
-      list<pair<string, string> > attr;
+      list<pair<int, int> > attr;
 
       while(*p && *p != '>') {
 	advance_on(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n');
@@ -389,7 +1307,7 @@ void xml_extract_tags(list<simple_tag> &tags, char *data, const char *fname)
 
 	if(!*p || *p == '>') {
 	  if(!attr_type.empty())
-	    attr.push_back(pair<string, string>(attr_type, ""));
+	    attr.push_back(pair<int, int>(attr_get(attr_type), attr_get("")));
 	  break;
 	}
 	      
@@ -399,7 +1317,7 @@ void xml_extract_tags(list<simple_tag> &tags, char *data, const char *fname)
 	}
 
 	if(*p != '=') {
-	  attr.push_back(pair<string, string>(attr_type, ""));
+	  attr.push_back(pair<int, int>(attr_get(attr_type), attr_get("")));
 	  continue;
 	}
 
@@ -429,7 +1347,7 @@ void xml_extract_tags(list<simple_tag> &tags, char *data, const char *fname)
 	  advance_on(*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '>');
 	  value = string(tstart, p);
 	}
-	attr.push_back(pair<string, string>(attr_type, value));
+	attr.push_back(pair<int, int>(attr_get(attr_type), attr_get(value)));
       }
 
       if(!*p) {
@@ -496,7 +1414,7 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
       int val_parent = -1;
 
 
-      list<pair<string, string> > attr;
+      list<pair<int, int> > attr;
 
       while(*p && (*p != '/' || p[1] != '>')) {
 	advance_on(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n');
@@ -514,7 +1432,7 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	  exit(1);
 	}
 
-	string value;
+	const char *vstart = p, *vend = p;
 	if(*p == '=') {
 	  p++;
 	  col++;
@@ -532,14 +1450,16 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	      fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, missing closing quote.\n", fname, sline, scol);
 	      exit(1);
 	    }
-	    value = string(tstart, p);
+	    vstart = tstart;
+	    vend = p;
 	    p++;
 	    col++;
 	    
 	  } else {
 	    tstart = p;
 	    advance_on(*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '>' && *p != '/');
-	    value = string(tstart, p);
+	    vstart = tstart;
+	    vend = p;
 	  }
 	}
 
@@ -549,7 +1469,7 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	    exit(1);
 	  }
 	  has_id = true;
-	  val_id = strtol(value.c_str(), 0, 10);
+	  val_id = strtol(vstart, 0, 10);
 
 	} else if(type == "type") {
 	  if(has_tagid) {
@@ -557,9 +1477,9 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	    exit(1);
 	  }
 	  has_tagid = true;
-	  val_tagid = tag_find(value);
+	  val_tagid = tag_find(vstart, vend);
 	  if(val_tagid == -1) {
-	    fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, unknown type %s.\n", fname, sline, scol, value.c_str());
+	    fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, unknown type %.*s.\n", fname, sline, scol, int(vend - vstart), vstart);
 	    exit(1);
 	  }
 
@@ -568,6 +1488,7 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	    fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, duplicate ftype.\n", fname, sline, scol);
 	    exit(1);
 	  }
+	  string value(vstart, vend);
 	  if(value != "s" && value != "e" && value != "se") {
 	    fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, unknown ftype %s.\n", fname, sline, scol, value.c_str());
 	    exit(1);
@@ -582,7 +1503,7 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	    exit(1);
 	  }
 
-	  val_depth = strtol(value.c_str(), 0, 10);
+	  val_depth = strtol(vstart, 0, 10);
 
 	} else if(type == "parent") {
 	  if(has_parent) {
@@ -590,10 +1511,10 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	    exit(1);
 	  }
 
-	  val_parent = strtol(value.c_str(), 0, 10);
+	  val_parent = strtol(vstart, 0, 10);
 
 	} else {
-	  fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, unknown attribute type %s.\n", fname, sline, scol, value.c_str());
+	  fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, unknown attribute type %.*s.\n", fname, sline, scol, int(vend - vstart), vstart);
 	  exit(1);
 	}
       }
@@ -659,7 +1580,7 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
       int val_depth = 0;
       int val_parent = -1;
 
-      list<pair<string, string> > attr;
+      list<pair<int, int> > attr;
 
       while(*p && (*p != '/' || p[1] != '>')) {
 	advance_on(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n');
@@ -677,7 +1598,7 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	  exit(1);
 	}
 
-	string value;
+	const char *vstart = p, *vend = p;
 	if(*p == '=') {
 	  p++;
 	  col++;
@@ -695,14 +1616,16 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	      fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, missing closing quote.\n", fname, sline, scol);
 	      exit(1);
 	    }
-	    value = string(tstart, p);
+	    vstart = tstart;
+	    vend = p;
 	    p++;
 	    col++;
 	    
 	  } else {
 	    tstart = p;
 	    advance_on(*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '>' && *p != '/');
-	    value = string(tstart, p);
+	    vstart = tstart;
+	    vend = p;
 	  }
 	}
 
@@ -712,7 +1635,7 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	    exit(1);
 	  }
 	  has_id = true;
-	  val_id = strtol(value.c_str(), 0, 10);
+	  val_id = strtol(vstart, 0, 10);
 
 	} else if(type == "type") {
 	  if(has_tagid) {
@@ -720,9 +1643,9 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	    exit(1);
 	  }
 	  has_tagid = true;
-	  val_tagid = tag_find(value);
+	  val_tagid = tag_find(vstart, vend);
 	  if(val_tagid == -1) {
-	    fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, unknown type %s.\n", fname, sline, scol, value.c_str());
+	    fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, unknown type %.*s.\n", fname, sline, scol, int(vend - vstart), vstart);
 	    exit(1);
 	  }
 
@@ -731,6 +1654,7 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	    fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, duplicate ftype.\n", fname, sline, scol);
 	    exit(1);
 	  }
+	  string value(vstart, vend);
 	  if(value != "s" && value != "e" && value != "se") {
 	    fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, unknown ftype %s.\n", fname, sline, scol, value.c_str());
 	    exit(1);
@@ -745,7 +1669,7 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	    exit(1);
 	  }
 
-	  val_depth = strtol(value.c_str(), 0, 10);
+	  val_depth = strtol(vstart, 0, 10);
 
 	} else if(type == "parent") {
 	  if(has_parent) {
@@ -753,10 +1677,10 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 	    exit(1);
 	  }
 
-	  val_parent = strtol(value.c_str(), 0, 10);
+	  val_parent = strtol(vstart, 0, 10);
 
 	} else {
-	  fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, unknown attribute type %s.\n", fname, sline, scol, value.c_str());
+	  fprintf(stderr, "%s:%d:%d: Error: Malformed annotation, unknown attribute type %.*s.\n", fname, sline, scol, int(vend - vstart), vstart);
 	  exit(1);
 	}
       }
@@ -782,61 +1706,224 @@ void aref_extract_tags(list<aref_tag> &tags, char *data, const char *fname)
 #undef step_test
 #undef advance_on
 
-// Load an annotated file and extract its tags
-void annotated_file_load(const char *name, list<simple_tag> &tags, char *&data)
+// One step of the O(ND) diff: pick the furthest reaching predecessor
+// of diagonal k in the previous round (down for an inserted hyp
+// character, right for a deleted ref one) and return the x it leads
+// to, -1 if none stays within the n x m edit graph
+static int resync_step(const vector<int> &pv, int off, int k, int n, int m, bool &down)
 {
-  data = file_load(name);
-  xml_extract_tags(tags, data, name);
+  int xd = pv[off+k+1];
+  int xr = pv[off+k-1];
+  if(xd != -1 && xd-k > m)
+    xd = -1;
+  if(xr != -1 && xr+1 > n)
+    xr = -1;
+  if(xd == -1 && xr == -1)
+    return -1;
+  down = xr == -1 || (xd != -1 && xr < xd);
+  return down ? xd : xr+1;
 }
 
-// Load an annotated file and extract its tags
-void aref_file_load(const char *name, list<aref_tag> &tags, char *&data)
+// Line ends for the resynchronization, a CR alone counts as one
+static inline bool line_end(const char *p)
 {
-  data = file_load(name);
-  aref_extract_tags(tags, data, name);
+  return *p == '\n' || (*p == '\r' && p[1] != '\n');
 }
 
-// Align pos-extraction reference and hypothesis to sync the hypothesis tag positions
-void align_and_reposition(const char *ref_data, const char *hyp_data, list<simple_tag> &hyp_tags)
+// First non-blank character after a line end, 0 at the end of the
+// text
+static inline char next_text(const char *p)
 {
-  const char *rp = ref_data, *hp = hyp_data;
-  list<simple_tag>::iterator i = hyp_tags.begin();
-  int ref_line = 1, hyp_line = 1;
-  for(;;) {
-    const char *hd = i != hyp_tags.end() ? hyp_data + i->pos : 0;
-    while((*rp || *hp) && hp != hd) {
-      char rc = *rp;
-      if(rc == ' ' || rc == '\t' || rc == '\r' || rc == '\n') {
-	if(rc == '\n')
-	  ref_line++;
+  while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+    p++;
+  return *p;
+}
+
+// Resynchronize ref and hyp after a mismatch.  The remainders of the
+// current lines are compared, blanks excluded, with a Myers O(ND) diff
+// limited to opt_resync edits, and the hyp tags falling in the lines
+// are moved to the matching ref positions.  Returns the number of
+// edits, -1 if the lines are too different.
+int resync_lines(const char *ref_data, const char *hyp_data, const char *&rp, const char *&hp, list<simple_tag> &hyp_tags, list<simple_tag>::iterator &i)
+{
+  const char *re = rp, *he = hp;
+  vector<text_pos> ro, ho;
+  for(; *re && !line_end(re); re++)
+    if(*re != ' ' && *re != '\t' && *re != '\r')
+      ro.push_back(re - ref_data);
+  for(; *he && !line_end(he); he++)
+    if(*he != ' ' && *he != '\t' && *he != '\r')
+      ho.push_back(he - hyp_data);
+
+  int n = ro.size(), m = ho.size();
+  int dmax = opt_resync;
+  if(dmax > n+m)
+    dmax = n+m;
+
+  // Forward pass, keeping the furthest reaching x per diagonal k for
+  // every edit count d, diagonals offset by dmax+1, -1 if unreachable
+  vector<vector<int> > trace;
+  vector<int> v(2*dmax+3, -1);
+  int d;
+  bool down;
+  for(d = 0; d <= dmax; d++) {
+    vector<int> pv = v;
+    for(int k = -d; k <= d; k += 2) {
+      int x = d ? resync_step(pv, dmax+1, k, n, m, down) : 0;
+      if(x == -1) {
+	v[dmax+1+k] = -1;
+	continue;
+      }
+      int y = x-k;
+      while(x < n && y < m && ref_data[ro[x]] == hyp_data[ho[y]]) {
+	x++;
+	y++;
+      }
+      v[dmax+1+k] = x;
+      if(x == n && y == m) {
+	trace.push_back(pv);
+	goto found;
+      }
+    }
+    trace.push_back(pv);
+  }
+  return -1;
+
+ found:
+  // Backtrack the edit script, mapping every hyp character to the ref
+  // character it matches, or to the next ref character when inserted
+  vector<int> hmap(m+1);
+  hmap[m] = n;
+  int x = n, y = m;
+  for(int dd = d; dd >= 0; dd--) {
+    int px = 0, py = 0, sx = 0;
+    if(dd) {
+      int k = x-y;
+      px = resync_step(trace[dd], dmax+1, k, n, m, down);
+      px = down ? px : px-1;
+      py = px - (down ? k+1 : k-1);
+      sx = down ? px : px+1;
+    }
+    while(x > sx) {
+      x--;
+      y--;
+      hmap[y] = x;
+    }
+    if(dd && down)
+      hmap[py] = px;
+    x = px;
+    y = py;
+  }
+
+  // Move the tags within the hyp lines
+  for(; i != hyp_tags.end() && hyp_data + i->pos <= he; i++) {
+    int hidx = lower_bound(ho.begin(), ho.end(), i->pos) - ho.begin();
+    int ridx = hmap[hidx];
+    i->pos = ridx < n ? ro[ridx] : re - ref_data;
+  }
+
+  rp = re;
+  hp = he;
+  return d;
+}
+
+// Align pos-extraction reference and hypothesis to sync the hypothesis tag positions
+void align_and_reposition(const char *ref_data, const char *hyp_data, list<simple_tag> &hyp_tags, int ref_line = 1, int hyp_line = 1)
+{
+  const char *rp = ref_data, *hp = hyp_data;
+  list<simple_tag>::iterator i = hyp_tags.begin();
+  int resynced = 0;
+  bool ref_blank = true, hyp_blank = true;  // Nothing but blanks yet on the current lines
+  for(;;) {
+    const char *hd = i != hyp_tags.end() ? hyp_data + i->pos : 0;
+    while((*rp || *hp) && hp != hd) {
+      // With -r the lines are kept in step, so that a mismatch is
+      // resynchronized against the corresponding line.  Blank lines
+      // are skipped on either side, the end of the text ends the
+      // last line, and a line break against other text is still a
+      // blank when the text goes on identically after it.
+      char rc = *rp;
+      bool rl = line_end(rp);
+      if(rc == ' ' || rc == '\t' || (rc == '\r' && !rl) || (rl && (!opt_resync || ref_blank))) {
+	if(rc == '\n')
+	  ref_line++;
 	rp++;
 	continue;
       }
 
       char hc = *hp;
-      if(hc == ' ' || hc == '\t' || hc == '\r' || hc == '\n') {
+      bool hl = line_end(hp);
+      if(hc == ' ' || hc == '\t' || (hc == '\r' && !hl) || (hl && (!opt_resync || hyp_blank))) {
+	if(hc == '\n')
+	  hyp_line++;
+	hp++;
+	continue;
+      }
+
+      if((rl || !rc) && (hl || !hc)) {
+	if(rc == '\n')
+	  ref_line++;
+	if(hc == '\n')
+	  hyp_line++;
+	if(rc)
+	  rp++;
+	if(hc)
+	  hp++;
+	ref_blank = hyp_blank = true;
+	continue;
+      }
+
+      if(rl && next_text(rp) == hc) {
+	if(rc == '\n')
+	  ref_line++;
+	rp++;
+	ref_blank = true;
+	continue;
+      }
+
+      if(hl && next_text(hp) == rc) {
 	if(hc == '\n')
 	  hyp_line++;
 	hp++;
+	hyp_blank = true;
 	continue;
       }
 
       if(rc != hc) {
-	char buf[64*5+1];
-	fprintf(stderr, "Mismatch when aligning ref and hyp, hyp line %d, ref line %d:\n", ref_line, hyp_line);
-	escape(buf, rp < ref_data-8 ? ref_data : rp-8, 64);
-	fprintf(stderr, "  ref:  [%s]\n", buf);
-	escape(buf, hp < hyp_data-8 ? hyp_data : hp-8, 64);
-	fprintf(stderr, "  hyp:  [%s]\n", buf);
-	exit(1);
+	char rbuf[64*5+1], hbuf[64*5+1];
+	escape(rbuf, rp - ref_data < 8 ? ref_data : rp-8, 64);
+	escape(hbuf, hp - hyp_data < 8 ? hyp_data : hp-8, 64);
+	const char *orp = rp, *ohp = hp;
+	int edits = opt_resync ? resync_lines(ref_data, hyp_data, rp, hp, hyp_tags, i) : -1;
+	if(edits != -1 && rp == orp && hp == ohp)
+	  edits = -1;
+	if(edits == -1) {
+	  fprintf(stderr, "Mismatch when aligning ref and hyp, ref line %d, hyp line %d:\n", ref_line, hyp_line);
+	  fprintf(stderr, "  ref:  [%s]\n", rbuf);
+	  fprintf(stderr, "  hyp:  [%s]\n", hbuf);
+	  if(opt_resync)
+	    fprintf(stderr, "  more than %d edits, cannot resynchronize\n", opt_resync);
+	  exit(1);
+	}
+	fprintf(stderr, "Resynchronized ref line %d and hyp line %d, %d edits:\n", ref_line, hyp_line, edits);
+	fprintf(stderr, "  ref:  [%s]\n", rbuf);
+	fprintf(stderr, "  hyp:  [%s]\n", hbuf);
+	resynced++;
+	ref_blank = hyp_blank = false;
+	hd = i != hyp_tags.end() ? hyp_data + i->pos : 0;
+	continue;
       }
       rp++;
       hp++;
+      ref_blank = hyp_blank = false;
     }
 
     // Exit when all tags have been repositioned *and* the end of oth files is reached
-    if(!hd)
+    if(!hd) {
+      if(resynced)
+	fprintf(stderr, "%d utterance(s) resynchronized\n", resynced);
       break;
+    }
 
     // Reaching the end of both files but not one of the extracted tags is in the "can't happen" category
     assert(hp == hd);
@@ -847,9 +1934,9 @@ void align_and_reposition(const char *ref_data, const char *hyp_data, list<simpl
 
 
 // Build entities from tags
-void build_entities_from_tags(vector<entity> &entities, const list<simple_tag> &tags, const char *fname, bool hyp)
+void build_entities_from_tags(entity_store &es, const list<simple_tag> &tags, const char *fname, bool hyp)
 {
-  list<int> stack;
+  list<entity_id> stack;
   for(list<simple_tag>::const_iterator i = tags.begin(); i != tags.end(); i++) {
     if(i->closing) {
       if(stack.empty()) {
@@ -857,68 +1944,70 @@ void build_entities_from_tags(vector<entity> &entities, const list<simple_tag> &
 		fname, i->line, i->col, tag_names[i->tagid].c_str());
 	exit(1);
       }
-      if(entities[stack.back()].tagid != i->tagid) {
+      if(es.tagid[stack.back()] != i->tagid) {
 	fprintf(stderr, "%s:%d:%d: Found closing %s tag for an opening %s tag.\n",
-		fname, i->line, i->col, tag_names[i->tagid].c_str(), tag_names[entities[stack.back()].tagid].c_str());
+		fname, i->line, i->col, tag_names[i->tagid].c_str(), tag_names[es.tagid[stack.back()]].c_str());
 	exit(1);
       }
-      entities[stack.back()].end.push_back(i->pos);
+      es.add_end(stack.back(), i->pos);
       stack.pop_back();
     } else {
-      int eid = entities.size();
-      entities.push_back(entity(i->tagid, i->line, i->col, stack.size(), hyp, i->attr));
-      entities[eid].start.push_back(i->pos);
-      stack.push_back(eid);      
+      entity_id eid = es.add(i->tagid, i->line, i->col, stack.size(), hyp, i->attr);
+      es.add_start(eid, i->pos);
+      stack.push_back(eid);
     }
   }
   if(!stack.empty()) {
     fprintf(stderr, "%s: Missing closing tag for %s (line %d) at end of file.\n",
-	    fname, tag_names[entities[stack.back()].tagid].c_str(), entities[stack.back()].line);
+	    fname, tag_names[es.tagid[stack.back()]].c_str(), es.line[stack.back()]);
     exit(1);    
   }
+  es.commit_frontiers();
 }
 
-void build_entities_from_tags(vector<entity> &entities, const list<aref_tag> &tags, const char *fname, bool hyp)
+void build_entities_from_tags(entity_store &es, const list<aref_tag> &tags, const char *fname, bool hyp)
 {
   int max_id = 0;
   for(list<aref_tag>::const_iterator i = tags.begin(); i != tags.end(); i++)
     if(i->id > max_id)
       max_id = i->id;
 
-  entities.resize(max_id+1);
+  entity_id base = es.size();
+  es.resize(base+max_id+1);
 
-  vector<entity *> entity_per_depth;
+  vector<entity_id> entity_per_depth;
   for(list<aref_tag>::const_iterator i = tags.begin(); i != tags.end(); i++) {
-    int eid = i->id;
-    if(entities[eid].tagid == -1) {
-      entities[eid].tagid = i->tagid;
-      entities[eid].line = i->line;
-      entities[eid].col = i->col;
-      entities[eid].depth = i->depth;
-      entities[eid].parent = i->parent == -1 ? 0 : &entities[i->parent];
-      entities[eid].attr = i->attr;
-      entities[eid].hyp = hyp;
-      if(int(entity_per_depth.size()) > i->depth && entity_per_depth[i->depth]->parent == entities[eid].parent)
-	entities[eid].left_constraint = entity_per_depth[i->depth];
+    entity_id eid = base + i->id;
+    if(es.tagid[eid] == -1) {
+      es.tagid[eid] = i->tagid;
+      es.line[eid] = i->line;
+      es.col[eid] = i->col;
+      es.depth[eid] = i->depth;
+      es.parent[eid] = i->parent == -1 ? NO_ENTITY : base + i->parent;
+      es.set_attr(eid, i->attr);
+      es.hyp[eid] = hyp;
+      if(int(entity_per_depth.size()) > i->depth && es.parent[entity_per_depth[i->depth]] == es.parent[eid])
+	es.left_constraint[eid] = entity_per_depth[i->depth];
       else
-	entities[eid].left_constraint = 0;
+	es.left_constraint[eid] = NO_ENTITY;
       if(int(entity_per_depth.size()) <= i->depth)
 	entity_per_depth.resize(i->depth+1);
-      entity_per_depth[i->depth] = &entities[eid];
+      entity_per_depth[i->depth] = eid;
     }
     if(i->opening)
-      entities[eid].start.push_back(i->pos);
+      es.add_start(eid, i->pos);
     if(i->closing)
-      entities[eid].end.push_back(i->pos);
+      es.add_end(eid, i->pos);
   }
+  es.commit_frontiers();
 }
 
 // Tighten entity frontiers so that they do not include whitespace
-void refine_entities(vector<entity> &entities, const char *data, const char *fname)
+void refine_entities(entity_store &es, entity_id first, entity_id last, const char *data, const char *fname)
 {
-  for(unsigned int i = 0; i != entities.size(); i++) {
-    for(vector<int>::iterator j = entities[i].start.begin(); j != entities[i].start.end(); j++) {
-      int s = *j;
+  for(entity_id i = first; i != last; i++) {
+    for(unsigned int j = 0; j != es.nstart(i); j++) {
+      text_pos s = es.start(i, j);
 
       while(data[s]) {
 	char c = data[s];
@@ -926,11 +2015,11 @@ void refine_entities(vector<entity> &entities, const char *data, const char *fna
 	  break;
 	s++;
       }
-      *j = s;
+      es.start(i, j) = s;
     }
 
-    for(vector<int>::iterator j = entities[i].end.begin(); j != entities[i].end.end(); j++) {
-      int e = *j;
+    for(unsigned int j = 0; j != es.nend(i); j++) {
+      text_pos e = es.end(i, j);
 
       while(e>0) {
 	char c = data[e-1];
@@ -938,43 +2027,57 @@ void refine_entities(vector<entity> &entities, const char *data, const char *fna
 	  break;
 	e--;
       }
-      *j = e;
+      es.end(i, j) = e;
     }
 
 #if 0
     fprintf(stderr, "%s:%d:%d: tag %s %d start=(",
-	    fname, entities[i].line, entities[i].col, tag_names[entities[i].tagid].c_str(), i);
-    for(vector<int>::iterator j = entities[i].start.begin(); j != entities[i].start.end(); j++)
-      fprintf(stderr, " %d", *j);
+	    fname, es.line[i], es.col[i], tag_names[es.tagid[i]].c_str(), i);
+    for(unsigned int j = 0; j != es.nstart(i); j++)
+      fprintf(stderr, " %lld", (long long)es.start(i, j));
     fprintf(stderr, " ) end=(");
-    for(vector<int>::iterator j = entities[i].end.begin(); j != entities[i].end.end(); j++)
-      fprintf(stderr, " %d", *j);
+    for(unsigned int j = 0; j != es.nend(i); j++)
+      fprintf(stderr, " %lld", (long long)es.end(i, j));
     fprintf(stderr, " )\n");
 #endif
 
-    for(int s = entities[i].start.front(); !entities[i].end.empty() && entities[i].end.front() <= s; entities[i].end.erase(entities[i].end.begin()));
-    if(entities[i].end.empty()) {
+    for(text_pos s = es.first_start(i); es.nends[i] && es.first_end(i) <= s; es.end_ofs[i]++, es.nends[i]--);
+    if(!es.nends[i]) {
+      // Resynchronization may leave a hyp tag around text absent from the ref
+      if(opt_resync && es.hyp[i]) {
+	fprintf(stderr, "%s:%d:%d: Empty tag %s after resynchronization, dropped.\n",
+		fname, es.line[i], es.col[i], tag_names[es.tagid[i]].c_str());
+	es.erase(i);
+	i--;
+	last--;
+	continue;
+      }
       fprintf(stderr, "%s:%d:%d: Empty tag %s.\n",
-	      fname, entities[i].line, entities[i].col, tag_names[entities[i].tagid].c_str());
+	      fname, es.line[i], es.col[i], tag_names[es.tagid[i]].c_str());
       exit(1);
     }
 
-    for(int e = entities[i].end.back(); !entities[i].start.empty() && entities[i].start.back() >= e; entities[i].start.erase(entities[i].start.end()-1));
+    for(text_pos e = es.last_end(i); es.nstarts[i] && es.last_start(i) >= e; es.nstarts[i]--);
   }
 }
 
-void compute_entities_miss_costs(lua_State *L, vector<entity> &entities, const char *data)
+struct miss_costs_ctx {
+  entity_store *es;
+  const char *data;
+};
+
+static void miss_costs_range(lua_State *L, unsigned int first, unsigned int last, void *_ctx, vector<pending_error> *pending)
 {
-  for(unsigned int i = 0; i != entities.size(); i++) {
-    entities[i].miss_errors.resize(entities[i].start.size());
-    for(unsigned int j=0; j != entities[i].start.size(); j++) {
-      entities[i].miss_errors[j].resize(entities[i].end.size());
-      for(unsigned int k=0; k != entities[i].end.size(); k++) {
-	if(entities[i].start[j] < entities[i].end[k]) {
+  miss_costs_ctx *ctx = static_cast<miss_costs_ctx *>(_ctx);
+  entity_store &es = *ctx->es;
+  for(entity_id i = first; i != last; i++) {
+    for(unsigned int j=0; j != es.nstart(i); j++) {
+      for(unsigned int k=0; k != es.nend(i); k++) {
+	if(es.start(i, j) < es.end(i, k) && es.feasible(i, j, k)) {
 	  lua_get_global_function(L, "get_miss_cost");
-	  lua_pushentity(L, &entities[i], j, k, data);
+	  lua_pushentity(L, es, i, j, k, ctx->data);
 	  lua_do_call(L, "get_miss_cost", 1, 2);
-	  lua_load_error(L, entities[i].miss_errors[j][k], "get_miss_cost");
+	  lua_load_error(L, es.miss_error(i, j, k), "get_miss_cost", pending);
 	  lua_pop(L, 2);
 	}
       }
@@ -982,106 +2085,343 @@ void compute_entities_miss_costs(lua_State *L, vector<entity> &entities, const c
   }
 }
 
-void add_frontiers(map<int, list<entity *> > &frontiers, vector<entity> &entities)
+void alloc_miss_costs(entity_store &es)
 {
-  for(unsigned int i = 0; i != entities.size(); i++) {
-    entity *e = &entities[i];
-    for(vector<int>::const_iterator j = e->start.begin(); j != e->start.end(); j++)
-      frontiers[*j].push_back(e);
-    for(vector<int>::const_iterator j = e->end.begin(); j != e->end.end(); j++)
-      frontiers[*j].push_back(e);
+  es.miss_ofs.resize(es.size());
+  unsigned int ofs = 0;
+  for(entity_id i = 0; i != es.size(); i++) {
+    es.miss_ofs[i] = ofs;
+    ofs += es.nstart(i)*es.nend(i);
   }
+  es.miss_pool.resize(ofs);
 }
 
-void build_segments(vector<segment> &segments, const map<int, list<entity *> > &frontiers)
+void compute_entities_miss_costs(entity_store &es, const char *data)
 {
-  if(!frontiers.size())
+  alloc_miss_costs(es);
+
+  miss_costs_ctx ctx;
+  ctx.es = &es;
+  ctx.data = data;
+  parallel_costs(miss_costs_range, &ctx, es.size(), 256);
+}
+
+// Arc consistency on the reference frontier alternatives (aref).
+// A (sf, ef) choice survives when the entity is not reversed and
+// each neighbour has a surviving choice compatible with it: the
+// parent containing it, every child inside it, the left sibling
+// ending before its start and the right sibling starting after its
+// end.  Every reference entity ends up instantiated, so a choice
+// without support can never be part of an alignment.  Frontiers left
+// without any choice are dropped, the other infeasible pairs are
+// marked so that the costing and the search skip them, and the first
+// surviving choice is the one scored for an unmapped entity, (0, 0)
+// may be gone.  Inconsistent annotations are left alone.
+// Does entity c keep a choice with its start in [slo, shi] and its
+// end in [elo, ehi] ?
+static bool has_choice(const entity_store &es, const vector<bool> &alive, entity_id c, text_pos slo, text_pos shi, text_pos elo, text_pos ehi)
+{
+  for(unsigned int sf = 0; sf != es.nstart(c); sf++)
+    for(unsigned int ef = 0; ef != es.nend(c); ef++)
+      if(alive[es.miss_ofs[c] + sf*es.nend(c) + ef] &&
+	 es.start(c, sf) >= slo && es.start(c, sf) <= shi && es.end(c, ef) >= elo && es.end(c, ef) <= ehi)
+	return true;
+  return false;
+}
+
+void prune_frontiers(entity_store &es, entity_id first_hyp)
+{
+  bool alternatives = false;
+  for(entity_id e = 0; e != first_hyp && !alternatives; e++)
+    alternatives = es.nstart(e) != 1 || es.nend(e) != 1;
+  if(!alternatives)
     return;
 
-  segments.resize(frontiers.size()-1);
-  set<entity *> current_entities;
-  int sid = 0;
-  map<int, list<entity *> >::const_iterator i = frontiers.begin();
-  for(;;) {
-    const list<entity *> &le = i->second;
-    int start = i->first;
-    i++;
-    if(i == frontiers.end())
-      break;
-    int end = i->first;
-
-    segment &s = segments[sid];
-    s.start = start;
-    s.end = end;
-
-    for(list<entity *>::const_iterator j = le.begin(); j != le.end(); j++) {
-      entity *e = *j;
-      current_entities.insert(e);
-      if(e->hyp) {
-	if(e->start.front() == start)
-	  s.starting_hyp_entities.push_back(e);
-      } else {
-	for(unsigned int k=0; k != e->start.size(); k++)
-	  if(e->start[k] == start)
-	    s.starting_ref_entities.push_back(segment::ef(e, k));
+  alloc_miss_costs(es);
+  vector<bool> alive(es.miss_pool.size());
+  vector<vector<entity_id> > children(first_hyp);
+  vector<entity_id> right(first_hyp, NO_ENTITY);
+  for(entity_id e = 0; e != first_hyp; e++) {
+    for(unsigned int sf = 0; sf != es.nstart(e); sf++)
+      for(unsigned int ef = 0; ef != es.nend(e); ef++)
+	alive[es.miss_ofs[e] + sf*es.nend(e) + ef] = es.start(e, sf) <= es.end(e, ef);
+    if(es.parent[e] != NO_ENTITY)
+      children[es.parent[e]].push_back(e);
+    if(es.left_constraint[e] != NO_ENTITY)
+      right[es.left_constraint[e]] = e;
+  }
 
-	for(unsigned int k=0; k != e->end.size(); k++)
-	  if(e->end[k] == end)
-	    s.ending_ref_entities.push_back(segment::ef(e, k));
-      }
+  bool changed = true;
+  while(changed) {
+    changed = false;
+    for(entity_id e = 0; e != first_hyp; e++) {
+      unsigned int n = 0;
+      for(unsigned int sf = 0; sf != es.nstart(e); sf++)
+	for(unsigned int ef = 0; ef != es.nend(e); ef++) {
+	  unsigned int idx = es.miss_ofs[e] + sf*es.nend(e) + ef;
+	  if(!alive[idx])
+	    continue;
+	  text_pos s = es.start(e, sf), en = es.end(e, ef);
+	  entity_id p = es.parent[e], l = es.left_constraint[e], r = right[e];
+	  bool ok = p == NO_ENTITY || has_choice(es, alive, p, 0, s, en, es.last_end(p));
+	  ok = ok && (l == NO_ENTITY || has_choice(es, alive, l, 0, s, 0, s));
+	  ok = ok && (r == NO_ENTITY || has_choice(es, alive, r, en, es.last_end(r), en, es.last_end(r)));
+	  for(vector<entity_id>::const_iterator c = children[e].begin(); ok && c != children[e].end(); c++)
+	    ok = has_choice(es, alive, *c, s, en, s, en);
+
+	  if(ok)
+	    n++;
+	  else {
+	    alive[idx] = false;
+	    changed = true;
+	  }
+	}
+      if(!n)
+	return;
     }
+  }
 
-    for(set<entity *>::iterator j = current_entities.begin(); j != current_entities.end();) {
-      s.entities.push_back(*j);
-      if((*j)->end.back() <= end) {
-	set<entity *>::iterator k = j;
-	j++;
-	current_entities.erase(k);
-      } else
-	j++;
+  // Compact the frontiers, keeping the order
+  es.miss_alt.assign(es.size(), 0);
+  for(entity_id e = 0; e != first_hyp; e++) {
+    unsigned int ns = 0, ne = 0;
+    vector<bool> keep_start(es.nstart(e)), keep_end(es.nend(e));
+    for(unsigned int sf = 0; sf != es.nstart(e); sf++)
+      for(unsigned int ef = 0; ef != es.nend(e); ef++)
+	if(alive[es.miss_ofs[e] + sf*es.nend(e) + ef])
+	  keep_start[sf] = keep_end[ef] = true;
+    vector<bool> grid;
+    bool found = false;
+    for(unsigned int sf = 0; sf != es.nstart(e); sf++)
+      if(keep_start[sf])
+	for(unsigned int ef = 0; ef != es.nend(e); ef++)
+	  if(keep_end[ef]) {
+	    bool a = alive[es.miss_ofs[e] + sf*es.nend(e) + ef];
+	    if(a && !found && es.start(e, sf) < es.end(e, ef)) {
+	      es.miss_alt[e] = grid.size();
+	      found = true;
+	    }
+	    grid.push_back(!a);
+	  }
+    for(unsigned int sf = 0; sf != es.nstart(e); sf++)
+      if(keep_start[sf])
+	es.start(e, ns++) = es.start(e, sf);
+    for(unsigned int ef = 0; ef != es.nend(e); ef++)
+      if(keep_end[ef])
+	es.end(e, ne++) = es.end(e, ef);
+    es.nstarts[e] = ns;
+    es.nends[e] = ne;
+    es.infeasible.insert(es.infeasible.end(), grid.begin(), grid.end());
+  }
+  for(entity_id e = first_hyp; e != es.size(); e++)
+    es.infeasible.insert(es.infeasible.end(), es.nstart(e)*es.nend(e), false);
+}
+
+// Cut the text at every frontier, sorted and deduplicated, then lay
+// out the lists of each segment as consecutive slices of the pool.
+// An entity is present from the segment of its first start to the
+// one starting on its last end, so that entities ending on s.end are
+// still listed in the next segment.
+static inline unsigned int segment_index(const vector<text_pos> &pos, text_pos p)
+{
+  return lower_bound(pos.begin(), pos.end(), p) - pos.begin();
+}
+
+template<class T> static void set_ranges(vector<segment> &segments, pool_range<T> segment::*r, const vector<T> &pool, const vector<unsigned int> &ofs)
+{
+  for(unsigned int i = 0; i != segments.size(); i++) {
+    (segments[i].*r).first = pool.empty() ? 0 : &pool[0] + ofs[i];
+    (segments[i].*r).count = ofs[i+1] - ofs[i];
+  }
+}
+
+void build_segments(vector<segment> &segments, segment_pool &sp, const entity_store &es)
+{
+  vector<text_pos> pos;
+  for(entity_id e = 0; e != es.size(); e++) {
+    for(unsigned int j = 0; j != es.nstart(e); j++)
+      pos.push_back(es.start(e, j));
+    for(unsigned int j = 0; j != es.nend(e); j++)
+      pos.push_back(es.end(e, j));
+  }
+  sort(pos.begin(), pos.end());
+  pos.erase(unique(pos.begin(), pos.end()), pos.end());
+  if(pos.empty())
+    return;
+
+  unsigned int ns = pos.size()-1;
+  segments.resize(ns);
+  for(unsigned int i = 0; i != ns; i++) {
+    segments[i].start = pos[i];
+    segments[i].end = pos[i+1];
+  }
+
+  // Counts per segment first, then offsets, then fill in entity order
+  vector<unsigned int> first(es.size()), last(es.size());
+  vector<unsigned int> eofs(ns+1), rofs(ns+1), hofs(ns+1);
+  vector<int> spanning(ns+1);
+  for(entity_id e = 0; e != es.size(); e++) {
+    first[e] = segment_index(pos, es.first_start(e));
+    last[e] = segment_index(pos, es.last_end(e));
+    if(last[e] != ns)
+      last[e]++;
+    spanning[first[e]]++;
+    spanning[last[e]]--;
+    if(es.hyp[e])
+      hofs[first[e]+1]++;
+    else
+      for(unsigned int j = 0; j != es.nstart(e); j++)
+	rofs[segment_index(pos, es.start(e, j))+1]++;
+  }
+  int n = 0;
+  for(unsigned int i = 0; i != ns; i++) {
+    n += spanning[i];
+    eofs[i+1] = eofs[i] + n;
+    rofs[i+1] += rofs[i];
+    hofs[i+1] += hofs[i];
+  }
+
+  sp.entities.resize(eofs[ns]);
+  sp.starting_ref.assign(rofs[ns], segment::ef(NO_ENTITY, 0));
+  sp.starting_hyp.resize(hofs[ns]);
+  vector<unsigned int> efill(eofs.begin(), eofs.end()-1), rfill(rofs.begin(), rofs.end()-1), hfill(hofs.begin(), hofs.end()-1);
+  for(entity_id e = 0; e != es.size(); e++) {
+    for(unsigned int i = first[e]; i != last[e]; i++)
+      sp.entities[efill[i]++] = e;
+    if(es.hyp[e])
+      sp.starting_hyp[hfill[first[e]]++] = e;
+    else
+      for(unsigned int j = 0; j != es.nstart(e); j++)
+	sp.starting_ref[rfill[segment_index(pos, es.start(e, j))]++] = segment::ef(e, j);
+  }
+
+  set_ranges(segments, &segment::entities, sp.entities, eofs);
+  set_ranges(segments, &segment::starting_ref_entities, sp.starting_ref, rofs);
+  set_ranges(segments, &segment::starting_hyp_entities, sp.starting_hyp, hofs);
+}
+
+// Cut the segments into independent groups and lay out their
+// substitution cost tensors
+void build_segment_groups(vector<segment_group> &groups, entity_store &es, const vector<segment> &segments)
+{
+  segment_group *g = 0;
+  text_pos group_end = 0;
+  for(unsigned int i = 0; i != segments.size(); i++) {
+    const segment &s = segments[i];
+    if(s.entities.empty())
+      continue;
+
+    if(!g) {
+      groups.resize(groups.size()+1);
+      g = &groups.back();
+      g->first = i;
+    }
+
+    for(const entity_id *j = s.entities.begin(); j != s.entities.end(); j++) {
+      entity_id e = *j;
+      vector<entity_id> &l = es.hyp[e] ? g->hyps : g->refs;
+      if(es.local_idx[e] >= l.size() || l[es.local_idx[e]] != e) {
+	es.local_idx[e] = l.size();
+	l.push_back(e);
+      }
+      if(es.last_end(e) > group_end)
+	group_end = es.last_end(e);
     }
 
-    sid++;    
+    // Entities ending on s.end are still listed in the next segment
+    if(group_end < s.end || i+1 == segments.size()) {
+      g->last = i+1;
+      size_t ofs = 0;
+      bool too_large = false;
+      g->blocks.resize(g->refs.size());
+      for(unsigned int j = 0; j != g->refs.size(); j++) {
+	entity_id er = g->refs[j];
+	segment_group::ref_block &b = g->blocks[j];
+	b.ofs = ofs;
+	b.sstride = es.nend(er);
+	b.hstride = es.nstart(er)*b.sstride;
+	if(b.hstride && g->hyps.size() > (g->subst.max_size() - ofs) / b.hstride)
+	  too_large = true;
+	else
+	  ofs += g->hyps.size()*b.hstride;
+      }
+      if(!too_large) {
+	try {
+	  g->subst.resize(ofs);
+	} catch(const std::bad_alloc &) {
+	  too_large = true;
+	}
+      }
+      if(too_large) {
+	fprintf(stderr, "Error: the group at %lld-%lld has too many substitution costs to store (%u references, %u hypotheses).\n",
+		(long long)segments[g->first].start, (long long)s.end, (unsigned int)g->refs.size(), (unsigned int)g->hyps.size());
+	exit(1);
+      }
+      g = 0;
+    }
   }
 }
 
-void compute_substitution_errors_costs(lua_State *L, vector<segment> &segments, const char *data)
+struct subst_costs_ctx {
+  entity_store *es;
+  const vector<segment> *segments;
+  vector<segment_group> *groups;
+  const char *data;
+};
+
+static void subst_costs_range(lua_State *L, unsigned int first, unsigned int last, void *_ctx, vector<pending_error> *pending)
 {
-  for(vector<segment>::iterator i = segments.begin(); i != segments.end(); i++)
-    for(vector<entity *>::iterator j = i->entities.begin(); j != i->entities.end(); j++) {
-      entity *eh = *j;
-      if(!eh->hyp)
-	continue;
-      for(vector<entity *>::iterator k = i->entities.begin(); k != i->entities.end(); k++) {
-	entity *er = *k;
-	if(er->hyp)
+  subst_costs_ctx *ctx = static_cast<subst_costs_ctx *>(_ctx);
+  entity_store &es = *ctx->es;
+  const vector<segment> &segments = *ctx->segments;
+  for(vector<segment_group>::iterator g = ctx->groups->begin() + first; g != ctx->groups->begin() + last; g++) {
+    vector<bool> done(g->refs.size()*g->hyps.size());
+    for(unsigned int i = g->first; i != g->last; i++) {
+      const segment &s = segments[i];
+      for(const entity_id *j = s.entities.begin(); j != s.entities.end(); j++) {
+	entity_id eh = *j;
+	if(!es.hyp[eh])
 	  continue;
-	if(er->subst_errors.find(eh) == er->subst_errors.end()) {
-	  er->subst_errors[eh].resize(er->start.size());
-	  int efc = er->end.size();
-	  vector<vector<error_d> > &evec = er->subst_errors[eh];
-	  for(unsigned int sf=0; sf != er->start.size(); sf++) {
-	    evec[sf].resize(efc);
-	    if(er->start[sf] >= eh->end[0])
+	for(const entity_id *k = s.entities.begin(); k != s.entities.end(); k++) {
+	  entity_id er = *k;
+	  if(es.hyp[er])
+	    continue;
+	  unsigned int lr = es.local_idx[er], lh = es.local_idx[eh];
+	  if(done[lr*g->hyps.size() + lh])
+	    continue;
+	  done[lr*g->hyps.size() + lh] = true;
+	  for(unsigned int sf=0; sf != es.nstart(er); sf++) {
+	    if(es.start(er, sf) >= es.first_end(eh))
 	      continue;
-	    for(unsigned int ef=0; ef != er->end.size(); ef++) {
-	      if(er->end[ef] < eh->start[0])
+	    for(unsigned int ef=0; ef != es.nend(er); ef++) {
+	      if(es.end(er, ef) < es.first_start(eh))
 		continue;
 
-	      if(er->start[sf] >= er->end[ef])
+	      if(es.start(er, sf) >= es.end(er, ef) || !es.feasible(er, sf, ef))
 		continue;
 
 	      lua_get_global_function(L, "get_substitution_cost");
-	      lua_pushentity(L, er, sf, ef, data);
-	      lua_pushentity(L, eh, 0, 0, data);
+	      lua_pushentity(L, es, er, sf, ef, ctx->data);
+	      lua_pushentity(L, es, eh, 0, 0, ctx->data);
 	      lua_do_call(L, "get_substitution_cost", 2, 2);
-	      lua_load_error(L, evec[sf][ef], "get_substitution_cost");
+	      lua_load_error(L, g->subst_error(lr, lh, sf, ef), "get_substitution_cost", pending);
 	      lua_pop(L, 2);
 	    }
 	  }
 	}
       }
     }
+  }
+}
+
+void compute_substitution_errors_costs(entity_store &es, const vector<segment> &segments, vector<segment_group> &groups, const char *data)
+{
+  subst_costs_ctx ctx;
+  ctx.es = &es;
+  ctx.segments = &segments;
+  ctx.groups = &groups;
+  ctx.data = data;
+  parallel_costs(subst_costs_range, &ctx, groups.size(), 64);
 }
 
 struct frontier_choice {
@@ -1095,81 +2435,272 @@ static inline bool operator!=(const frontier_choice &f1, const frontier_choice &
   return f1.sf != f2.sf || f1.ef != f2.ef;
 }
 
-int act_nodes = 0;
-struct align_node {
+// Profiling and tracing
+
+static double wall_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static double cpu_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+void trace_open(const char *fname)
+{
+  trace_file = fopen(fname, "w");
+  if(!trace_file) {
+    fprintf(stderr, "Error opening %s for writing\n", fname);
+    exit(1);
+  }
+  trace_origin = wall_time();
+  trace_first = true;
+  fprintf(trace_file, "{\"traceEvents\":[");
+}
+
+// Write a complete event, args is a json object body or 0
+void trace_event(const char *name, const char *cat, double start, double end, int tid, const char *args)
+{
+  pthread_mutex_lock(&trace_lock);
+  fprintf(trace_file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d",
+	  trace_first ? "" : ",", name, cat, (start - trace_origin)*1e6, (end - start)*1e6, tid);
+  if(args)
+    fprintf(trace_file, ",\"args\":{%s}", args);
+  fprintf(trace_file, "}");
+  trace_first = false;
+  pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_close()
+{
+  fprintf(trace_file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(trace_file);
+  trace_file = 0;
+}
+
+// Close the current phase and open the next one, -1 to stop
+void phase(int next)
+{
+  if(!opt_profile && !trace_file)
+    return;
+  double w = wall_time(), c = cpu_time();
+  if(current_phase != -1) {
+    phase_wall[current_phase] += w - phase_wall_start;
+    phase_cpu[current_phase] += c - phase_cpu_start;
+    if(trace_file)
+      trace_event(phase_names[current_phase], "phase", phase_wall_start, w, 0, 0);
+  }
+  current_phase = next;
+  phase_wall_start = w;
+  phase_cpu_start = c;
+}
+
+// Per thread, merged into the all_ ones when a thread is done
+static __thread int act_nodes, peak_nodes;
+static __thread long total_nodes;
+static __thread unsigned int max_nalt;
+static int all_peak_nodes;
+static long all_total_nodes;
+static unsigned int all_max_nalt;
+static pthread_mutex_t node_counts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void merge_node_counts()
+{
+  pthread_mutex_lock(&node_counts_lock);
+  if(peak_nodes > all_peak_nodes)
+    all_peak_nodes = peak_nodes;
+  all_total_nodes += total_nodes;
+  if(max_nalt > all_max_nalt)
+    all_max_nalt = max_nalt;
+  peak_nodes = total_nodes = max_nalt = 0;
+  pthread_mutex_unlock(&node_counts_lock);
+}
+
+static inline void count_node()
+{
+  act_nodes++;
+  total_nodes++;
+  if(act_nodes > peak_nodes)
+    peak_nodes = act_nodes;
+}
+
+// Persistent map from the reference entities of a group, by local
+// index, to their chosen frontiers.  It is a radix tree with
+// FMAP_FANOUT wide chunks: a copy shares the whole tree and setting
+// an entry only copies the path to it when it is shared.  Entries are
+// never removed, the expired ones are simply not looked up anymore
+// and go away with the last node sharing their chunk.
+#define FMAP_BITS 4
+#define FMAP_FANOUT (1 << FMAP_BITS)
+
+struct fmap_chunk {
   int refcount;
-  align_node *prev;
-  const segment *seg;
+  fmap_chunk() { refcount = 1; }
+};
 
-  double score;                                  // Score of this node (the lower the better)
+struct fmap_inner : public fmap_chunk {
+  fmap_chunk *child[FMAP_FANOUT];
+  fmap_inner() { memset(child, 0, sizeof(child)); }
+};
 
-  list<segment::pairinfo> added_pairs;           // Pairs added within the segment
-  list<entity *> unmapped_entities;              // Entities that could have been mapped within the segment (e.g. starting there) but haven't
+struct fmap_leaf : public fmap_chunk {
+  frontier_choice f[FMAP_FANOUT];
+};
 
-  list<pair<entity *, entity *> > current_pairs; // Pairs active when exiting the segment
-  set<entity *> active_set;                      // Entities mapped to something and still present when exiting the segment
+class frontier_map {
+  fmap_chunk *root;
+  int levels;                 // Inner levels above the leaves
+
+  static void release(fmap_chunk *c, int level) {
+    if(!c || --c->refcount)
+      return;
+    if(level) {
+      fmap_inner *n = static_cast<fmap_inner *>(c);
+      for(int i = 0; i != FMAP_FANOUT; i++)
+	release(n->child[i], level-1);
+      delete n;
+    } else
+      delete static_cast<fmap_leaf *>(c);
+  }
 
-  map<entity *, frontier_choice> frontiers;      // Chosen frontiers
+  // Make the chunk private to this map, copying it if it is shared
+  static fmap_chunk *own(fmap_chunk *c, int level) {
+    if(!c)
+      return level ? static_cast<fmap_chunk *>(new fmap_inner) : static_cast<fmap_chunk *>(new fmap_leaf);
+    if(c->refcount == 1)
+      return c;
+    c->refcount--;
+    if(level) {
+      fmap_inner *n = new fmap_inner(*static_cast<fmap_inner *>(c));
+      n->refcount = 1;
+      for(int i = 0; i != FMAP_FANOUT; i++)
+	if(n->child[i])
+	  n->child[i]->refcount++;
+      return n;
+    }
+    fmap_leaf *l = new fmap_leaf(*static_cast<fmap_leaf *>(c));
+    l->refcount = 1;
+    return l;
+  }
 
-  align_node() { refcount = 1; prev = 0; score = 0; act_nodes++; seg = 0; }
-  align_node(const segment *_seg, align_node *_prev) { refcount = 1; seg = _seg; prev = _prev; prev->copy_frontiers_filtered(frontiers, seg); prev->ref(); score = prev->score; act_nodes++; }
-  ~align_node() {
-    if(prev) {
-      align_node *n = prev;
-      while(n && n->refcount == 1) {
-	align_node *n1 = n->prev;
-	n->prev = 0;
-	delete n;
-	n = n1;
-      }
-      if(n)
-	n->unref();
+  static void collect(const fmap_chunk *c, int level, unsigned int base, vector<pair<unsigned int, frontier_choice> > &out) {
+    if(!c)
+      return;
+    if(level) {
+      for(int i = 0; i != FMAP_FANOUT; i++)
+	collect(static_cast<const fmap_inner *>(c)->child[i], level-1, (base << FMAP_BITS) | i, out);
+    } else {
+      for(int i = 0; i != FMAP_FANOUT; i++)
+	if(static_cast<const fmap_leaf *>(c)->f[i].sf != -1)
+	  out.push_back(pair<unsigned int, frontier_choice>((base << FMAP_BITS) | i, static_cast<const fmap_leaf *>(c)->f[i]));
     }
-    act_nodes--;
   }
 
-  void ref() { refcount++; }
-  void unref() { refcount--; if(!refcount) delete this; }
+public:
+  frontier_map() { root = 0; levels = 0; }
+  frontier_map(const frontier_map &m) { root = m.root; levels = m.levels; if(root) root->refcount++; }
+  ~frontier_map() { release(root, levels); }
+
+  frontier_map &operator=(const frontier_map &m) {
+    if(m.root)
+      m.root->refcount++;
+    release(root, levels);
+    root = m.root;
+    levels = m.levels;
+    return *this;
+  }
+
+  // Empty map for local indexes up to n-1
+  void init(unsigned int n) {
+    release(root, levels);
+    root = 0;
+    levels = 0;
+    while(n > (1U << (FMAP_BITS*(levels+1))))
+      levels++;
+  }
 
-  bool active(entity *e) const { return active_set.find(e) != active_set.end(); }
+  const frontier_choice *find(unsigned int idx) const {
+    const fmap_chunk *c = root;
+    for(int level = levels; c && level; level--)
+      c = static_cast<const fmap_inner *>(c)->child[(idx >> (FMAP_BITS*level)) & (FMAP_FANOUT-1)];
+    if(!c)
+      return 0;
+    const frontier_choice &f = static_cast<const fmap_leaf *>(c)->f[idx & (FMAP_FANOUT-1)];
+    return f.sf == -1 ? 0 : &f;
+  }
 
-  const frontier_choice *find_frontier(entity *e) const {
-    assert(!seg || e->end.back() >= seg->start);
-    map<entity *, frontier_choice>::const_iterator i = frontiers.find(e);
-    if(i != frontiers.end())
-      return &i->second;
-    return NULL;
+  void set(unsigned int idx, const frontier_choice &f) {
+    fmap_chunk **c = &root;
+    for(int level = levels; level; level--) {
+      *c = own(*c, level);
+      c = &static_cast<fmap_inner *>(*c)->child[(idx >> (FMAP_BITS*level)) & (FMAP_FANOUT-1)];
+    }
+    *c = own(*c, 0);
+    static_cast<fmap_leaf *>(*c)->f[idx & (FMAP_FANOUT-1)] = f;
   }
 
-  void add_frontier(entity *e, const frontier_choice &f) {
-    assert(e->end.back() >= seg->start);
-    frontiers[e] = f;
+  // All the set entries by increasing local index, for debugging
+  void entries(vector<pair<unsigned int, frontier_choice> > &out) const {
+    out.clear();
+    collect(root, levels, 0, out);
   }
+};
+
+// What a search node decided in its segment: the instantiated
+// reference frontiers and the mapping combination.  The pairs and
+// unmapped entities are rebuilt from the surviving chain at the end.
+struct align_decision {
+  int prev;                   // Decision of the parent node, -1 for the group start
+  unsigned int alt;           // Mapping combination index
+  unsigned int ffirst, fcount; // Instantiated frontiers in the decision_frontiers array
+};
+
+struct align_node {
+  const segment *seg;
+  const entity_store *es;
+  int decision;                                        // Index of the decision taken in the segment
 
-  void copy_frontiers_unfiltered(map<entity *, frontier_choice> &dest) {
-    for(map<entity *, frontier_choice>::const_iterator i = frontiers.begin(); i != frontiers.end(); i++)
-      dest[i->first] = i->second;
+  double score;                                        // Score of this node (the lower the better)
+
+  list<pair<entity_id, entity_id> > current_pairs;     // Pairs active when exiting the segment
+  set<entity_id> active_set;                           // Entities mapped to something and still present when exiting the segment
+
+  frontier_map frontiers;                              // Chosen frontiers, shared with the parent
+
+  align_node(const entity_store *_es, unsigned int nrefs) { score = 0; count_node(); seg = 0; es = _es; decision = -1; frontiers.init(nrefs); }
+  align_node(const segment *_seg, const align_node *prev) : frontiers(prev->frontiers) { seg = _seg; es = prev->es; score = prev->score; count_node(); decision = -1; }
+  ~align_node() { act_nodes--; }
+
+  bool active(entity_id e) const { return active_set.find(e) != active_set.end(); }
+
+  const frontier_choice *find_frontier(entity_id e) const {
+    assert(!seg || es->last_end(e) >= seg->start);
+    return frontiers.find(es->local_idx[e]);
   }
 
-  void copy_frontiers_filtered(map<entity *, frontier_choice> &dest, const segment *fseg) {
-    for(map<entity *, frontier_choice>::const_iterator i = frontiers.begin(); i != frontiers.end(); i++)
-      if(i->first->end.back() >= fseg->start)
-	dest[i->first] = i->second;
+  void add_frontier(entity_id e, const frontier_choice &f) {
+    assert(es->last_end(e) >= seg->start);
+    frontiers.set(es->local_idx[e], f);
   }
 };
 
-void show_entity(entity *e, const char *data, const map<entity *, frontier_choice> &fm)
+void show_entity(const entity_store &es, entity_id e, const char *data, const map<entity_id, frontier_choice> &fm)
 {
   int sf = 0;
-  int ef = e->end.size()-1;
-  map<entity *, frontier_choice>::const_iterator i = fm.find(e);
+  int ef = es.nend(e)-1;
+  map<entity_id, frontier_choice>::const_iterator i = fm.find(e);
   if(i != fm.end()) {
     sf = i->second.sf;
     ef = i->second.ef;
   }
-  char *ebuf = new char[5*(e->end[ef] - e->start[sf])];
-  escape(ebuf, data + e->start[sf], e->end[ef] - e->start[sf]);
-  printf("%c:%d:%s:%s", e->hyp ? 'H' : 'R', e->depth, tag_names[e->tagid].c_str(), ebuf);
+  char *ebuf = new char[5*(es.end(e, ef) - es.start(e, sf))];
+  escape(ebuf, data + es.start(e, sf), es.end(e, ef) - es.start(e, sf));
+  printf("%c:%d:%s:%s", es.hyp[e] ? 'H' : 'R', es.depth[e], tag_names[es.tagid[e]].c_str(), ebuf);
   delete[] ebuf;
 }
 
@@ -1182,8 +2713,8 @@ bool nodes_are_equivalent(const align_node *an1, const align_node *an2, const se
     return false;
 
 
-  set<entity *>::const_iterator s1 = an1->active_set.begin();
-  set<entity *>::const_iterator s2 = an2->active_set.begin();
+  set<entity_id>::const_iterator s1 = an1->active_set.begin();
+  set<entity_id>::const_iterator s2 = an2->active_set.begin();
 
   while(s1 != an1->active_set.end()) {
     if(*s1 != *s2)
@@ -1193,8 +2724,8 @@ bool nodes_are_equivalent(const align_node *an1, const align_node *an2, const se
     s2++;
   }
 
-  list<pair<entity *, entity *> >::const_iterator i1 = an1->current_pairs.begin();
-  list<pair<entity *, entity *> >::const_iterator i2 = an2->current_pairs.begin();
+  list<pair<entity_id, entity_id> >::const_iterator i1 = an1->current_pairs.begin();
+  list<pair<entity_id, entity_id> >::const_iterator i2 = an2->current_pairs.begin();
   while(i1 != an1->current_pairs.end()) {
     if(i1->first != i2->first || i1->second != i2->second)
       return false;
@@ -1203,16 +2734,17 @@ bool nodes_are_equivalent(const align_node *an1, const align_node *an2, const se
     i2++;
   }
 
+  const entity_store &es = *an1->es;
   for(unsigned int i = 0; i != seg.entities.size(); i++) {
-    entity *e = seg.entities[i];
-    if(!e->hyp) {
+    entity_id e = seg.entities[i];
+    if(!es.hyp[e]) {
       const frontier_choice *f1 = an1->find_frontier(e);
       const frontier_choice *f2 = an2->find_frontier(e);
       if(!f1 && !f2)
 	continue;
       if(!f1 || !f2)
 	return false;
-      if(e->end[f1->ef] <= seg.end && e->end[f2->ef] <= seg.end)
+      if(es.end(e, f1->ef) <= seg.end && es.end(e, f2->ef) <= seg.end)
 	continue;
       if(*f1 != *f2)
 	return false;
@@ -1222,35 +2754,223 @@ bool nodes_are_equivalent(const align_node *an1, const align_node *an2, const se
   return true;
 }
 
-void align(vector<segment> &segments, const char *data, map<entity *, frontier_choice> &align_frontiers)
+// Mapping candidates of the entities starting in a segment, the
+// instantiated reference ones first, in choices order, then the
+// hypothesis ones.  frontiers holds the choices of the parent node.
+static void mapping_targets(const entity_store &es, const segment &seg, const map<entity_id, frontier_choice> &choices, const frontier_map &frontiers,
+			    list<entity_id> &starting_entities, list<vector<entity_id> > &target_entities, unsigned int &nalt)
+{
+  nalt = 1;
+
+  // First add the reference entities starting here associated
+  // to the possible hyp entities.
+  for(map<entity_id, frontier_choice>::const_iterator k = choices.begin(); k != choices.end(); k++) {
+    // Skip the uninstatiated ones
+    if(k->second.ef == -1)
+      continue;
+
+    // Add the entity to the list
+    starting_entities.push_back(k->first);
+    target_entities.resize(target_entities.size()+1);
+
+    // Pick up its frontiers
+    text_pos start = es.start(k->first, k->second.sf);
+    text_pos end = es.end(k->first, k->second.ef);
+
+    // Scan the hypothesis entities to find the compatible ones
+    for(unsigned int l=0; l != seg.entities.size(); l++) {
+      entity_id e = seg.entities[l];
+      if(es.hyp[e] && es.first_start(e) < end && es.last_end(e) > start)
+	target_entities.back().push_back(e);
+    }
+
+    // Incrementally compute the permutations count
+    nalt *= 1+target_entities.back().size();
+  }
+
+  // Then add the hypothesis entities starting here associated
+  // to the possible, but not starting, reference entities.
+  for(unsigned int k=0; k != seg.starting_hyp_entities.size(); k++) {
+    // Add the entity to the list
+    starting_entities.push_back(seg.starting_hyp_entities[k]);
+    target_entities.resize(target_entities.size()+1);
+
+    // Scan the reference entities to find the compatible ones.
+    // They have to be instanciated in search node to be
+    // expanded (i.e. not starting in this segment), and with
+    // the end frontier after the hypothesis start (which is the
+    // segment start).
+    for(unsigned int l=0; l != seg.entities.size(); l++) {
+      entity_id e = seg.entities[l];
+      if(!es.hyp[e]) {
+	const frontier_choice *m = frontiers.find(es.local_idx[e]);
+	if(m && es.end(e, m->ef) > seg.start)
+	  target_entities.back().push_back(e);
+      }
+    }
+
+    // Incrementally compute the permutations count
+    nalt *= 1+target_entities.back().size();
+  }
+}
+
+// Target index of every starting entity in mapping combination alt,
+// 0 for unmapped
+static inline int mapping_target(const vector<entity_id> &targets, unsigned int &alt)
+{
+  if(!targets.size())
+    return 0;
+  int div = targets.size()+1;
+  int tidx = alt % div;
+  alt /= div;
+  return tidx;
+}
+
+// Rebuild the pairs, unmapped entities and frontiers of the segments
+// of a group by replaying the decisions of the surviving chain
+static void replay_decisions(const entity_store &es, vector<segment> &segments, const segment_group &g, map<entity_id, frontier_choice> &align_frontiers,
+			     const vector<align_decision> &decisions, const vector<pair<entity_id, frontier_choice> > &decision_frontiers, int last)
+{
+  vector<int> chain(g.last - g.first);
+  for(int idx = g.last-1; idx >= int(g.first); idx--) {
+    chain[idx - g.first] = last;
+    last = decisions[last].prev;
+  }
+  assert(last == -1);
+
+  set<entity_id> active_set;
+  frontier_map frontiers;
+  frontiers.init(g.refs.size());
+  for(unsigned int idx = g.first; idx != g.last; idx++) {
+    segment &s = segments[idx];
+    const align_decision &d = decisions[chain[idx - g.first]];
+    s.added_pairs.clear();
+    s.unmapped_entities.clear();
+
+    map<entity_id, frontier_choice> choices;
+    for(unsigned int k = d.ffirst; k != d.ffirst + d.fcount; k++)
+      choices.insert(decision_frontiers[k]);
+
+    list<entity_id> starting_entities;
+    list<vector<entity_id> > target_entities;
+    unsigned int nalt;
+    mapping_targets(es, s, choices, frontiers, starting_entities, target_entities, nalt);
+
+    for(map<entity_id, frontier_choice>::const_iterator k = choices.begin(); k != choices.end(); k++) {
+      frontiers.set(es.local_idx[k->first], k->second);
+      align_frontiers[k->first] = k->second;
+    }
+
+    unsigned int alt = d.alt;
+    list<vector<entity_id> >::const_iterator tei = target_entities.begin();
+    for(list<entity_id>::const_iterator sei = starting_entities.begin(); sei != starting_entities.end(); sei++, tei++) {
+      int tidx = mapping_target(*tei, alt);
+      if(!tidx) {
+	if(active_set.find(*sei) == active_set.end())
+	  s.unmapped_entities.push_back(*sei);
+	continue;
+      }
+      entity_id eh = *sei;
+      entity_id er = (*tei)[tidx-1];
+      if(es.hyp[er]) {
+	entity_id ee = eh;
+	eh = er;
+	er = ee;
+      }
+      const frontier_choice *erf = frontiers.find(es.local_idx[er]);
+      s.added_pairs.push_back(segment::pairinfo(er, eh, &g.subst_error(es.local_idx[er], es.local_idx[eh], erf->sf, erf->ef)));
+      active_set.insert(eh);
+      active_set.insert(er);
+    }
+
+    for(unsigned int k=0; k != s.entities.size(); k++)
+      if(es.last_end(s.entities[k]) == s.end)
+	active_set.erase(s.entities[k]);
+  }
+}
+
+// Drop the decisions no live node leads to anymore and renumber the
+// others.  A decision always comes after its parent and the
+// combinations of a node share consecutive decisions with the same
+// frontiers, so one forward pass is enough.
+static void compact_decisions(const list<align_node *> &nodes, vector<align_decision> &decisions, vector<pair<entity_id, frontier_choice> > &decision_frontiers)
+{
+  vector<int> remap(decisions.size(), -1);
+  for(list<align_node *>::const_iterator j = nodes.begin(); j != nodes.end(); j++)
+    for(int d = (*j)->decision; d != -1 && remap[d] == -1; d = decisions[d].prev)
+      remap[d] = 0;
+
+  unsigned int nd = 0, nf = 0;
+  unsigned int last_src = 0, last_dst = 0;
+  bool have_last = false;
+  for(unsigned int d = 0; d != decisions.size(); d++) {
+    if(remap[d] == -1)
+      continue;
+    align_decision dec = decisions[d];
+    if(dec.prev != -1)
+      dec.prev = remap[dec.prev];
+    if(!dec.fcount)
+      dec.ffirst = nf;
+    else if(have_last && dec.ffirst == last_src)
+      dec.ffirst = last_dst;
+    else {
+      for(unsigned int k = 0; k != dec.fcount; k++)
+	decision_frontiers[nf + k] = decision_frontiers[dec.ffirst + k];
+      last_src = dec.ffirst;
+      last_dst = nf;
+      have_last = true;
+      dec.ffirst = nf;
+      nf += dec.fcount;
+    }
+    remap[d] = nd;
+    decisions[nd++] = dec;
+  }
+  decisions.resize(nd);
+  decision_frontiers.resize(nf);
+
+  for(list<align_node *>::const_iterator j = nodes.begin(); j != nodes.end(); j++)
+    if((*j)->decision != -1)
+      (*j)->decision = remap[(*j)->decision];
+}
+
+// Gives up and returns false once more than max_nodes search nodes
+// stay alive after a segment, unless max_nodes is negative.
+bool align_group(const entity_store &es, vector<segment> &segments, const segment_group &g, const char *data, map<entity_id, frontier_choice> &align_frontiers, long max_nodes)
 {
   list<align_node *> current_nodes;
-  current_nodes.push_back(new align_node);
+  current_nodes.push_back(new align_node(&es, g.refs.size()));
 
-  for(vector<segment>::const_iterator i = segments.begin(); i != segments.end(); i++) {
+  // Decisions of the created nodes, indexed by align_node::decision.
+  // The ones of dropped nodes are reclaimed once the array has doubled
+  // since the last compaction, so it stays within twice the live chains.
+  vector<align_decision> decisions;
+  vector<pair<entity_id, frontier_choice> > decision_frontiers;
+  size_t compact_at = 1024;
+
+  for(vector<segment>::const_iterator i = segments.begin() + g.first; i != segments.begin() + g.last; i++) {
 #if 0
     printf("starting on segment %d, %d nodes, (sre=%d, ent=%d)\n", int(i-segments.begin()), int(current_nodes.size()), int(i->starting_ref_entities.size()), int(i->entities.size()));
     if(true)
       for(unsigned int j=0; j != i->starting_ref_entities.size(); j++) {
-	map<entity *, frontier_choice> fc;
-	printf(" sre %d : %p:%d - ", j, i->starting_ref_entities[j].e, i->starting_ref_entities[j].fid);
-	show_entity(i->starting_ref_entities[j].e, data, fc);
+	map<entity_id, frontier_choice> fc;
+	printf(" sre %d : %u:%d - ", j, i->starting_ref_entities[j].e, i->starting_ref_entities[j].fid);
+	show_entity(es, i->starting_ref_entities[j].e, data, fc);
 	printf("\n");
       }
 
     for(unsigned int j=0; j != i->entities.size(); j++) {
-      entity *e =  i->entities[j];
-      printf("  %d %p %s (", j, e, e->hyp ? "hyp" : "ref");
-      for(unsigned int k=0; k != e->start.size(); k++) {
+      entity_id e =  i->entities[j];
+      printf("  %d %u %s (", j, e, es.hyp[e] ? "hyp" : "ref");
+      for(unsigned int k=0; k != es.nstart(e); k++) {
 	if(k)
 	  printf(" ");
-	printf("%d", e->start[k]);
+	printf("%lld", (long long)es.start(e, k));
       }
       printf(")-(");
-      for(unsigned int k=0; k != e->end.size(); k++) {
+      for(unsigned int k=0; k != es.nend(e); k++) {
 	if(k)
 	  printf(" ");
-	printf("%d", e->end[k]);
+	printf("%lld", (long long)es.end(e, k));
       }
       printf(")\n");
     }
@@ -1266,10 +2986,12 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
       align_node *pan = *j;
 
 #if 0
-      for(map<entity *, frontier_choice>::const_iterator k = pan->frontiers.begin(); k != pan->frontiers.end(); k++) {
-	printf("node %p frontier %p %d %d\n", pan, k->first, k->second.sf, k->second.ef);
-	if(k->second.sf == -1) {
-	  printf("frontier error %p %d %d\n", k->first, k->second.sf, k->second.ef);
+      vector<pair<unsigned int, frontier_choice> > fl;
+      pan->frontiers.entries(fl);
+      for(vector<pair<unsigned int, frontier_choice> >::const_iterator k = fl.begin(); k != fl.end(); k++) {
+	printf("node %p frontier %u %d %d\n", pan, k->first, k->second.sf, k->second.ef);
+	if(k->second.ef == -1) {
+	  printf("frontier error %u %d %d\n", k->first, k->second.sf, k->second.ef);
 	  abort();
 	}
       }
@@ -1284,7 +3006,7 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 
       // Enumerate all the acceptable combinations of reference
       // entities starting at the beginning of the segment
-      map<entity *, frontier_choice> choices;
+      map<entity_id, frontier_choice> choices;
 
       int slot = 0;
       bool backtracking = false;
@@ -1319,20 +3041,20 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 	    continue;
 	  }
 
-	  entity *e = i->starting_ref_entities[slot].e;
-	  map<entity *, frontier_choice>::iterator k = choices.find(e);
+	  entity_id e = i->starting_ref_entities[slot].e;
+	  map<entity_id, frontier_choice>::iterator k = choices.find(e);
 	  if(k == choices.end()) {
 	    // No choice yet on this slot, start by not selecting the entity
 	    choices[e] = frontier_choice(i->starting_ref_entities[slot].fid, -1);
 
-	    //	    printf("slot %d start %p, frontier=%d/%d\n", slot, e, i->starting_ref_entities[slot].fid, int(e->start.size()));
+	    //	    printf("slot %d start %u, frontier=%d/%d\n", slot, e, i->starting_ref_entities[slot].fid, int(es.nstart(e)));
 
 	    // Not selecting the entity is only actually acceptable
 	    // if this is not the last possible segment for mapping.
 	    // In the latter case, just loop on the slot without
 	    // moving it to go to the first acceptable ending
 	    // frontier.
-	    if(i->starting_ref_entities[slot].fid == e->start.size()-1)
+	    if(i->starting_ref_entities[slot].fid == es.nstart(e)-1)
 	      continue;
 
 	    backtracking = false;
@@ -1342,10 +3064,10 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 	    // selected (-1) is naturally followed by the first
 	    // frontier (0)
 	    k->second.ef++;
-	    //	    printf("slot %d advancing %p, end frontier=%d/%d\n", slot, e, k->second.ef, int(e->end.size()));
+	    //	    printf("slot %d advancing %p, end frontier=%d/%d\n", slot, e, k->second.ef, int(es.nend(e)));
 
 	    // Out of frontiers, time to backtrack
-	    if(k->second.ef == int(e->end.size())) {
+	    if(k->second.ef == int(es.nend(e))) {
 	      choices.erase(k);
 	      slot--;
 	      backtracking = true;
@@ -1355,8 +3077,8 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 	    backtracking = false;
 
 #if 0
-	    printf("slot %d %p frontiers %d %d\n", slot, e, e->start[k->second.sf], e->end[k->second.ef]);
-	    printf("slot %d %p parent=%p left=%p\n", slot, e, e->parent, e->left_constraint);
+	    printf("slot %d %u frontiers %lld %lld\n", slot, e, (long long)es.start(e, k->second.sf), (long long)es.end(e, k->second.ef));
+	    printf("slot %d %u parent=%u left=%u\n", slot, e, es.parent[e], es.left_constraint[e]);
 #endif
 
 	    // Now check whether the choice is acceptable.  On
@@ -1364,16 +3086,20 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 
 	    // First test, the entity size.  The frontiers have to
 	    // be separated by at least one character.
-	    if(e->start[k->second.sf] > e->end[k->second.ef])
+	    if(es.start(e, k->second.sf) > es.end(e, k->second.ef))
+	      continue;
+
+	    // Choices pruned up front can't satisfy the next tests
+	    if(!es.feasible(e, k->second.sf, k->second.ef))
 	      continue;
 
 	    // Second test, the parent.  If it exists, it must be
 	    // instanciated and the current instance must be within
 	    // it.
-	    if(e->parent) {
-	      const frontier_choice *l = pan->find_frontier(e->parent);
+	    if(es.parent[e] != NO_ENTITY) {
+	      const frontier_choice *l = pan->find_frontier(es.parent[e]);
 	      if(!l) {
-		map<entity *, frontier_choice>::const_iterator ll = choices.find(e->parent);
+		map<entity_id, frontier_choice>::const_iterator ll = choices.find(es.parent[e]);
 		if(ll == choices.end() || ll->second.ef == -1) {
 		  //		  printf("slot %d %p parent not instanciated\n", slot, e);
 		  continue;
@@ -1381,32 +3107,32 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 		l = &ll->second;
 	      }
 #if 0
-	      printf("slot %d %p parent frontiers %d %d\n", slot, e, e->parent->start[l->sf], e->parent->end[l->ef]);
-	      printf("%d %d - %d %d\n", l->sf, l->ef, int(e->parent->start.size()), int(e->parent->end.size()));
+	      printf("slot %d %u parent frontiers %lld %lld\n", slot, e, (long long)es.start(es.parent[e], l->sf), (long long)es.end(es.parent[e], l->ef));
+	      printf("%d %d - %d %d\n", l->sf, l->ef, int(es.nstart(es.parent[e])), int(es.nend(es.parent[e])));
 #endif
 
 	      // Instantiation found, check the inclusion
-	      if(e->parent->start[l->sf] > e->start[k->second.sf] || e->parent->end[l->ef] < e->end[k->second.ef])
+	      if(es.start(es.parent[e], l->sf) > es.start(e, k->second.sf) || es.end(es.parent[e], l->ef) < es.end(e, k->second.ef))
 		continue;
 	    }
 
 	    // Third test, the left constraint.  If it exists, it
 	    // must be instanciated and the current instance must be
 	    // to the left of the current entity (they can touch).
-	    if(e->left_constraint && e->left_constraint->end.back() > e->start[k->second.sf]) {
-	      const frontier_choice *l = pan->find_frontier(e->left_constraint);
+	    if(es.left_constraint[e] != NO_ENTITY && es.last_end(es.left_constraint[e]) > es.start(e, k->second.sf)) {
+	      const frontier_choice *l = pan->find_frontier(es.left_constraint[e]);
 	      if(!l) {
-		map<entity *, frontier_choice>::const_iterator ll = choices.find(e->left_constraint);
+		map<entity_id, frontier_choice>::const_iterator ll = choices.find(es.left_constraint[e]);
 		if(ll == choices.end() || ll->second.ef == -1) {
 		  //		  printf("slot %d %p left not instanciated\n", slot, e);
 		  continue;
 		}
 		l = &ll->second;
 	      }
-	      //	      printf("slot %d %p left frontiers %d %d\n", slot, e, e->left_constraint->start[l->sf], e->left_constraint->end[l->ef]);
+	      //	      printf("slot %d %u left frontiers %lld %lld\n", slot, e, (long long)es.start(es.left_constraint[e], l->sf), (long long)es.end(es.left_constraint[e], l->ef));
 
 	      // Instantiation found, check the placement
-	      if(e->left_constraint->end[l->ef] > e->start[k->second.sf])
+	      if(es.end(es.left_constraint[e], l->ef) > es.start(e, k->second.sf))
 		continue;
 	    }
 
@@ -1419,63 +3145,23 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 
 	// Build a list of mappings to try
 	// Count the permutations while we're at it
-	list<entity *> starting_entities;
-	list<vector<entity *> > target_entities;
-	unsigned int nalt = 1;
-
-	// First add the reference entities starting here associated
-	// to the possible hyp entities.
-	for(map<entity *, frontier_choice>::const_iterator k = choices.begin(); k != choices.end(); k++) {
-	  // Skip the uninstatiated ones
-	  if(k->second.ef == -1)
-	    continue;
-
-	  // Add the entity to the list
-	  starting_entities.push_back(k->first);
-	  target_entities.resize(target_entities.size()+1);
-
-	  // Pick up its frontiers
-	  int start = k->first->start[k->second.sf];
-	  int end = k->first->end[k->second.ef];
-
-	  // Scan the hypothesis entities to find the compatible ones
-	  for(unsigned int l=0; l != i->entities.size(); l++) {
-	    entity *e = i->entities[l];
-	    //	    printf("scanning starting ref %d-%d vs. %s %d-%d\n", start, end, e->hyp ? "hyp" : "ref", e->start.front(), e->end.back());
-	    if(e->hyp && e->start.front() < end && e->end.back() > start)
-	      target_entities.back().push_back(e);
-	  }
-
-	  // Incrementally compute the permutations count
-	  nalt *= 1+target_entities.back().size();
-	}
-
-	// Then add the hypothesis entities starting here associated
-	// to the possible, but not starting, reference entities.
-	for(unsigned int k=0; k != i->starting_hyp_entities.size(); k++) {
-	  // Add the entity to the list
-	  starting_entities.push_back(i->starting_hyp_entities[k]);
-	  target_entities.resize(target_entities.size()+1);
-
-	  // Scan the reference entities to find the compatible ones.
-	  // They have to be instanciated in search node to be
-	  // expanded (i.e. not starting in this segment), and with
-	  // the end frontier after the hypothesis start (which is the
-	  // segment start).
-	  for(unsigned int l=0; l != i->entities.size(); l++) {
-	    entity *e = i->entities[l];
-	    if(!e->hyp) {
-	      const frontier_choice *m = pan->find_frontier(e);
-	      if(m && e->end[m->ef] > i->start)
-		target_entities.back().push_back(e);
-	    }
-	  }
-
-	  // Incrementally compute the permutations count
-	  nalt *= 1+target_entities.back().size();
-	}
+	list<entity_id> starting_entities;
+	list<vector<entity_id> > target_entities;
+	unsigned int nalt;
+	mapping_targets(es, *i, choices, pan->frontiers, starting_entities, target_entities, nalt);
+
+	// Record the instantiated frontiers, shared by the combinations
+	align_decision dec;
+	dec.prev = pan->decision;
+	dec.ffirst = decision_frontiers.size();
+	for(map<entity_id, frontier_choice>::const_iterator k = choices.begin(); k != choices.end(); k++)
+	  if(k->second.ef != -1)
+	    decision_frontiers.push_back(*k);
+	dec.fcount = decision_frontiers.size() - dec.ffirst;
 
 	//	printf("scan done, se=%d, nalt=%d\n", int(starting_entities.size()), nalt);
+	if(nalt > max_nalt)
+	  max_nalt = nalt;
 
 	// Create a new node for every combination if it doesn't break the constraints
 	for(unsigned int k=0; k<nalt; k++) {
@@ -1487,7 +3173,7 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 	  an->current_pairs = pan->current_pairs;
 
 	  // Add the frontier instantiations
-	  for(map<entity *, frontier_choice>::const_iterator l = choices.begin(); l != choices.end(); l++) {
+	  for(map<entity_id, frontier_choice>::const_iterator l = choices.begin(); l != choices.end(); l++) {
 	    // Add the instatiated ones
 	    if(l->second.ef != -1) {
 	      //	      printf("node add %p frontier %p %d %d\n", an, l->first, l->second.sf, l->second.ef);
@@ -1496,39 +3182,32 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 	  }
 
 	  // Then do the mappings
-	  int idx = k;
-	  list<entity *>::iterator sei = starting_entities.begin();
-	  list<vector<entity *> >::iterator tei = target_entities.begin();
+	  unsigned int idx = k;
+	  list<entity_id>::iterator sei = starting_entities.begin();
+	  list<vector<entity_id> >::iterator tei = target_entities.begin();
 
 	  while(sei != starting_entities.end()) {
-	    int tidx;
-	    if(tei->size()) {
-	      int div = tei->size()+1;
-	      tidx = idx % div;
-	      idx /= div;
-	    } else
-	      tidx = 0;
+	    int tidx = mapping_target(*tei, idx);
 
 	    if(!tidx) {
 	      //   Don't map the entity to anything, or the entity is already used (due to previous mappings in the same segment)
 	      if(!an->active(*sei)) {
 		//     Score increment is equal to the entity cost
-		entity *e = *sei;
-		an->unmapped_entities.push_back(e);
-		if(e->hyp)
-		  an->score += e->miss_errors[0][0].cost;
+		entity_id e = *sei;
+		if(es.hyp[e])
+		  an->score += es.miss_error(e, 0, 0).cost;
 		else {
 		  const frontier_choice &ff = choices[e];
-		  an->score += e->miss_errors[ff.sf][ff.ef].cost;
+		  an->score += es.miss_error(e, ff.sf, ff.ef).cost;
 		}
 	      }
 	    } else {
 	      //   Map two entities
 	      //     Find the two entities ids to map
-	      entity *eh = *sei;
-	      entity *er = (*tei)[tidx-1];
-	      if(er->hyp) {
-		entity *ee = eh;
+	      entity_id eh = *sei;
+	      entity_id er = (*tei)[tidx-1];
+	      if(es.hyp[er]) {
+		entity_id ee = eh;
 		eh = er;
 		er = ee;
 	      }
@@ -1538,12 +3217,12 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 		goto rejected;
 
 	      //     Test the ordering constraint, drop the combination if it fails
-	      int edh = eh->depth;
-	      int edr = er->depth;
+	      int edh = es.depth[eh];
+	      int edr = es.depth[er];
 	    
-	      for(list<pair<entity *, entity *> >::const_iterator m = an->current_pairs.begin(); m != an->current_pairs.end(); m++) {
-		int pdh = m->first->depth;
-		int pdr = m->second->depth;
+	      for(list<pair<entity_id, entity_id> >::const_iterator m = an->current_pairs.begin(); m != an->current_pairs.end(); m++) {
+		int pdh = es.depth[m->first];
+		int pdr = es.depth[m->second];
 		if(edh < pdh && edr > pdr)
 		  goto rejected;
 		if(edh > pdh && edr < pdr)
@@ -1551,16 +3230,15 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 	      }
 
 	      const frontier_choice *erf = an->find_frontier(er);
-	      error_d *err = &er->subst_errors[eh][erf->sf][erf->ef];
+	      const error_d *err = &g.subst_error(es.local_idx[er], es.local_idx[eh], erf->sf, erf->ef);
 	      if(err->cost == -1) {
-		printf("seg: (%d, %d)\n", i->start, i->end);
-		printf("er: %p (%d, %d)\n", er, er->start[erf->sf], er->end[erf->ef]);
-		printf("eh: %p (%d, %d)\n", eh, eh->start.front(), eh->end.back());
+		printf("seg: (%lld, %lld)\n", (long long)i->start, (long long)i->end);
+		printf("er: %u (%lld, %lld)\n", er, (long long)es.start(er, erf->sf), (long long)es.end(er, erf->ef));
+		printf("eh: %u (%lld, %lld)\n", eh, (long long)es.first_start(eh), (long long)es.last_end(eh));
 	      }
 
 	      assert(err->cost != -1);
-	      an->added_pairs.push_back(segment::pairinfo(er, eh, err));
-	      an->current_pairs.push_back(pair<entity *, entity *>(eh, er));
+	      an->current_pairs.push_back(pair<entity_id, entity_id>(eh, er));
 	      an->active_set.insert(eh);
 	      an->active_set.insert(er);
 	      an->score += err->cost;
@@ -1569,37 +3247,14 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 	    sei++;
 	    tei++;
 	  }
+	  dec.alt = k;
+	  an->decision = decisions.size();
+	  decisions.push_back(dec);
 	  opened_nodes.push_back(an);
 
-#if 0
-	  if(v) {
-	    printf("New opened node %p (%d), score=%g, frontiers=%d\n", an, int(opened_nodes.size()), an->score, int(an->frontiers.size()));
-	    printf("  active:");
-	    for(set<entity *>::iterator j = an->active_set.begin(); j != an->active_set.end(); j++) {
-	      printf(" ");
-	      show_entity(*j, data, an->frontiers);
-	    }
-	    printf("\n");
-	    printf("  pairs:");
-	    for(list<segment::pairinfo>::const_iterator l = an->added_pairs.begin(); l != an->added_pairs.end(); l++) {
-	      printf(" ");
-	      show_entity(l->er, data, an->frontiers);
-	      printf(" = ");
-	      show_entity(l->eh, data, an->frontiers);
-	    }
-	    printf("\n");
-	    printf("  unmapped:");
-	    for(list<entity *>::const_iterator l = an->unmapped_entities.begin(); l != an->unmapped_entities.end(); l++) {
-	      printf(" ");
-	      show_entity(*l, data, an->frontiers);
-	    }
-	    printf("\n");
-	  }
-#endif
 	  continue;
 	rejected:
-	  if(an)
-	    an->unref();
+	  delete an;
 	}
       }
     done:
@@ -1607,7 +3262,7 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
     }
 
 #if 0
-    printf("%d-%d %d opened nodes :", i->start, i->end, int(opened_nodes.size()));
+    printf("%lld-%lld %d opened nodes :", (long long)i->start, (long long)i->end, int(opened_nodes.size()));
     for(list<align_node *>::const_iterator j = opened_nodes.begin(); j != opened_nodes.end(); j++)
       printf(" %g", (*j)->score);
     printf("\n");
@@ -1615,24 +3270,24 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 
     // Clearup the current nodes
     for(list<align_node *>::const_iterator j = current_nodes.begin(); j != current_nodes.end(); j++)
-      (*j)->unref();
+      delete *j;
     current_nodes.clear();
 
     // Close and merge
     for(list<align_node *>::const_iterator j = opened_nodes.begin(); j != opened_nodes.end(); j++) {
       align_node *an = *j;
       //   Close all entities in current_pairs or active_vector that finish in the current segment
-      int elimit = i->end;
+      text_pos elimit = i->end;
       for(unsigned int k=0; k != i->entities.size(); k++)
-	if(i->entities[k]->end.back() == elimit) {
-	  set<entity *>::iterator l = an->active_set.find(i->entities[k]);
+	if(es.last_end(i->entities[k]) == elimit) {
+	  set<entity_id>::iterator l = an->active_set.find(i->entities[k]);
 	  if(l != an->active_set.end())
 	    an->active_set.erase(l);
 	}
 
-      for(list<pair<entity *, entity *> >::iterator k = an->current_pairs.begin(); k != an->current_pairs.end();)
+      for(list<pair<entity_id, entity_id> >::iterator k = an->current_pairs.begin(); k != an->current_pairs.end();)
 	if(!an->active(k->first) || !an->active(k->second)) {
-	  list<pair<entity *, entity *> >::iterator l = k;
+	  list<pair<entity_id, entity_id> >::iterator l = k;
 	  k++;
 	  an->current_pairs.erase(l);
 	} else
@@ -1643,9 +3298,9 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
 	if(nodes_are_equivalent(an, *j, *i)) {
 	  //   If yes, keep the one with the best score
 	  if((*j)->score <= an->score)
-	    an->unref();
+	    delete an;
 	  else {
-	    (*j)->unref();
+	    delete *j;
 	    *j = an;
 	  }
 	  goto node_found;
@@ -1656,342 +3311,2833 @@ void align(vector<segment> &segments, const char *data, map<entity *, frontier_c
       ;
     }
 #if 0
-    printf("%d-%d %d closed nodes :", i->start, i->end, int(current_nodes.size()));
+    printf("%lld-%lld %d closed nodes :", (long long)i->start, (long long)i->end, int(current_nodes.size()));
     for(list<align_node *>::const_iterator j = current_nodes.begin(); j != current_nodes.end(); j++)
       printf(" %g", (*j)->score);
     printf("\n");
 #endif
+
+    if(max_nodes >= 0 && long(current_nodes.size()) > max_nodes) {
+      for(list<align_node *>::const_iterator j = current_nodes.begin(); j != current_nodes.end(); j++)
+	delete *j;
+      return false;
+    }
+
+    if(decisions.size() >= compact_at) {
+      compact_decisions(current_nodes, decisions, decision_frontiers);
+      compact_at = 2*decisions.size() + 1024;
+    }
   }
 
   assert(current_nodes.size() == 1);
-  int idx = segments.size()-1;
+  replay_decisions(es, segments, g, align_frontiers, decisions, decision_frontiers, current_nodes.front()->decision);
+  delete current_nodes.front();
+  return true;
+}
+
+// A position where entities start in a flat annotation, for the
+// sweep scorer
+struct sweep_step {
+  text_pos pos;
+  entity_id r, h;                           // Reference and hypothesis entities starting here, NO_ENTITY if none
+  entity_id rprev, hprev;                   // Entities started before and still open here, NO_ENTITY if none
+  const error_d *subst_r_hprev, *subst_r_h, *subst_h_rprev;
+};
 
-  align_node *an = current_nodes.front();
-  do {
-    an->copy_frontiers_unfiltered(align_frontiers);
-    segments[idx].added_pairs = an->added_pairs;
-    segments[idx].unmapped_entities = an->unmapped_entities;
-    idx--;
-    an = an->prev;
-  } while(an->prev);
+struct start_order {
+  const entity_store *es;
+  start_order(const entity_store *_es) { es = _es; }
+  bool operator()(entity_id e1, entity_id e2) const { return es->first_start(e1) < es->first_start(e2); }
+};
 
-  current_nodes.front()->unref();
+// Entities in start order, false if some overlap, nest or are empty
+static bool flat_sorted(const entity_store &es, entity_id first, entity_id last, vector<entity_id> &sorted)
+{
+  for(entity_id e = first; e != last; e++) {
+    if(es.depth[e] || es.nstart(e) != 1 || es.nend(e) != 1 || es.first_start(e) >= es.last_end(e))
+      return false;
+    sorted.push_back(e);
+  }
+  stable_sort(sorted.begin(), sorted.end(), start_order(&es));
+  for(unsigned int i = 1; i < sorted.size(); i++)
+    if(es.first_start(sorted[i]) < es.last_end(sorted[i-1]))
+      return false;
+  return true;
 }
 
-void cleanup_unmapped(vector<segment> &segments, vector<entity> &ref_entities, vector<entity> &hyp_entities)
+// Check whether the annotations are flat, with single frontiers, and
+// build the sweep steps if so
+bool build_sweep(const entity_store &es, entity_id first_hyp, vector<sweep_step> &steps)
 {
-  for(vector<entity>::iterator i = ref_entities.begin(); i != ref_entities.end(); i++)
-    i->paired = false;
-  for(vector<entity>::iterator i = hyp_entities.begin(); i != hyp_entities.end(); i++)
-    i->paired = false;
+  if(opt_ref_aref)
+    return false;
 
-  for(vector<segment>::const_iterator i = segments.begin(); i != segments.end(); i++)
-    for(list<segment::pairinfo>::const_iterator j = i->added_pairs.begin(); j != i->added_pairs.end(); j++) {
-      j->er->paired = true;
-      j->eh->paired = true;
-    }
+  vector<entity_id> refs, hyps;
+  if(!flat_sorted(es, 0, first_hyp, refs) || !flat_sorted(es, first_hyp, es.size(), hyps))
+    return false;
 
-  for(vector<segment>::iterator i = segments.begin(); i != segments.end(); i++)
-    for(list<entity *>::iterator j = i->unmapped_entities.begin(); j != i->unmapped_entities.end();)
-      if((*j)->paired) {
-	list<entity *>::iterator k = j;
+  unsigned int i = 0, j = 0;
+  entity_id rprev = NO_ENTITY, hprev = NO_ENTITY;
+  while(i != refs.size() || j != hyps.size()) {
+    sweep_step st;
+    st.pos = i == refs.size() ? es.first_start(hyps[j]) : j == hyps.size() ? es.first_start(refs[i]) : min(es.first_start(refs[i]), es.first_start(hyps[j]));
+    st.r = i != refs.size() && es.first_start(refs[i]) == st.pos ? refs[i++] : NO_ENTITY;
+    st.h = j != hyps.size() && es.first_start(hyps[j]) == st.pos ? hyps[j++] : NO_ENTITY;
+    st.rprev = rprev != NO_ENTITY && es.last_end(rprev) > st.pos ? rprev : NO_ENTITY;
+    st.hprev = hprev != NO_ENTITY && es.last_end(hprev) > st.pos ? hprev : NO_ENTITY;
+    st.subst_r_hprev = st.subst_r_h = st.subst_h_rprev = 0;
+    if(st.r != NO_ENTITY)
+      rprev = st.r;
+    if(st.h != NO_ENTITY)
+      hprev = st.h;
+    steps.push_back(st);
+  }
+  return true;
+}
+
+static const error_d *sweep_subst_cost(lua_State *L, const entity_store &es, entity_id er, entity_id eh, error_d &err, const char *data,
+					vector<pending_error> *pending)
+{
+  lua_get_global_function(L, "get_substitution_cost");
+  lua_pushentity(L, es, er, 0, 0, data);
+  lua_pushentity(L, es, eh, 0, 0, data);
+  lua_do_call(L, "get_substitution_cost", 2, 2);
+  lua_load_error(L, err, "get_substitution_cost", pending);
+  lua_pop(L, 2);
+  return &err;
+}
+
+// Substitution costs of the overlapping pairs, step i keeps its
+// errors in slots 3i to 3i+2 of the storage
+struct sweep_costs_ctx {
+  const entity_store *es;
+  vector<sweep_step> *steps;
+  vector<error_d> *errors;
+  const char *data;
+};
+
+static void sweep_costs_range(lua_State *L, unsigned int first, unsigned int last, void *_ctx, vector<pending_error> *pending)
+{
+  sweep_costs_ctx *ctx = static_cast<sweep_costs_ctx *>(_ctx);
+  const entity_store &es = *ctx->es;
+  for(unsigned int i = first; i != last; i++) {
+    sweep_step &st = (*ctx->steps)[i];
+    error_d *err = &(*ctx->errors)[3*i];
+    if(st.r != NO_ENTITY && st.hprev != NO_ENTITY)
+      st.subst_r_hprev = sweep_subst_cost(L, es, st.r, st.hprev, err[0], ctx->data, pending);
+    if(st.r != NO_ENTITY && st.h != NO_ENTITY)
+      st.subst_r_h = sweep_subst_cost(L, es, st.r, st.h, err[1], ctx->data, pending);
+    if(st.h != NO_ENTITY && st.rprev != NO_ENTITY)
+      st.subst_h_rprev = sweep_subst_cost(L, es, st.rprev, st.h, err[2], ctx->data, pending);
+  }
+}
+
+void compute_sweep_costs(const entity_store &es, vector<sweep_step> &steps, vector<error_d> &errors, const char *data)
+{
+  errors.resize(3*steps.size());
+
+  sweep_costs_ctx ctx;
+  ctx.es = &es;
+  ctx.steps = &steps;
+  ctx.errors = &errors;
+  ctx.data = data;
+  parallel_costs(sweep_costs_range, &ctx, steps.size(), 256);
+}
+
+// One combination tried by the search at a step, in its enumeration
+// order.  The state tells whether the last started reference (bit 0)
+// and hypothesis (bit 1) entities are paired.  Returns false if the
+// combination is rejected, otherwise the cost, the next state and
+// what was paired (0 for nothing, 1 for the previous entity, 2 for
+// the one starting at the same place).
+static bool sweep_combination(const entity_store &es, const sweep_step &st, int state, int k, double &cost, int &nstate, int &rpair, int &hpair)
+{
+  int rtargets = st.r == NO_ENTITY ? 0 : (st.hprev != NO_ENTITY) + (st.h != NO_ENTITY);
+  int htargets = st.h == NO_ENTITY ? 0 : st.rprev != NO_ENTITY;
+  bool rprev_active = st.rprev != NO_ENTITY && (state & 1);
+  bool hprev_active = st.hprev != NO_ENTITY && (state & 2);
+  bool r_active = false, h_active = false;
+
+  cost = 0;
+  rpair = hpair = 0;
+  if(st.r != NO_ENTITY) {
+    int tidx = 0;
+    if(rtargets) {
+      tidx = k % (rtargets+1);
+      k /= rtargets+1;
+    }
+    if(!tidx)
+      cost += es.miss_error(st.r, 0, 0).cost;
+    else {
+      // Targets in entity order, the previous hypothesis comes first
+      if(tidx == 1 && st.hprev != NO_ENTITY) {
+	if(hprev_active)
+	  return false;
+	cost += st.subst_r_hprev->cost;
+	hprev_active = r_active = true;
+	rpair = 1;
+      } else {
+	cost += st.subst_r_h->cost;
+	h_active = r_active = true;
+	rpair = 2;
+      }
+    }
+  }
+  if(st.h != NO_ENTITY) {
+    int tidx = 0;
+    if(htargets) {
+      tidx = k % (htargets+1);
+      k /= htargets+1;
+    }
+    if(!tidx) {
+      if(!h_active)
+	cost += es.miss_error(st.h, 0, 0).cost;
+    } else {
+      if(h_active || rprev_active)
+	return false;
+      cost += st.subst_h_rprev->cost;
+      rprev_active = h_active = true;
+      hpair = 1;
+    }
+  }
+
+  nstate = (st.r != NO_ENTITY ? r_active : rprev_active ? 1 : (state & 1)) |
+    ((st.h != NO_ENTITY ? h_active : hprev_active ? 1 : (state >> 1) & 1) << 1);
+  return true;
+}
+
+static int sweep_combinations(const sweep_step &st)
+{
+  int rtargets = st.r == NO_ENTITY ? 0 : (st.hprev != NO_ENTITY) + (st.h != NO_ENTITY);
+  int htargets = st.h == NO_ENTITY ? 0 : st.rprev != NO_ENTITY;
+  return (rtargets+1)*(htargets+1);
+}
+
+// Score flat annotations with a dynamic programming sweep over the
+// start positions, at most one reference and one hypothesis entity
+// being open at any time.  The costs are the search ones, and among
+// the optimal solutions the one the search enumerates first is kept.
+// Each step becomes a segment holding the unmapped entities and pairs
+// the search would have put there.
+void sweep_align(const entity_store &es, const vector<sweep_step> &steps, vector<segment> &segments, map<entity_id, frontier_choice> &align_frontiers)
+{
+  unsigned int n = steps.size();
+
+  // Best cost from each step to the end, per state
+  vector<double> best((n+1)*4, 0);
+  for(int i = n-1; i >= 0; i--)
+    for(int state = 0; state != 4; state++) {
+      double b = HUGE_VAL;
+      for(int k = 0; k != sweep_combinations(steps[i]); k++) {
+	double cost;
+	int nstate, rpair, hpair;
+	if(sweep_combination(es, steps[i], state, k, cost, nstate, rpair, hpair) && cost + best[(i+1)*4 + nstate] < b)
+	  b = cost + best[(i+1)*4 + nstate];
+      }
+      best[i*4 + state] = b;
+    }
+
+  // Follow the first optimal combination at each step
+  vector<int> rpairs(n), hpairs(n);
+  int state = 0;
+  for(unsigned int i = 0; i != n; i++) {
+    double target = best[i*4 + state];
+    int k;
+    for(k = 0; k != sweep_combinations(steps[i]); k++) {
+      double cost;
+      int nstate, rpair, hpair;
+      if(sweep_combination(es, steps[i], state, k, cost, nstate, rpair, hpair) &&
+	 fabs(cost + best[(i+1)*4 + nstate] - target) <= 1e-9*(1+fabs(target))) {
+	rpairs[i] = rpair;
+	hpairs[i] = hpair;
+	state = nstate;
+	break;
+      }
+    }
+    assert(k != sweep_combinations(steps[i]));
+  }
+
+  // Find which entities end up paired
+  vector<bool> paired(es.size());
+  for(unsigned int i = 0; i != n; i++) {
+    const sweep_step &st = steps[i];
+    if(rpairs[i]) {
+      paired[st.r] = true;
+      paired[rpairs[i] == 1 ? st.hprev : st.h] = true;
+    }
+    if(hpairs[i]) {
+      paired[st.h] = true;
+      paired[st.rprev] = true;
+    }
+  }
+
+  segments.resize(n);
+  for(unsigned int i = 0; i != n; i++) {
+    const sweep_step &st = steps[i];
+    segment &s = segments[i];
+    s.start = st.pos;
+    s.end = i+1 != n ? steps[i+1].pos : st.pos;
+    if(st.r != NO_ENTITY) {
+      align_frontiers[st.r] = frontier_choice(0, 0);
+      if(!paired[st.r])
+	s.unmapped_entities.push_back(st.r);
+    }
+    if(st.h != NO_ENTITY && !paired[st.h])
+      s.unmapped_entities.push_back(st.h);
+    if(rpairs[i] == 1)
+      s.added_pairs.push_back(segment::pairinfo(st.r, st.hprev, st.subst_r_hprev));
+    else if(rpairs[i] == 2)
+      s.added_pairs.push_back(segment::pairinfo(st.r, st.h, st.subst_r_h));
+    if(hpairs[i])
+      s.added_pairs.push_back(segment::pairinfo(st.rprev, st.h, st.subst_h_rprev));
+  }
+}
+
+// Faster alignment strategies, tried in order on the groups they
+// apply to once the search keeps more than opt_match_above nodes
+// alive after a segment, before falling back to the full search.  They must give the
+// same results, and may still return false to leave a group to the
+// search.
+typedef bool (*group_applies_fn)(const entity_store &es, const segment_group &g);
+typedef bool (*group_aligner_fn)(const entity_store &es, vector<segment> &segments, const segment_group &g, const char *data, map<entity_id, frontier_choice> &align_frontiers);
+
+struct group_aligner {
+  const char *name;
+  group_applies_fn applies;
+  group_aligner_fn align;
+};
+
+#define MATCH_FORBIDDEN 1e30
+
+// Hungarian algorithm on a square cost matrix.  The potentials and
+// the matching are kept, so that after raising some costs only the
+// rows losing their column have to be augmented again: the other
+// matched cells stay tight and the potentials stay feasible.  Changes
+// made by a trial are logged to be undone in place.
+struct hungarian_solver {
+  int n;
+  vector<vector<double> > a;
+  vector<double> u, v;                      // Row and column potentials, 1-based
+  vector<int> p;                            // Row matched to each column, 1-based, 0 if none
+
+  vector<double> minv;                      // Augmentation scratch
+  vector<int> way;
+  vector<bool> used;
+  vector<pair<int, double> > reached;       // Columns reached and the distance then
+  vector<int> freed;
+
+  bool logging;
+  vector<pair<double *, double> > dlog;     // Old values of the changed costs and potentials
+  vector<pair<int *, int> > plog;           // Old values of the changed matches
+
+  void set(double &x, double val) {
+    if(logging)
+      dlog.push_back(pair<double *, double>(&x, x));
+    x = val;
+  }
+
+  void set(int &x, int val) {
+    if(logging)
+      plog.push_back(pair<int *, int>(&x, x));
+    x = val;
+  }
+
+  void solve(const vector<vector<double> > &_a) {
+    a = _a;
+    n = a.size();
+    u.assign(n+1, 0);
+    v.assign(n+1, 0);
+    p.assign(n+1, 0);
+    minv.resize(n+1);
+    way.resize(n+1);
+    used.resize(n+1);
+    logging = false;
+    for(int i = 1; i <= n; i++)
+      augment(i);
+  }
+
+  // Match the free row i along a shortest augmenting path.  The
+  // potentials of the columns reached and their rows only move by the
+  // distance covered since they were reached, so minv is kept as
+  // distances from the start and they are updated once at the end.
+  void augment(int i) {
+    minv.assign(n+1, HUGE_VAL);
+    used.assign(n+1, false);
+    reached.clear();
+    double dist = 0;
+    p[0] = i;
+    int j0 = 0;
+    do {
+      used[j0] = true;
+      reached.push_back(pair<int, double>(j0, dist));
+      int i0 = p[j0], j1 = 0;
+      double next = HUGE_VAL;
+      const double *ai = &a[i0-1][0], ui = u[i0] - dist;
+      for(int j = 1; j <= n; j++)
+	if(!used[j]) {
+	  double cur = ai[j-1] - ui - v[j];
+	  double m = minv[j];
+	  if(cur < m) {
+	    minv[j] = m = cur;
+	    way[j] = j0;
+	  }
+	  if(m < next) {
+	    next = m;
+	    j1 = j;
+	  }
+	}
+      dist = next;
+      j0 = j1;
+    } while(p[j0]);
+    for(unsigned int k = 0; k != reached.size(); k++) {
+      int j = reached[k].first;
+      double d = dist - reached[k].second;
+      set(u[p[j]], u[p[j]] + d);
+      set(v[j], v[j] - d);
+    }
+    do {
+      int j1 = way[j0];
+      set(p[j0], p[j1]);
+      j0 = j1;
+    } while(j0);
+  }
+
+  double total() const {
+    double t = 0;
+    for(int j = 1; j <= n; j++)
+      t += a[p[j]-1][j-1];
+    return t;
+  }
+
+  int match(int r) const {
+    for(int j = 1; j <= n; j++)
+      if(p[j] == r+1)
+	return j-1;
+    return -1;
+  }
+
+  // Forbid the (row, column) cells and tell whether the optimal cost
+  // best is still reachable.  The change is kept only if it is and
+  // keep is set.
+  bool forbid(const vector<pair<int, int> > &cells, double best, bool keep) {
+    dlog.clear();
+    plog.clear();
+    freed.clear();
+    logging = true;
+    for(unsigned int k = 0; k != cells.size(); k++) {
+      int r = cells[k].first, c = cells[k].second;
+      set(a[r][c], MATCH_FORBIDDEN);
+      if(p[c+1] == r+1) {
+	set(p[c+1], 0);
+	freed.push_back(r+1);
+      }
+    }
+    for(unsigned int k = 0; k != freed.size(); k++)
+      augment(freed[k]);
+    logging = false;
+    double c = total();
+    bool ok = c < MATCH_FORBIDDEN && fabs(c - best) <= 1e-9*(1+fabs(best));
+    if(ok && keep)
+      return true;
+    for(int k = dlog.size()-1; k >= 0; k--)
+      *dlog[k].first = dlog[k].second;
+    for(int k = plog.size()-1; k >= 0; k--)
+      *plog[k].first = plog[k].second;
+    return ok;
+  }
+};
+
+// Groups without nesting, with single frontiers everywhere, have no
+// constraint beyond the one pairing per entity, and the search then
+// amounts to a bipartite matching.  Its score counts the miss cost of
+// the earlier starting entity of a pair on top of the substitution
+// cost, since that entity was left unmapped when it started.
+//
+// The result is laid out by going through the decisions the search
+// takes, segment by segment, and the starting entities in reverse
+// order within a segment, each time picking the choice (unmapped or
+// one of the targets) that still allows the optimum.  Which of several
+// optimal matchings the search keeps depends on its node merging, so
+// groups where a decision has more than one such choice are left to
+// it.
+//
+// In such groups at most one reference and one hypothesis entity are
+// open at a time, so the search keeps few nodes alive and stays
+// linear in the group length: the default budget is not reached.  The
+// groups that do blow up the search, with nesting or frontier
+// alternatives, are not covered.
+bool matching_applies(const entity_store &es, const segment_group &g)
+{
+  unsigned int nr = g.refs.size(), nh = g.hyps.size();
+  for(unsigned int i = 0; i != nr; i++) {
+    entity_id e = g.refs[i];
+    if(es.depth[e] || es.nstart(e) != 1 || es.nend(e) != 1 || es.first_start(e) >= es.last_end(e))
+      return false;
+    if(es.left_constraint[e] != NO_ENTITY && es.last_end(es.left_constraint[e]) > es.first_start(e))
+      return false;
+  }
+  for(unsigned int i = 0; i != nh; i++) {
+    entity_id e = g.hyps[i];
+    if(es.depth[e] || es.first_start(e) >= es.last_end(e))
+      return false;
+  }
+  return true;
+}
+
+bool align_group_matching(const entity_store &es, vector<segment> &segments, const segment_group &g, const char *data, map<entity_id, frontier_choice> &align_frontiers)
+{
+  unsigned int nr = g.refs.size(), nh = g.hyps.size();
+
+  // The starting entities and their possible targets, per segment, as
+  // the search builds them
+  vector<vector<entity_id> > starting(g.last - g.first);
+  vector<vector<vector<entity_id> > > targets(g.last - g.first);
+  for(unsigned int i = g.first; i != g.last; i++) {
+    const segment &s = segments[i];
+    vector<entity_id> &st = starting[i - g.first];
+    for(unsigned int j = 0; j != s.starting_ref_entities.size(); j++)
+      st.push_back(s.starting_ref_entities[j].e);
+    sort(st.begin(), st.end());
+    st.insert(st.end(), s.starting_hyp_entities.begin(), s.starting_hyp_entities.end());
+
+    vector<vector<entity_id> > &tg = targets[i - g.first];
+    tg.resize(st.size());
+    for(unsigned int j = 0; j != st.size(); j++) {
+      entity_id e = st[j];
+      for(unsigned int k = 0; k != s.entities.size(); k++) {
+	entity_id t = s.entities[k];
+	if(es.hyp[t] == es.hyp[e] || es.last_end(t) <= s.start)
+	  continue;
+	if(es.hyp[e] ? es.first_start(t) < s.start : es.first_start(t) < es.last_end(e))
+	  tg[j].push_back(t);
+      }
+    }
+  }
+
+  // Rows are the reference entities then one dummy per hypothesis
+  // entity, columns the hypothesis entities then one dummy per
+  // reference entity.  Pairing an entity with its dummy leaves it
+  // unmapped.
+  unsigned int n = nr + nh;
+  vector<vector<double> > a(n, vector<double>(n, MATCH_FORBIDDEN));
+  for(unsigned int r = 0; r != nr; r++) {
+    entity_id er = g.refs[r];
+    text_pos rs = es.first_start(er), re = es.last_end(er);
+    for(unsigned int h = 0; h != nh; h++) {
+      entity_id eh = g.hyps[h];
+      text_pos hs = es.first_start(eh);
+      if(hs >= re || es.last_end(eh) <= rs)
+	continue;
+      double c = g.subst_error(r, h, 0, 0).cost;
+      if(c == -1)
+	continue;
+      if(hs < rs)
+	c += es.miss_error(eh, 0, 0).cost;
+      else if(rs < hs)
+	c += es.miss_error(er, 0, 0).cost;
+      a[r][h] = c;
+    }
+    a[r][nh + r] = es.miss_error(er, 0, 0).cost;
+  }
+  for(unsigned int h = 0; h != nh; h++) {
+    a[nr + h][h] = es.miss_error(g.hyps[h], 0, 0).cost;
+    for(unsigned int r = 0; r != nr; r++)
+      a[nr + h][nh + r] = 0;
+  }
+
+  hungarian_solver hs;
+  hs.solve(a);
+  double best = hs.total();
+
+  // Replay the decisions
+  vector<bool> paired(n);
+  for(unsigned int i = 0; i != starting.size(); i++) {
+    const vector<entity_id> &st = starting[i];
+    for(int j = st.size()-1; j >= 0; j--) {
+      entity_id e = st[j];
+      const vector<entity_id> &tg = targets[i][j];
+      unsigned int ei = es.hyp[e] ? nr + es.local_idx[e] : es.local_idx[e];
+      if(paired[ei] || tg.empty())
+	continue;
+
+      // Cells to forbid for each choice, unmapped first
+      vector<vector<pair<int, int> > > choices(1);
+      vector<int> choice_target(1, -1);
+      for(unsigned int k = 0; k != tg.size(); k++) {
+	unsigned int r = es.hyp[e] ? es.local_idx[tg[k]] : es.local_idx[e];
+	unsigned int h = es.hyp[e] ? es.local_idx[e] : es.local_idx[tg[k]];
+	choices[0].push_back(pair<int, int>(r, h));
+	if(paired[r] || paired[nr + h] || hs.a[r][h] >= MATCH_FORBIDDEN)
+	  continue;
+	vector<pair<int, int> > cells;
+	for(unsigned int l = 0; l != n; l++) {
+	  if(l != h && hs.a[r][l] < MATCH_FORBIDDEN)
+	    cells.push_back(pair<int, int>(r, l));
+	  if(l != r && hs.a[l][h] < MATCH_FORBIDDEN)
+	    cells.push_back(pair<int, int>(l, h));
+	}
+	choices.push_back(cells);
+	choice_target.push_back(k);
+      }
+
+      int chosen = -1;
+      for(unsigned int k = 0; k != choices.size(); k++)
+	if(hs.forbid(choices[k], best, false)) {
+	  if(chosen != -1)
+	    return false;
+	  chosen = k;
+	}
+      assert(chosen != -1);
+      hs.forbid(choices[chosen], best, true);
+      if(choice_target[chosen] != -1) {
+	entity_id t = tg[choice_target[chosen]];
+	unsigned int r = es.hyp[e] ? es.local_idx[t] : es.local_idx[e];
+	unsigned int h = es.hyp[e] ? es.local_idx[e] : es.local_idx[t];
+	paired[r] = paired[nr + h] = true;
+      }
+    }
+  }
+
+  vector<int> row_match(n);
+  for(unsigned int r = 0; r != n; r++)
+    row_match[r] = hs.match(r);
+
+  // Lay the result out as the search does: pairs in the segment where
+  // the later entity starts, unmapped entities where they start
+  vector<int> hyp_match(nh, -1);
+  for(unsigned int r = 0; r != nr; r++) {
+    align_frontiers[g.refs[r]] = frontier_choice(0, 0);
+    if(row_match[r] < int(nh))
+      hyp_match[row_match[r]] = r;
+  }
+
+  for(unsigned int i = 0; i != starting.size(); i++) {
+    segment &s = segments[g.first + i];
+    s.added_pairs.clear();
+    s.unmapped_entities.clear();
+    const vector<entity_id> &st = starting[i];
+    for(unsigned int j = 0; j != st.size(); j++) {
+      entity_id e = st[j];
+      unsigned int le = es.local_idx[e];
+      int m = es.hyp[e] ? hyp_match[le] : row_match[le] < int(nh) ? row_match[le] : -1;
+      if(m == -1) {
+	s.unmapped_entities.push_back(e);
+	continue;
+      }
+      unsigned int r = es.hyp[e] ? m : le;
+      unsigned int h = es.hyp[e] ? le : m;
+      entity_id er = g.refs[r], eh = g.hyps[h];
+      if(es.hyp[e] ? es.first_start(er) < es.first_start(eh) : es.first_start(eh) <= es.first_start(er))
+	s.added_pairs.push_back(segment::pairinfo(er, eh, &g.subst_error(r, h, 0, 0)));
+    }
+  }
+  return true;
+}
+
+static const group_aligner group_aligners[] = {
+  { "matching", matching_applies, align_group_matching },
+  { 0, 0, 0 }
+};
+
+void align(const entity_store &es, vector<segment> &segments, vector<segment_group> &groups, const char *data, map<entity_id, frontier_choice> &align_frontiers, bool fast)
+{
+  for(vector<segment_group>::iterator g = groups.begin(); g != groups.end(); g++) {
+    double start = trace_file ? wall_time() : 0;
+    long nodes = total_nodes;
+    g->aligner = 0;
+    bool applies = false;
+    for(const group_aligner *a = group_aligners; fast && !applies && a->name; a++)
+      applies = a->applies(es, *g);
+    if(!applies || !align_group(es, segments, *g, data, align_frontiers, opt_match_above)) {
+      for(const group_aligner *a = group_aligners; applies && a->name; a++)
+	if(a->applies(es, *g) && a->align(es, segments, *g, data, align_frontiers)) {
+	  g->aligner = a->name;
+	  break;
+	}
+      if(!g->aligner)
+	align_group(es, segments, *g, data, align_frontiers, -1);
+    }
+    if(trace_file) {
+      char args[128];
+      sprintf(args, "\"start\":%lld,\"end\":%lld,\"segments\":%u,\"nodes\":%ld",
+	      (long long)segments[g->first].start, (long long)segments[g->last-1].end, g->last - g->first, total_nodes - nodes);
+      trace_event("align group", "align", start, wall_time(), trace_tid, args);
+    }
+  }
+}
+
+void cleanup_unmapped(vector<segment> &segments, entity_store &es)
+{
+  for(entity_id e = 0; e != es.size(); e++)
+    es.paired[e] = false;
+
+  for(vector<segment>::const_iterator i = segments.begin(); i != segments.end(); i++)
+    for(list<segment::pairinfo>::const_iterator j = i->added_pairs.begin(); j != i->added_pairs.end(); j++) {
+      es.paired[j->er] = true;
+      es.paired[j->eh] = true;
+    }
+
+  for(vector<segment>::iterator i = segments.begin(); i != segments.end(); i++)
+    for(list<entity_id>::iterator j = i->unmapped_entities.begin(); j != i->unmapped_entities.end();)
+      if(es.paired[*j]) {
+	list<entity_id>::iterator k = j;
 	j++;
 	i->unmapped_entities.erase(k);
       } else
 	j++;
 }
 
-void show_entities(const vector<entity> &entities, const char *data)
+void show_entities(const entity_store &es, const char *data)
 {
-  for(unsigned int i = 0; i != entities.size(); i++) {
-    const entity &e = entities[i];
-    char *ebuf = new char[5*(e.end.back() - e.start.front())];
-    escape(ebuf, data + e.start.front(), e.end.back() - e.start.front());
-    printf("%4d: %5d %5d %d %c %s %s\n", i, e.start.front(), e.end.back(), e.depth, e.hyp ? 'H' : 'R', tag_names[e.tagid].c_str(), ebuf);
+  for(entity_id i = 0; i != es.size(); i++) {
+    char *ebuf = new char[5*(es.last_end(i) - es.first_start(i))];
+    escape(ebuf, data + es.first_start(i), es.last_end(i) - es.first_start(i));
+    printf("%4d: %5lld %5lld %d %c %s %s\n", i, (long long)es.first_start(i), (long long)es.last_end(i), es.depth[i], es.hyp[i] ? 'H' : 'R', tag_names[es.tagid[i]].c_str(), ebuf);
     delete[] ebuf;
   }
 }
 
-void show_segments(const vector<segment> &segments, const char *data)
+void show_segments(const entity_store &es, const vector<segment> &segments, const char *data)
 {
   for(unsigned int i=0; i != segments.size(); i++) {
     const segment &s = segments[i];
-    printf("%4d: %5d %5d", i, s.start, s.end);
+    printf("%4d: %5lld %5lld", i, (long long)s.start, (long long)s.end);
     for(unsigned int j=0; j != s.entities.size(); j++) {
-      const entity *e = s.entities[j];
-      char *ebuf = new char[5*(e->end.back() - e->start.front())];
-      escape(ebuf, data + e->start.front(), e->end.back() - e->start.front());
+      entity_id e = s.entities[j];
+      char *ebuf = new char[5*(es.last_end(e) - es.first_start(e))];
+      escape(ebuf, data + es.first_start(e), es.last_end(e) - es.first_start(e));
       if(j)
 	printf(" | ");
       else
 	printf(" ");
-      printf("%c:%d:%d %s %s", e->hyp ? 'H' : 'R', e->depth, j, tag_names[e->tagid].c_str(), ebuf);
+      printf("%c:%d:%d %s %s", es.hyp[e] ? 'H' : 'R', es.depth[e], j, tag_names[es.tagid[e]].c_str(), ebuf);
       delete[] ebuf;
     }
     printf("\n");
   }
 }
 
+void error_ids(const error_d &err, vector<int> &ids)
+{
+  ids.clear();
+  if(err.error_set & ERROR_SET_OVERFLOW) {
+    const list<int> &error_types = error_sets[err.error_set & ~ERROR_SET_OVERFLOW];
+    ids.insert(ids.end(), error_types.begin(), error_types.end());
+    return;
+  }
+  for(int i = 0; i != 63; i++)
+    if(err.error_set & (uint64_t(1) << i))
+      ids.push_back(i);
+}
+
 string build_error_string(const error_d &err)
 {
-  string s;
-  for(list<int>::const_iterator i = err.error_types.begin(); i != err.error_types.end(); i++) {
-    if(i != err.error_types.begin())
-      s += ' ';
-    s += error_names[*i];
+  string s;
+  vector<int> ids;
+  error_ids(err, ids);
+  for(unsigned int i = 0; i != ids.size(); i++) {
+    if(i)
+      s += ' ';
+    s += error_names[ids[i]];
+  }
+  return s;
+}
+
+// Buffered output, on a file or appended to a string
+struct out_writer {
+  FILE *f;
+  string *str;
+  size_t len;
+  char buf[65536];
+
+  out_writer(FILE *_f) { f = _f; str = 0; len = 0; }
+  out_writer(string *_str) { f = 0; str = _str; len = 0; }
+  ~out_writer() { flush(); }
+
+  void write(const char *s, size_t n) {
+    if(str)
+      str->append(s, n);
+    else if(fwrite(s, 1, n, f) != n) {
+      perror("write");
+      exit(1);
+    }
+  }
+
+  void flush() {
+    if(len)
+      write(buf, len);
+    len = 0;
+  }
+
+  void put(const char *s, size_t n) {
+    if(len + n > sizeof(buf)) {
+      flush();
+      if(n > sizeof(buf)) {
+	write(s, n);
+	return;
+      }
+    }
+    memcpy(buf + len, s, n);
+    len += n;
+  }
+
+  void put(const char *s) { put(s, strlen(s)); }
+  void put(const string &s) { put(s.data(), s.size()); }
+  void put(char c) {
+    if(len == sizeof(buf))
+      flush();
+    buf[len++] = c;
+  }
+
+  void put_int(int64_t v) {
+    char t[32];
+    put(t, sprintf(t, "%lld", (long long)v));
+  }
+
+  void put_double(double v) {
+    char t[32];
+    if(!isfinite(v))
+      v = 0;
+    put(t, sprintf(t, "%.10g", v));
+  }
+
+  void put_json(const char *s, size_t n) {
+    put('"');
+    for(size_t i = 0; i != n; i++) {
+      unsigned char c = s[i];
+      if(c == '"' || c == '\\') {
+	put('\\');
+	put(char(c));
+      } else if(c == '\n')
+	put("\\n", 2);
+      else if(c == '\t')
+	put("\\t", 2);
+      else if(c < 0x20) {
+	char t[8];
+	put(t, sprintf(t, "\\u%04x", c));
+      } else
+	put(char(c));
+    }
+    put('"');
+  }
+  void put_json(const string &s) { put_json(s.data(), s.size()); }
+
+  // Same as escape(), pc is the previous character for the space
+  // deduplication
+  void put_escaped(const char *s, size_t n, unsigned char &pc) {
+    for(size_t i = 0; i != n && s[i]; i++) {
+      unsigned char c = s[i];
+      if(c == 10)
+	put("\\n", 2);
+      else if(c < 32) {
+	char t[8];
+	put(t, sprintf(t, "\\0x%02x", c));
+      } else if(c != 32 || c != pc)
+	put(char(c));
+      pc = c;
+    }
+  }
+
+  void put_csv(const char *s, size_t n) {
+    put('"');
+    for(size_t i = 0; i != n; i++) {
+      if(s[i] == '"')
+	put('"');
+      put(s[i] == '\n' ? ' ' : s[i]);
+    }
+    put('"');
+  }
+  void put_csv(const string &s) { put_csv(s.data(), s.size()); }
+
+  // Binary values are little-endian whatever the host
+  void put_u8(int v) { put(char(v)); }
+  void put_u32(uint32_t v) {
+    char t[4];
+    for(int i=0; i != 4; i++)
+      t[i] = v >> (8*i);
+    put(t, 4);
+  }
+  void put_u64(uint64_t v) {
+    char t[8];
+    for(int i=0; i != 8; i++)
+      t[i] = v >> (8*i);
+    put(t, 8);
+  }
+  void put_f64(double v) {
+    uint64_t u;
+    memcpy(&u, &v, 8);
+    char t[8];
+    for(int i=0; i != 8; i++)
+      t[i] = u >> (8*i);
+    put(t, 8);
+  }
+  void put_bin(const char *s, size_t n) {
+    put_u32(n);
+    put(s, n);
+  }
+  void put_bin(const string &s) { put_bin(s.data(), s.size()); }
+};
+
+// Detail report selection, resolved once the tags and error names
+// are known.  Error names only appear as the costs are computed, so
+// unknown ones are errors only once all_errors is set.
+static string details_classes;
+static vector<bool> details_tags, details_errors;
+static uint64_t details_error_mask;
+
+void resolve_details_filters(bool all_errors)
+{
+  details_classes = opt_details_class ? opt_details_class : opt_details_correct ? "IDSC" : "IDS";
+  for(unsigned int i = 0; i != details_classes.size(); i++)
+    if(!strchr("IDSC", details_classes[i])) {
+      fprintf(stderr, "Error: unknown class %c in --details-class\n", details_classes[i]);
+      exit(1);
+    }
+
+  details_tags.clear();
+  for(list<string>::const_iterator i = opt_details_tags.begin(); i != opt_details_tags.end(); i++) {
+    int id = tag_find(*i);
+    if(id == -1) {
+      fprintf(stderr, "Error: unknown tag %s in --details-tag\n", i->c_str());
+      exit(1);
+    }
+    details_tags.resize(tag_names.size());
+    details_tags[id] = true;
+  }
+
+  details_errors.clear();
+  details_error_mask = 0;
+  if(!opt_details_errors.empty()) {
+    details_errors.resize(error_names.size());
+    for(list<string>::const_iterator i = opt_details_errors.begin(); i != opt_details_errors.end(); i++) {
+      map<string, int>::const_iterator j = error_names_map.find(*i);
+      if(j == error_names_map.end()) {
+	if(all_errors) {
+	  fprintf(stderr, "Error: unknown error type %s in --details-error\n", i->c_str());
+	  exit(1);
+	}
+	continue;
+      }
+      details_errors[j->second] = true;
+      if(j->second < 63)
+	details_error_mask |= uint64_t(1) << j->second;
+    }
+  }
+}
+
+// Tell whether a detail record passes the filters, e2 is -1 for
+// inserts and deletes
+bool detail_selected(const entity_store &es, char cls, const error_d &err, entity_id e1, entity_id e2)
+{
+  if(!strchr(details_classes.c_str(), cls))
+    return false;
+
+  if(!details_tags.empty() && !details_tags[es.tagid[e1]] && (e2 == entity_id(-1) || !details_tags[es.tagid[e2]]))
+    return false;
+
+  if(!details_errors.empty()) {
+    if(!(err.error_set & ERROR_SET_OVERFLOW))
+      return err.error_set & details_error_mask;
+    const list<int> &error_types = error_sets[err.error_set & ~ERROR_SET_OVERFLOW];
+    for(list<int>::const_iterator i = error_types.begin(); i != error_types.end(); i++)
+      if(details_errors[*i])
+	return true;
+    return false;
+  }
+  return true;
+}
+
+void put_detail_entity(out_writer &w, const entity_store &es, entity_id e, const char *data, char error, const map<entity_id, frontier_choice> &fm,
+		       vector<pair<text_pos, int> > &fr)
+{
+  w.put(error);
+  w.put(es.hyp[e] ? ": hyp: " : ": ref: ");
+  w.put(tag_names[es.tagid[e]]);
+  if(es.nattrs[e]) {
+    w.put(" (");
+    for(const pair<int, int> *i = es.attr_begin(e); i != es.attr_end(e); i++) {
+      if(i != es.attr_begin(e))
+	w.put(' ');
+      w.put(attr_string(i->first));
+      w.put('=');
+      w.put(attr_string(i->second));
+    }
+    w.put(')');
+  }
+  w.put(" - ");
+
+  unsigned char pc = 0;
+  if(es.nstart(e) != 1 || es.nend(e) != 1) {
+    int sf = 0, ef = es.nend(e)-1;
+    map<entity_id, frontier_choice>::const_iterator fi = fm.find(e);
+    if(fi != fm.end()) {
+      sf = fi->second.sf;
+      ef = fi->second.ef;
+    }
+
+    // Frontiers in text order, with the chosen ones in braces
+    fr.clear();
+    for(unsigned int i = 0; i != es.nstart(e); i++)
+      fr.push_back(pair<text_pos, int>(es.start(e, i), 1));
+    for(unsigned int i = 0; i != es.nend(e); i++)
+      fr.push_back(pair<text_pos, int>(es.end(e, i), 2));
+    sort(fr.begin(), fr.end());
+    text_pos pos = -1;
+    for(unsigned int i = 0; i != fr.size();) {
+      text_pos p = fr[i].first;
+      int flags = 0;
+      for(; i != fr.size() && fr[i].first == p; i++)
+	flags |= fr[i].second;
+      if(pos != -1)
+	w.put_escaped(data+pos, p-pos, pc);
+      pos = p;
+      char c;
+      if(flags & 2) {
+	c = pos == es.end(e, ef) ? '}' : ']';
+	w.put_escaped(&c, 1, pc);
+      }
+      if(flags & 1) {
+	c = pos == es.start(e, sf) ? '{' : '[';
+	w.put_escaped(&c, 1, pc);
+      }
+    }
+
+  } else
+    w.put_escaped(data + es.first_start(e), es.last_end(e) - es.first_start(e), pc);
+  w.put('\n');
+}
+
+void put_details(out_writer &w, const entity_store &es, const vector<segment> &segments, unsigned int first, unsigned int last,
+		 const char *data, const map<entity_id, frontier_choice> &fm, const char *rfname, const char *hfname, vector<pair<text_pos, int> > &fr)
+{
+  char t[128];
+  for(unsigned int i = first; i != last; i++) {
+    const segment &s = segments[i];
+    for(list<entity_id>::const_iterator j = s.unmapped_entities.begin(); j != s.unmapped_entities.end(); j++) {
+      entity_id e = *j;
+      char err = es.hyp[e] ? 'I' : 'D';
+      const error_d &miss = es.unmapped_error(e);
+      if(!detail_selected(es, err, miss, e, entity_id(-1)))
+	continue;
+      w.put(err);
+      w.put(": ");
+      w.put(build_error_string(miss));
+      w.put(t, sprintf(t, " (%g): ", miss.cost));
+      w.put(es.hyp[e] ? hfname : rfname);
+      w.put(t, sprintf(t, ":%d\n", es.line[e]));
+      put_detail_entity(w, es, e, data, err, fm, fr);
+      w.put('\n');
+    }
+
+    for(list<segment::pairinfo>::const_iterator j = s.added_pairs.begin(); j != s.added_pairs.end(); j++) {
+      entity_id e1 = j->er;
+      entity_id e2 = j->eh;
+      char err = j->error->error_set ? 'S' : 'C';
+      if(!detail_selected(es, err, *j->error, e1, e2))
+	continue;
+      w.put(err);
+      w.put(": ");
+      w.put(err == 'C' ? string("correct") : build_error_string(*j->error));
+      w.put(t, sprintf(t, " (%g): ", j->error->cost));
+      w.put(rfname);
+      w.put(t, sprintf(t, ":%d ", es.line[e1]));
+      w.put(hfname);
+      w.put(t, sprintf(t, ":%d\n", es.line[e2]));
+      put_detail_entity(w, es, e1, data, err, fm, fr);
+      put_detail_entity(w, es, e2, data, err, fm, fr);
+      w.put('\n');
+    }
+  }
+}
+
+// With several jobs the report is formatted by regions of segments
+// in parallel, a batch of regions at a time, and written in order
+#define DETAILS_REGION 1024
+
+struct details_ctx {
+  const entity_store *es;
+  const vector<segment> *segments;
+  const char *data;
+  const map<entity_id, frontier_choice> *fm;
+  const char *rfname, *hfname;
+  unsigned int base;
+  vector<string> out;
+};
+
+static void details_region(unsigned int worker, unsigned int chunk, unsigned int first, unsigned int last, void *_ctx)
+{
+  details_ctx *ctx = static_cast<details_ctx *>(_ctx);
+  vector<pair<text_pos, int> > fr;
+  ctx->out[chunk].clear();
+  out_writer w(&ctx->out[chunk]);
+  put_details(w, *ctx->es, *ctx->segments, ctx->base + first, ctx->base + last, ctx->data, *ctx->fm, ctx->rfname, ctx->hfname, fr);
+}
+
+void show_details(const entity_store &es, const vector<segment> &segments, const char *data, const map<entity_id, frontier_choice> &fm, const char *rfname, const char *hfname)
+{
+  FILE *f = stdout;
+  if(opt_details_out) {
+    f = fopen(opt_details_out, "w");
+    if(!f) {
+      perror(opt_details_out);
+      exit(1);
+    }
+  }
+
+  if(opt_jobs <= 1) {
+    vector<pair<text_pos, int> > fr;
+    out_writer w(f);
+    put_details(w, es, segments, 0, segments.size(), data, fm, rfname, hfname, fr);
+
+  } else {
+    details_ctx ctx;
+    ctx.es = &es;
+    ctx.segments = &segments;
+    ctx.data = data;
+    ctx.fm = &fm;
+    ctx.rfname = rfname;
+    ctx.hfname = hfname;
+    unsigned int batch = 8*opt_jobs*DETAILS_REGION;
+    ctx.out.resize(8*opt_jobs);
+    out_writer w(f);
+    for(ctx.base = 0; ctx.base < segments.size(); ctx.base += batch) {
+      unsigned int n = segments.size() - ctx.base < batch ? segments.size() - ctx.base : batch;
+      parallel_for(details_region, &ctx, n, DETAILS_REGION);
+      for(unsigned int i = 0; i != (n + DETAILS_REGION - 1)/DETAILS_REGION; i++)
+	w.put(ctx.out[i]);
+    }
+  }
+
+  if(opt_details_out && fclose(f)) {
+    perror(opt_details_out);
+    exit(1);
+  }
+}
+
+// Scoring totals, summed over the segments in order
+struct score_counts {
+  int tc;
+  vector<int> tag_hypcount, tag_refcount, tag_correct;
+  double ser;
+  int count_insert, count_delete, count_subst, count_correct, count_total;
+
+  score_counts() {
+    tc = tag_names.size();
+    tag_hypcount.resize(tc);
+    tag_refcount.resize(tc);
+    tag_correct.resize(tc);
+    ser = 0;
+    count_insert = count_delete = count_subst = count_correct = count_total = 0;
+  }
+};
+
+void add_scores(const entity_store &es, const vector<segment> &segments, score_counts &sc)
+{
+  for(vector<segment>::const_iterator i = segments.begin(); i != segments.end(); i++) {
+    for(list<entity_id>::const_iterator j = i->unmapped_entities.begin(); j != i->unmapped_entities.end(); j++) {
+      entity_id e = *j;
+      if(es.hyp[e]) {
+	sc.count_insert++;
+	sc.tag_hypcount[es.tagid[e]]++;
+      } else {
+	sc.count_delete++;
+	sc.tag_refcount[es.tagid[e]]++;
+      }
+      sc.ser += es.unmapped_error(e).cost;
+    }
+
+    for(list<segment::pairinfo>::const_iterator j = i->added_pairs.begin(); j != i->added_pairs.end(); j++) {
+      entity_id er = j->er;
+      entity_id eh = j->eh;
+      sc.tag_refcount[es.tagid[er]]++;
+      sc.tag_hypcount[es.tagid[eh]]++;
+      if(!j->error->error_set) {
+	sc.count_correct++;
+	sc.tag_correct[es.tagid[er]]++;
+      } else
+	sc.count_subst++;
+      sc.ser += j->error->cost;
+    }
+  }
+
+  sc.count_total = sc.count_insert + sc.count_delete + sc.count_subst;
+}
+
+// Token level counts (-t).  Tokens are the blank separated words of
+// the reference text, each one gets on each side the type of the
+// deepest entity covering its first character with the frontiers
+// chosen by the alignment, label 0 (shown as O) when none.
+struct token_counts {
+  int nl;                                  // Labels, tags + 1
+  long total, correct;
+  vector<long> confusion;                  // nl x nl, reference major
+
+  token_counts() {
+    nl = tag_names.size() + 1;
+    total = correct = 0;
+    confusion.resize(nl*nl);
+  }
+};
+
+static const char *token_label(int l)
+{
+  return l ? tag_names[l-1].c_str() : "O";
+}
+
+void add_token_counts(const entity_store &es, const char *data, const map<entity_id, frontier_choice> &fm, token_counts &tk)
+{
+  vector<text_pos> tokens;
+  const char *p = data;
+  for(;;) {
+    while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+      p++;
+    if(!*p)
+      break;
+    tokens.push_back(p - data);
+    while(*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+      p++;
+  }
+
+  unsigned int n = tokens.size();
+  vector<int> label(2*n), depth(2*n, -1);
+  for(entity_id e = 0; e != es.size(); e++) {
+    int sf = 0;
+    int ef = es.nend(e)-1;
+    map<entity_id, frontier_choice>::const_iterator i = fm.find(e);
+    if(i != fm.end()) {
+      sf = i->second.sf;
+      ef = i->second.ef;
+    }
+    text_pos start = es.start(e, sf), end = es.end(e, ef);
+    unsigned int side = es.hyp[e] ? n : 0;
+    for(unsigned int t = lower_bound(tokens.begin(), tokens.end(), start) - tokens.begin(); t != n && tokens[t] < end; t++)
+      if(es.depth[e] > depth[side+t]) {
+	depth[side+t] = es.depth[e];
+	label[side+t] = es.tagid[e] + 1;
+      }
+  }
+
+  for(unsigned int t = 0; t != n; t++) {
+    tk.confusion[label[t]*tk.nl + label[n+t]]++;
+    if(label[t] == label[n+t])
+      tk.correct++;
+  }
+  tk.total += n;
+}
+
+// CoNLL style span scores (--conll), computed from the entities
+// alone without any segment or alignment.  Strict and boundary
+// matches pair entities one to one through a hash table of the
+// reference spans, all the start/end alternatives of an aref entity
+// being entered.  Type matches count, on each side, the entities
+// overlapping one of the same type on the other side.
+struct conll_counts {
+  int tc;
+  int count_ref, count_hyp;
+  int strict, boundary;                    // Matched pairs
+  int type_ref, type_hyp;                  // Overlapped entities per side
+  vector<int> tag_refcount, tag_hypcount, tag_strict;
+
+  conll_counts() {
+    tc = tag_names.size();
+    count_ref = count_hyp = strict = boundary = type_ref = type_hyp = 0;
+    tag_refcount.resize(tc);
+    tag_hypcount.resize(tc);
+    tag_strict.resize(tc);
+  }
+};
+
+// Open addressing table of spans, the type is -1 when ignored
+class span_table {
+  struct slot {
+    text_pos start, end;
+    int type;
+    entity_id e;
+  };
+
+  vector<slot> slots;
+  unsigned int mask;
+
+  static unsigned int hash(text_pos start, text_pos end, int type) {
+    uint64_t h = uint64_t(start) * 0x9e3779b97f4a7c15ULL;
+    h ^= uint64_t(end) + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+    h ^= uint64_t(type + 1) * 0xff51afd7ed558ccdULL;
+    return h ^ (h >> 32);
+  }
+
+public:
+  span_table(unsigned int n) {
+    unsigned int size = 16;
+    while(size < 2*n)
+      size <<= 1;
+    slot s;
+    s.e = NO_ENTITY;
+    slots.assign(size, s);
+    mask = size-1;
+  }
+
+  void add(text_pos start, text_pos end, int type, entity_id e) {
+    unsigned int h = hash(start, end, type) & mask;
+    while(slots[h].e != NO_ENTITY)
+      h = (h+1) & mask;
+    slots[h].start = start;
+    slots[h].end = end;
+    slots[h].type = type;
+    slots[h].e = e;
+  }
+
+  // First entity on that span not paired yet, NO_ENTITY if none
+  entity_id find(text_pos start, text_pos end, int type, const vector<bool> &paired) const {
+    for(unsigned int h = hash(start, end, type) & mask; slots[h].e != NO_ENTITY; h = (h+1) & mask) {
+      const slot &s = slots[h];
+      if(s.start == start && s.end == end && s.type == type && !paired[s.e])
+	return s.e;
+    }
+    return NO_ENTITY;
+  }
+};
+
+static int conll_pairs(const entity_store &es, entity_id first_hyp, bool typed, conll_counts *cc)
+{
+  unsigned int n = 0;
+  for(entity_id e = 0; e != first_hyp; e++)
+    n += es.nstart(e) * es.nend(e);
+  span_table spans(n);
+  for(entity_id e = 0; e != first_hyp; e++)
+    for(unsigned int i = 0; i != es.nstart(e); i++)
+      for(unsigned int j = 0; j != es.nend(e); j++)
+	spans.add(es.start(e, i), es.end(e, j), typed ? es.tagid[e] : -1, e);
+
+  vector<bool> paired(first_hyp);
+  int count = 0;
+  for(entity_id e = first_hyp; e != es.size(); e++) {
+    entity_id er = spans.find(es.start(e, 0), es.end(e, es.nend(e)-1), typed ? es.tagid[e] : -1, paired);
+    if(er == NO_ENTITY)
+      continue;
+    paired[er] = true;
+    count++;
+    if(cc)
+      cc->tag_strict[es.tagid[e]]++;
+  }
+  return count;
+}
+
+// Widest span of each entity of one side, by type then start, with
+// the running maximum of the ends
+struct conll_span {
+  int type;
+  text_pos start, end, max_end;
+  bool operator<(const conll_span &s) const { return type < s.type || (type == s.type && start < s.start); }
+};
+
+static void conll_spans(const entity_store &es, entity_id first, entity_id last, vector<conll_span> &spans)
+{
+  for(entity_id e = first; e != last; e++) {
+    conll_span s;
+    s.type = es.tagid[e];
+    s.start = es.start(e, 0);
+    s.end = es.end(e, es.nend(e)-1);
+    spans.push_back(s);
+  }
+  sort(spans.begin(), spans.end());
+  for(unsigned int i = 0; i != spans.size(); i++)
+    spans[i].max_end = i && spans[i-1].type == spans[i].type && spans[i-1].max_end > spans[i].end ? spans[i-1].max_end : spans[i].end;
+}
+
+// Count the spans of a overlapping at least one span of b with the same type
+static int conll_overlaps(const vector<conll_span> &a, const vector<conll_span> &b)
+{
+  int count = 0;
+  for(vector<conll_span>::const_iterator i = a.begin(); i != a.end(); i++) {
+    // Last span of b of that type starting before the end of i
+    conll_span key;
+    key.type = i->type;
+    key.start = i->end;
+    vector<conll_span>::const_iterator j = lower_bound(b.begin(), b.end(), key);
+    if(j == b.begin())
+      continue;
+    --j;
+    if(j->type == i->type && j->max_end > i->start)
+      count++;
+  }
+  return count;
+}
+
+void add_conll_counts(const entity_store &es, entity_id first_hyp, conll_counts &cc)
+{
+  cc.count_ref += first_hyp;
+  cc.count_hyp += es.size() - first_hyp;
+  for(entity_id e = 0; e != es.size(); e++)
+    if(es.hyp[e])
+      cc.tag_hypcount[es.tagid[e]]++;
+    else
+      cc.tag_refcount[es.tagid[e]]++;
+
+  cc.strict += conll_pairs(es, first_hyp, true, &cc);
+  cc.boundary += conll_pairs(es, first_hyp, false, 0);
+
+  vector<conll_span> ref_spans, hyp_spans;
+  conll_spans(es, 0, first_hyp, ref_spans);
+  conll_spans(es, first_hyp, es.size(), hyp_spans);
+  cc.type_ref += conll_overlaps(ref_spans, hyp_spans);
+  cc.type_hyp += conll_overlaps(hyp_spans, ref_spans);
+}
+
+void calc_scores(const entity_store &es, const vector<segment> &segments, int &tc, vector<int> &tag_hypcount, vector<int> &tag_refcount, vector<int> &tag_correct, double &ser, int &count_insert, int &count_delete, int &count_subst, int &count_correct, int &count_total)
+{
+  score_counts sc;
+  add_scores(es, segments, sc);
+  tc = sc.tc;
+  tag_hypcount = sc.tag_hypcount;
+  tag_refcount = sc.tag_refcount;
+  tag_correct = sc.tag_correct;
+  ser = sc.ser;
+  count_insert = sc.count_insert;
+  count_delete = sc.count_delete;
+  count_subst = sc.count_subst;
+  count_correct = sc.count_correct;
+  count_total = sc.count_total;
+}
+
+// Costs summed in a different order can differ in the last bits
+static inline bool same_cost(double c1, double c2)
+{
+  return fabs(c1 - c2) <= 1e-9*(1+fabs(c2));
+}
+
+// Compare the scores of two alignments, true if they differ
+bool verify_totals(const entity_store &es, const vector<segment> &segments, const vector<segment> &vsegments)
+{
+  int tc, count_insert, count_delete, count_subst, count_correct, count_total;
+  int vtc, vcount_insert, vcount_delete, vcount_subst, vcount_correct, vcount_total;
+  double ser, vser;
+  vector<int> hypcount, refcount, correct, vhypcount, vrefcount, vcorrect;
+  calc_scores(es, segments, tc, hypcount, refcount, correct, ser, count_insert, count_delete, count_subst, count_correct, count_total);
+  calc_scores(es, vsegments, vtc, vhypcount, vrefcount, vcorrect, vser, vcount_insert, vcount_delete, vcount_subst, vcount_correct, vcount_total);
+
+  bool differ = false;
+  if(!same_cost(ser, vser) || count_insert != vcount_insert || count_delete != vcount_delete || count_subst != vcount_subst || count_correct != vcount_correct) {
+    fprintf(stderr, "Verify: totals differ, fast SER cost %g (I=%d D=%d S=%d C=%d) vs. exhaustive %g (I=%d D=%d S=%d C=%d)\n",
+	    ser, count_insert, count_delete, count_subst, count_correct,
+	    vser, vcount_insert, vcount_delete, vcount_subst, vcount_correct);
+    differ = true;
+  }
+  for(int i=0; i != tc; i++)
+    if(hypcount[i] != vhypcount[i] || refcount[i] != vrefcount[i] || correct[i] != vcorrect[i]) {
+      fprintf(stderr, "Verify: %s counts differ, fast hyp=%d ref=%d correct=%d vs. exhaustive hyp=%d ref=%d correct=%d\n",
+	      tag_names[i].c_str(), hypcount[i], refcount[i], correct[i], vhypcount[i], vrefcount[i], vcorrect[i]);
+      differ = true;
+    }
+  return differ;
+}
+
+// Compare a sweep scoring with the exhaustive search pairing by
+// pairing, then on the totals.  Returns the number of differences.
+int verify_sweep(const entity_store &es, const vector<segment> &segments, const vector<segment> &vsegments)
+{
+  set<pair<entity_id, entity_id> > pairs, vpairs;
+  for(vector<segment>::const_iterator i = segments.begin(); i != segments.end(); i++)
+    for(list<segment::pairinfo>::const_iterator j = i->added_pairs.begin(); j != i->added_pairs.end(); j++)
+      pairs.insert(pair<entity_id, entity_id>(j->er, j->eh));
+  for(vector<segment>::const_iterator i = vsegments.begin(); i != vsegments.end(); i++)
+    for(list<segment::pairinfo>::const_iterator j = i->added_pairs.begin(); j != i->added_pairs.end(); j++)
+      vpairs.insert(pair<entity_id, entity_id>(j->er, j->eh));
+
+  int mismatches = 0;
+  for(set<pair<entity_id, entity_id> >::const_iterator j = pairs.begin(); j != pairs.end(); j++)
+    if(vpairs.find(*j) == vpairs.end()) {
+      fprintf(stderr, "Verify: only sweep:      %s %d:%d - %s %d:%d\n",
+	      tag_names[es.tagid[j->first]].c_str(), es.line[j->first], es.col[j->first],
+	      tag_names[es.tagid[j->second]].c_str(), es.line[j->second], es.col[j->second]);
+      mismatches++;
+    }
+  for(set<pair<entity_id, entity_id> >::const_iterator j = vpairs.begin(); j != vpairs.end(); j++)
+    if(pairs.find(*j) == pairs.end()) {
+      fprintf(stderr, "Verify: only exhaustive: %s %d:%d - %s %d:%d\n",
+	      tag_names[es.tagid[j->first]].c_str(), es.line[j->first], es.col[j->first],
+	      tag_names[es.tagid[j->second]].c_str(), es.line[j->second], es.col[j->second]);
+      mismatches++;
+    }
+  if(verify_totals(es, segments, vsegments) && !mismatches)
+    mismatches++;
+
+  fprintf(stderr, "Verify: flat sweep, %d pairs, %d mismatches\n", int(pairs.size()), mismatches);
+  return mismatches;
+}
+
+// Compare the alignment given by the fast strategies with the
+// exhaustive one, group by group then on the totals.  Returns the
+// number of mismatching groups.
+int verify_alignment(const entity_store &es, const vector<segment> &segments, const vector<segment> &vsegments, const vector<segment_group> &groups,
+		     const map<entity_id, frontier_choice> &align_frontiers, const map<entity_id, frontier_choice> &valign_frontiers)
+{
+  int fast_groups = 0, mismatches = 0;
+  for(vector<segment_group>::const_iterator g = groups.begin(); g != groups.end(); g++) {
+    if(!g->aligner)
+      continue;
+    fast_groups++;
+
+    set<pair<entity_id, entity_id> > pairs, vpairs;
+    set<entity_id> unmapped, vunmapped;
+    double cost = 0, vcost = 0;
+    bool frontiers_differ = false;
+    for(unsigned int i = g->first; i != g->last; i++) {
+      for(list<segment::pairinfo>::const_iterator j = segments[i].added_pairs.begin(); j != segments[i].added_pairs.end(); j++) {
+	pairs.insert(pair<entity_id, entity_id>(j->er, j->eh));
+	cost += j->error->cost;
+	map<entity_id, frontier_choice>::const_iterator f1 = align_frontiers.find(j->er);
+	map<entity_id, frontier_choice>::const_iterator f2 = valign_frontiers.find(j->er);
+	if(f1 == align_frontiers.end() || f2 == valign_frontiers.end() || f1->second != f2->second)
+	  frontiers_differ = true;
+      }
+      for(list<segment::pairinfo>::const_iterator j = vsegments[i].added_pairs.begin(); j != vsegments[i].added_pairs.end(); j++) {
+	vpairs.insert(pair<entity_id, entity_id>(j->er, j->eh));
+	vcost += j->error->cost;
+      }
+      for(list<entity_id>::const_iterator j = segments[i].unmapped_entities.begin(); j != segments[i].unmapped_entities.end(); j++) {
+	unmapped.insert(*j);
+	cost += es.unmapped_error(*j).cost;
+      }
+      for(list<entity_id>::const_iterator j = vsegments[i].unmapped_entities.begin(); j != vsegments[i].unmapped_entities.end(); j++) {
+	vunmapped.insert(*j);
+	vcost += es.unmapped_error(*j).cost;
+      }
+    }
+
+    if(pairs == vpairs && unmapped == vunmapped && !frontiers_differ && same_cost(cost, vcost))
+      continue;
+
+    mismatches++;
+    entity_id e0 = g->refs.empty() ? g->hyps[0] : g->refs[0];
+    fprintf(stderr, "Verify: %s mismatch at line %d (offsets %lld-%lld), cost %g vs. exhaustive %g\n",
+	    g->aligner, es.line[e0], (long long)segments[g->first].start, (long long)segments[g->last-1].end, cost, vcost);
+    for(set<pair<entity_id, entity_id> >::const_iterator j = pairs.begin(); j != pairs.end(); j++)
+      if(vpairs.find(*j) == vpairs.end())
+	fprintf(stderr, "  only fast:       %s %d:%d - %s %d:%d\n",
+		tag_names[es.tagid[j->first]].c_str(), es.line[j->first], es.col[j->first],
+		tag_names[es.tagid[j->second]].c_str(), es.line[j->second], es.col[j->second]);
+    for(set<pair<entity_id, entity_id> >::const_iterator j = vpairs.begin(); j != vpairs.end(); j++)
+      if(pairs.find(*j) == pairs.end())
+	fprintf(stderr, "  only exhaustive: %s %d:%d - %s %d:%d\n",
+		tag_names[es.tagid[j->first]].c_str(), es.line[j->first], es.col[j->first],
+		tag_names[es.tagid[j->second]].c_str(), es.line[j->second], es.col[j->second]);
+    if(frontiers_differ)
+      fprintf(stderr, "  frontier choices differ\n");
+  }
+
+  if(verify_totals(es, segments, vsegments) && !mismatches)
+    mismatches++;
+
+  fprintf(stderr, "Verify: %d groups, %d aligned by fast strategies, %d mismatches\n", int(groups.size()), fast_groups, mismatches);
+  return mismatches;
+}
+
+void show_summary(const score_counts &sc, int count_ref, int count_hyp)
+{
+  int tc = sc.tc, count_insert = sc.count_insert, count_delete = sc.count_delete, count_subst = sc.count_subst;
+  int count_correct = sc.count_correct, count_total = sc.count_total;
+  double ser = sc.ser;
+  const vector<int> &tag_hypcount = sc.tag_hypcount, &tag_refcount = sc.tag_refcount, &tag_correct = sc.tag_correct;
+
+  printf("Slot Error Rate: %5.1f%% (%g %d)\n\n", ser*100.0/count_ref, ser, count_ref);
+
+  printf("%6d %5.1f%% corrects\n", count_correct, count_correct*100.0/count_ref);
+  printf("%6d %5.1f%% inserts\n", count_insert, count_insert*100.0/count_ref);
+  printf("%6d %5.1f%% deletes\n", count_delete, count_delete*100.0/count_ref);
+  printf("%6d %5.1f%% substitutions\n", count_subst, count_subst*100.0/count_ref);
+  printf("%6d %5.1f%% total errors\n\n", count_total, count_total*100.0/count_ref);
+  if(count_hyp)
+    printf("%5.1f%% overall precision (%d entities in hypothesis)\n", count_correct*100.0/count_hyp, count_hyp);
+  else
+    printf("   0.0%% overall precision (0 entities in hypothesis)\n");
+  printf("%5.1f%% overall recall (%d entities in reference)\n", count_correct*100.0/count_ref, count_ref);
+  printf("%5.1f%% overall F-measure\n\n", 2*count_correct*100.0/(count_ref+count_hyp));  
+
+  printf("   P      R      F   tag\n");
+  for(int i=0; i != tc; i++) {
+    double cc = 100*tag_correct[i];
+    if(tag_hypcount[i] + tag_refcount[i])
+      printf("%5.1f%% %5.1f%% %5.1f%% %s (hyp_count=%d, ref_count=%d, correct=%d)\n",
+	     tag_hypcount[i] ? cc/tag_hypcount[i] : 0,
+	     tag_refcount[i] ? cc/tag_refcount[i] : 0,
+	     tag_hypcount[i] + tag_refcount[i] ? 2*cc/(tag_hypcount[i] + tag_refcount[i]) : 0,
+	     tag_names[i].c_str(),
+	     tag_hypcount[i], tag_refcount[i], tag_correct[i]
+	     );
+  }
+}
+
+/*
+
+Coef = (a0-ae)/(1-ae)
+
+A0 = correct / total = (rc + ovc)/(rt + ovc)
+
+AeS = 1/|T| (-> tend vers 1, rien a faire)
+
+AePi = 1/(2*total)^2 * sum((correct(tag, a1) + correct(tag, a2))^2)
+
+AeKappa = 1/(total_a*total_b) * sum(correct(tag,a1)*correct(tag,a2))
+
+SumPi = sum((correct(tag, a1) + correct(tag, a2))^2)
+SumKappa = sum(correct(tag,a1)*correct(tag,a2))
+
+AePi = 1/(2*total)^2 * (SumPi + (va1+va2+2*ovc)^2)
+
+AeKappa = 1/((rt1+va1+ovc)*(rt2+va2+ovc)) * (SumKappa + (va1+ovc)*(va2+ovc))
+
+*/
+
+struct iag_values {
+  double rt, ovc;
+  int count_correct, tc;
+  double r_S, r_pi, r_kappa, r_fm;
+};
+
+void calc_iag(const score_counts &sc, int count_ref, int count_hyp, iag_values &iv)
+{
+  int tc = sc.tc, count_subst = sc.count_subst, count_correct = sc.count_correct;
+  const vector<int> &tag_hypcount = sc.tag_hypcount, &tag_refcount = sc.tag_refcount;
+
+  double void_hyp, void_ref, rt;
+  if(opt_open) {
+    void_hyp = count_ref - count_correct;
+    void_ref = count_hyp - count_correct;
+    rt = count_correct + void_hyp + void_ref;
+
+  } else {
+    void_hyp = count_ref - count_correct - count_subst;
+    void_ref = count_hyp - count_correct - count_subst;
+    rt = count_correct + count_subst + void_hyp + void_ref;
+  }
+  double ovc = opt_expected_count - rt;
+  if(ovc<0)
+    ovc = 0;
+
+  double A0 = ovc ? (1+count_correct/ovc)/(1+rt/ovc) : count_correct/rt;
+  double AeS = 1/double(tc+1);
+  double r_S = (A0-AeS)/(1-AeS);
+
+  double SigmaPi = (void_hyp+void_ref)*(void_hyp+void_ref);
+  double SigmaKappa = void_hyp*void_ref;
+
+  for(int i=0; i<tc; i++) {
+    double cpi = double(tag_hypcount[i]+tag_refcount[i]);
+    SigmaPi += cpi*cpi;
+    SigmaKappa += double(tag_hypcount[i])*double(tag_refcount[i]);
+  }
+
+  double r_pi, r_kappa;
+
+  if(ovc) {
+    r_pi = (8*count_correct-4*(rt-count_correct) + (4*count_correct*rt - SigmaPi)/ovc)/(8*count_correct + (4*rt*rt - SigmaPi)/ovc);
+    r_kappa = (2*count_correct + (count_correct*rt - SigmaKappa)/ovc)/(count_correct+rt + (rt*rt - SigmaKappa)/ovc);
+  } else {
+    r_pi = (4*count_correct*rt - SigmaPi)/(4*rt*rt - SigmaPi);
+    r_kappa = (count_correct*rt - SigmaKappa)/(rt*rt - SigmaKappa);
+  }
+
+  double r_fm = 2*count_correct/double(count_ref + count_hyp);
+
+  iv.rt = rt;
+  iv.ovc = ovc;
+  iv.count_correct = count_correct;
+  iv.tc = tc;
+  iv.r_S = r_S;
+  iv.r_pi = r_pi;
+  iv.r_kappa = r_kappa;
+  iv.r_fm = r_fm;
+}
+
+void show_iag(const score_counts &sc, int count_ref, int count_hyp)
+{
+  iag_values iv;
+  calc_iag(sc, count_ref, count_hyp, iv);
+
+  printf("Total entities: %d\n", int(iv.rt));
+  printf("Correct: %d\n", iv.count_correct);
+  printf("Added void/void corrects: %g\n", iv.ovc);
+  printf("Tag types: %d\n", iv.tc);
+  printf("\n");
+  printf("S         = %7.5f\n", iv.r_S);
+  printf("Pi        = %7.5f\n", iv.r_pi);
+  printf("Kappa     = %7.5f\n", iv.r_kappa);
+  printf("F-measure = %7.5f\n", iv.r_fm);
+}
+
+void show_tokens(const token_counts &tk)
+{
+  printf("Token accuracy: %5.1f%% (%ld correct over %ld tokens)\n\n", tk.total ? tk.correct*100.0/tk.total : 0, tk.correct, tk.total);
+
+  // Only the labels seen on either side, columns as wide as their name
+  vector<int> used;
+  int nw = 1;
+  for(int i=0; i != tk.nl; i++) {
+    long c = 0;
+    for(int j=0; j != tk.nl; j++)
+      c += tk.confusion[i*tk.nl + j] + tk.confusion[j*tk.nl + i];
+    if(c) {
+      used.push_back(i);
+      int l = strlen(token_label(i));
+      if(l > nw)
+	nw = l;
+    }
+  }
+  int cw = 1;
+  for(long t = tk.total; t >= 10; t /= 10)
+    cw++;
+
+  printf("Token confusion, reference in rows, hypothesis in columns:\n");
+  printf("%*s", nw, "");
+  for(vector<int>::const_iterator j = used.begin(); j != used.end(); j++) {
+    int l = strlen(token_label(*j));
+    printf(" %*s", l > cw ? l : cw, token_label(*j));
+  }
+  printf("\n");
+  for(vector<int>::const_iterator i = used.begin(); i != used.end(); i++) {
+    printf("%-*s", nw, token_label(*i));
+    for(vector<int>::const_iterator j = used.begin(); j != used.end(); j++) {
+      int l = strlen(token_label(*j));
+      printf(" %*ld", l > cw ? l : cw, tk.confusion[*i*tk.nl + *j]);
+    }
+    printf("\n");
+  }
+}
+
+// Precision, recall and F-measure of the three CoNLL matches
+struct conll_prf {
+  const char *name;
+  double p, r, f;
+};
+
+static void conll_values(const conll_counts &cc, conll_prf *v)
+{
+  int hc[3] = { cc.strict, cc.type_hyp, cc.boundary };
+  int rc[3] = { cc.strict, cc.type_ref, cc.boundary };
+  static const char *const names[3] = { "strict", "type", "boundary" };
+  for(int i=0; i != 3; i++) {
+    v[i].name = names[i];
+    v[i].p = cc.count_hyp ? hc[i]/double(cc.count_hyp) : 0;
+    v[i].r = cc.count_ref ? rc[i]/double(cc.count_ref) : 0;
+    v[i].f = v[i].p + v[i].r ? 2*v[i].p*v[i].r/(v[i].p + v[i].r) : 0;
+  }
+}
+
+void show_conll(const conll_counts &cc)
+{
+  conll_prf v[3];
+  conll_values(cc, v);
+
+  printf("CoNLL span scores (%d entities in reference, %d in hypothesis)\n\n", cc.count_ref, cc.count_hyp);
+  printf("   P      R      F   match\n");
+  printf("%5.1f%% %5.1f%% %5.1f%% strict, same span and type (%d pairs)\n", v[0].p*100, v[0].r*100, v[0].f*100, cc.strict);
+  printf("%5.1f%% %5.1f%% %5.1f%% type, overlapping span of the same type (hyp=%d, ref=%d)\n", v[1].p*100, v[1].r*100, v[1].f*100, cc.type_hyp, cc.type_ref);
+  printf("%5.1f%% %5.1f%% %5.1f%% boundary, same span whatever the type (%d pairs)\n\n", v[2].p*100, v[2].r*100, v[2].f*100, cc.boundary);
+
+  printf("   P      R      F   tag, strict\n");
+  for(int i=0; i != cc.tc; i++) {
+    double c = 100*cc.tag_strict[i];
+    if(cc.tag_hypcount[i] + cc.tag_refcount[i])
+      printf("%5.1f%% %5.1f%% %5.1f%% %s (hyp_count=%d, ref_count=%d, correct=%d)\n",
+	     cc.tag_hypcount[i] ? c/cc.tag_hypcount[i] : 0,
+	     cc.tag_refcount[i] ? c/cc.tag_refcount[i] : 0,
+	     2*c/(cc.tag_hypcount[i] + cc.tag_refcount[i]),
+	     tag_names[i].c_str(),
+	     cc.tag_hypcount[i], cc.tag_refcount[i], cc.tag_strict[i]
+	     );
+  }
+}
+
+// Structured output (--format json|csv|bin), everything goes
+// through one buffered writer on stdout.
+
+// One entity of an alignment record, offsets are in the reference
+// text, with the frontiers chosen by the alignment
+struct record_entity {
+  const char *side, *file;
+  int line, depth;
+  text_pos start, end;
+  string tag, value, attrs;
+};
+
+void get_record_entity(const entity_store &es, entity_id e, const char *data, const map<entity_id, frontier_choice> &fm,
+		       const char *rfname, const char *hfname, text_pos base, record_entity &re)
+{
+  int sf = 0;
+  int ef = es.nend(e)-1;
+  map<entity_id, frontier_choice>::const_iterator i = fm.find(e);
+  if(i != fm.end()) {
+    sf = i->second.sf;
+    ef = i->second.ef;
+  }
+  re.side = es.hyp[e] ? "hyp" : "ref";
+  re.file = es.hyp[e] ? hfname : rfname;
+  re.line = es.line[e];
+  re.depth = es.depth[e];
+  re.start = es.start(e, sf);
+  re.end = es.end(e, ef);
+  re.tag = tag_names[es.tagid[e]];
+  re.value.assign(data + re.start, data + re.end);
+  re.start += base;
+  re.end += base;
+  re.attrs.clear();
+  for(const pair<int, int> *j = es.attr_begin(e); j != es.attr_end(e); j++) {
+    if(j != es.attr_begin(e))
+      re.attrs += ' ';
+    re.attrs += attr_string(j->first) + '=' + attr_string(j->second);
+  }
+}
+
+// Records in the same order as show_details, cls is the class
+// letter, C/S/I/D
+struct result_record {
+  char cls;
+  vector<int> errors;
+  double cost;
+  int nent;
+  record_entity ent[2];
+};
+
+void write_record_json(out_writer &w, const result_record &r, bool first)
+{
+  w.put(first ? "\n    {" : ",\n    {");
+  w.put("\"class\": \"");
+  w.put(r.cls);
+  w.put("\", \"errors\": [");
+  for(unsigned int i = 0; i != r.errors.size(); i++) {
+    if(i)
+      w.put(", ");
+    w.put_json(error_names[r.errors[i]]);
+  }
+  w.put("], \"cost\": ");
+  w.put_double(r.cost);
+  for(int i = 0; i != r.nent; i++) {
+    const record_entity &re = r.ent[i];
+    w.put(", \"");
+    w.put(re.side);
+    w.put("\": {\"file\": ");
+    w.put_json(re.file, strlen(re.file));
+    w.put(", \"line\": ");
+    w.put_int(re.line);
+    w.put(", \"depth\": ");
+    w.put_int(re.depth);
+    w.put(", \"start\": ");
+    w.put_int(re.start);
+    w.put(", \"end\": ");
+    w.put_int(re.end);
+    w.put(", \"tag\": ");
+    w.put_json(re.tag);
+    w.put(", \"attrs\": ");
+    w.put_json(re.attrs);
+    w.put(", \"value\": ");
+    w.put_json(re.value);
+    w.put('}');
+  }
+  w.put('}');
+}
+
+void write_record_csv(out_writer &w, const result_record &r)
+{
+  w.put(r.cls);
+  w.put(',');
+  string e;
+  for(unsigned int i = 0; i != r.errors.size(); i++) {
+    if(i)
+      e += ' ';
+    e += error_names[r.errors[i]];
+  }
+  w.put_csv(e);
+  w.put(',');
+  w.put_double(r.cost);
+  const record_entity *re[2] = { 0, 0 };
+  for(int i = 0; i != r.nent; i++)
+    re[r.ent[i].side[0] == 'h'] = r.ent + i;
+  for(int i = 0; i != 2; i++) {
+    if(!re[i]) {
+      w.put(",,,,,,,,");
+      continue;
+    }
+    w.put(',');
+    w.put_csv(re[i]->file, strlen(re[i]->file));
+    w.put(',');
+    w.put_int(re[i]->line);
+    w.put(',');
+    w.put_int(re[i]->depth);
+    w.put(',');
+    w.put_int(re[i]->start);
+    w.put(',');
+    w.put_int(re[i]->end);
+    w.put(',');
+    w.put_csv(re[i]->tag);
+    w.put(',');
+    w.put_csv(re[i]->attrs);
+    w.put(',');
+    w.put_csv(re[i]->value);
+  }
+  w.put('\n');
+}
+
+void write_record_bin(out_writer &w, const result_record &r)
+{
+  w.put_u8(r.cls);
+  w.put_u32(r.errors.size());
+  for(unsigned int i = 0; i != r.errors.size(); i++)
+    w.put_bin(error_names[r.errors[i]]);
+  w.put_f64(r.cost);
+  w.put_u8(r.nent);
+  for(int i = 0; i != r.nent; i++) {
+    const record_entity &re = r.ent[i];
+    w.put_u8(re.side[0] == 'h');
+    w.put_u32(re.line);
+    w.put_u32(re.depth);
+    w.put_u64(re.start);
+    w.put_u64(re.end);
+    w.put_bin(re.tag);
+    w.put_bin(re.attrs);
+    w.put_bin(re.value);
+  }
+}
+
+// Write the selected records, count is the number of records written
+// so far, base is added to the offsets
+void write_records(out_writer &w, const entity_store &es, const vector<segment> &segments, const char *data,
+		   const map<entity_id, frontier_choice> &fm, const char *rfname, const char *hfname, long &count, text_pos base = 0)
+{
+  result_record r;
+  for(vector<segment>::const_iterator i = segments.begin(); i != segments.end(); i++) {
+    for(list<entity_id>::const_iterator j = i->unmapped_entities.begin(); j != i->unmapped_entities.end(); j++) {
+      entity_id e = *j;
+      error_d err = es.unmapped_error(e);
+      r.cls = es.hyp[e] ? 'I' : 'D';
+      if(!detail_selected(es, r.cls, err, e, entity_id(-1)))
+	continue;
+      error_ids(err, r.errors);
+      r.cost = err.cost;
+      r.nent = 1;
+      get_record_entity(es, e, data, fm, rfname, hfname, base, r.ent[0]);
+      if(opt_format == FORMAT_JSON)
+	write_record_json(w, r, !count);
+      else if(opt_format == FORMAT_CSV)
+	write_record_csv(w, r);
+      else
+	write_record_bin(w, r);
+      count++;
+    }
+
+    for(list<segment::pairinfo>::const_iterator j = i->added_pairs.begin(); j != i->added_pairs.end(); j++) {
+      r.cls = j->error->error_set ? 'S' : 'C';
+      if(!detail_selected(es, r.cls, *j->error, j->er, j->eh))
+	continue;
+      error_ids(*j->error, r.errors);
+      r.cost = j->error->cost;
+      r.nent = 2;
+      get_record_entity(es, j->er, data, fm, rfname, hfname, base, r.ent[0]);
+      get_record_entity(es, j->eh, data, fm, rfname, hfname, base, r.ent[1]);
+      if(opt_format == FORMAT_JSON)
+	write_record_json(w, r, !count);
+      else if(opt_format == FORMAT_CSV)
+	write_record_csv(w, r);
+      else
+	write_record_bin(w, r);
+      count++;
+    }
+  }
+}
+
+static void csv_metric(out_writer &w, const char *metric, const string &tag, double v)
+{
+  w.put(metric);
+  w.put(',');
+  w.put_csv(tag);
+  w.put(',');
+  w.put_double(v);
+  w.put('\n');
+}
+
+/*
+
+Binary layout (--format bin), integers u32 and doubles f64, all
+little-endian, strings are a u32 length followed by the bytes:
+
+  "NESB" u32:version(2)
+  then sections, each starting with a u8 id, until id 0:
+  1 summary:  f64:ser_cost u32:ref_count u32:hyp_count u32:correct
+              u32:insert u32:delete u32:substitution
+  2 tags:     u32:count, then per tag string:name u32:hyp_count
+              u32:ref_count u32:correct
+  3 iag:      f64:total f64:void_void_corrects u32:correct u32:types
+              f64:S f64:Pi f64:Kappa f64:F
+  4 records:  per record u8:class ('C', 'S', 'I' or 'D'), u32:error count
+              then the error names as strings, f64:cost, u8:entity count
+              then per entity u8:is_hyp u32:line u32:depth u64:start
+              u64:end string:tag string:attrs string:value;
+              a class byte of 0 ends the section
+  5 tokens:   u64:total u64:correct u32:labels, then per label
+              string:name ("O" first, then the tags), then labels x
+              labels u64:count, reference major
+  6 conll:    u32:ref_count u32:hyp_count u32:strict u32:type_hyp
+              u32:type_ref u32:boundary u32:count, then per tag
+              string:name u32:hyp_count u32:ref_count u32:strict;
+              written alone with --conll
+
+*/
+
+// Where the records come from, the alignment itself or a file where
+// the pipeline already rendered them
+struct records_source {
+  const entity_store *es;
+  const vector<segment> *segments;
+  const char *data;
+  const map<entity_id, frontier_choice> *fm;
+  FILE *rendered;
+  long count;
+
+  records_source() { es = 0; segments = 0; data = 0; fm = 0; rendered = 0; count = 0; }
+};
+
+void emit_records(out_writer &w, records_source &rs, const char *rfname, const char *hfname)
+{
+  if(!rs.rendered) {
+    write_records(w, *rs.es, *rs.segments, rs.data, *rs.fm, rfname, hfname, rs.count);
+    return;
   }
-  return s;
+  w.flush();
+  rewind(rs.rendered);
+  char buf[65536];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), rs.rendered)) > 0)
+    w.put(buf, n);
 }
 
-void show_entity(const entity *e, const char *data, char error, const map<entity *, frontier_choice> &fm)
+void write_results(const score_counts &sc, const token_counts &tk, int count_ref, int count_hyp, const char *rfname, const char *hfname, records_source &rs)
 {
-  char *ebuf;
-  if(e->start.size() != 1 || e->end.size() != 1) {
-    int sf = 0, ef = e->end.size()-1;
-    map<entity *, frontier_choice>::const_iterator fi = fm.find(const_cast<entity *>(e));
-    if(fi != fm.end()) {
-      sf = fi->second.sf;
-      ef = fi->second.ef;
+  int tc = sc.tc, count_insert = sc.count_insert, count_delete = sc.count_delete, count_subst = sc.count_subst;
+  int count_correct = sc.count_correct, count_total = sc.count_total;
+  double ser = sc.ser;
+  const vector<int> &tag_hypcount = sc.tag_hypcount, &tag_refcount = sc.tag_refcount, &tag_correct = sc.tag_correct;
+
+  iag_values iv;
+  if(opt_iag)
+    calc_iag(sc, count_ref, count_hyp, iv);
+
+  double precision = count_hyp ? count_correct/double(count_hyp) : 0;
+  double recall = count_ref ? count_correct/double(count_ref) : 0;
+  double fmeasure = count_ref + count_hyp ? 2*count_correct/double(count_ref + count_hyp) : 0;
+
+  out_writer w(stdout);
+
+  switch(opt_format) {
+  case FORMAT_JSON:
+    w.put("{\n  \"ref_file\": ");
+    w.put_json(rfname, strlen(rfname));
+    w.put(",\n  \"hyp_file\": ");
+    w.put_json(hfname, strlen(hfname));
+    if(opt_summary) {
+      w.put(",\n  \"summary\": {\"ser\": ");
+      w.put_double(count_ref ? ser/count_ref : 0);
+      w.put(", \"ser_cost\": ");
+      w.put_double(ser);
+      w.put(", \"ref_count\": ");
+      w.put_int(count_ref);
+      w.put(", \"hyp_count\": ");
+      w.put_int(count_hyp);
+      w.put(", \"correct\": ");
+      w.put_int(count_correct);
+      w.put(", \"insert\": ");
+      w.put_int(count_insert);
+      w.put(", \"delete\": ");
+      w.put_int(count_delete);
+      w.put(", \"substitution\": ");
+      w.put_int(count_subst);
+      w.put(", \"total_errors\": ");
+      w.put_int(count_total);
+      w.put(", \"precision\": ");
+      w.put_double(precision);
+      w.put(", \"recall\": ");
+      w.put_double(recall);
+      w.put(", \"f_measure\": ");
+      w.put_double(fmeasure);
+      w.put("},\n  \"tags\": [");
+      bool first = true;
+      for(int i=0; i != tc; i++) {
+	if(!(tag_hypcount[i] + tag_refcount[i]))
+	  continue;
+	double cc = tag_correct[i];
+	w.put(first ? "\n    {\"tag\": " : ",\n    {\"tag\": ");
+	first = false;
+	w.put_json(tag_names[i]);
+	w.put(", \"precision\": ");
+	w.put_double(tag_hypcount[i] ? cc/tag_hypcount[i] : 0);
+	w.put(", \"recall\": ");
+	w.put_double(tag_refcount[i] ? cc/tag_refcount[i] : 0);
+	w.put(", \"f_measure\": ");
+	w.put_double(2*cc/(tag_hypcount[i] + tag_refcount[i]));
+	w.put(", \"hyp_count\": ");
+	w.put_int(tag_hypcount[i]);
+	w.put(", \"ref_count\": ");
+	w.put_int(tag_refcount[i]);
+	w.put(", \"correct\": ");
+	w.put_int(tag_correct[i]);
+	w.put('}');
+      }
+      w.put(first ? "]" : "\n  ]");
     }
-    
-    string ff;
-    map<int, int> fr;
-    for(vector<int>::const_iterator i = e->start.begin(); i != e->start.end(); i++)
-      fr[*i] |= 1;
-    for(vector<int>::const_iterator i = e->end.begin(); i != e->end.end(); i++)
-      fr[*i] |= 2;
-    int pos = -1;
-    for(map<int, int>::const_iterator i = fr.begin(); i != fr.end(); i++) {
-      if(pos != -1)
-	ff += string(data+pos, data+i->first);
-      pos = i->first;
-      if(i->second & 2)
-	ff += pos == e->end[ef] ? '}' : ']';
-      if(i->second & 1)
-	ff += pos == e->start[sf] ? '{' : '[';
+    if(opt_iag) {
+      w.put(",\n  \"iag\": {\"total\": ");
+      w.put_double(iv.rt);
+      w.put(", \"correct\": ");
+      w.put_int(iv.count_correct);
+      w.put(", \"void_void_corrects\": ");
+      w.put_double(iv.ovc);
+      w.put(", \"types\": ");
+      w.put_int(iv.tc);
+      w.put(", \"S\": ");
+      w.put_double(iv.r_S);
+      w.put(", \"Pi\": ");
+      w.put_double(iv.r_pi);
+      w.put(", \"Kappa\": ");
+      w.put_double(iv.r_kappa);
+      w.put(", \"F\": ");
+      w.put_double(iv.r_fm);
+      w.put('}');
     }
-    ebuf = new char[5*ff.size()];
-    escape(ebuf, ff.data(), ff.size());
-
-  } else {
-    ebuf = new char[5*(e->end.back() - e->start.front())];
-    escape(ebuf, data + e->start.front(), e->end.back() - e->start.front());
-  }
-
-  string ee = tag_names[e->tagid].c_str();
-
-  if(!e->attr.empty()) {
-    ee += " (";
-    for(list<pair<string, string> >::const_iterator i = e->attr.begin(); i != e->attr.end(); i++) {
-      if(i != e->attr.begin())
-	ee += ' ';
-      ee += i->first + '=' + i->second;
+    if(opt_tokens) {
+      w.put(",\n  \"tokens\": {\"total\": ");
+      w.put_int(tk.total);
+      w.put(", \"correct\": ");
+      w.put_int(tk.correct);
+      w.put(", \"accuracy\": ");
+      w.put_double(tk.total ? tk.correct/double(tk.total) : 0);
+      w.put(", \"confusion\": [");
+      bool first = true;
+      for(int i=0; i != tk.nl*tk.nl; i++) {
+	if(!tk.confusion[i])
+	  continue;
+	w.put(first ? "\n    {\"ref\": " : ",\n    {\"ref\": ");
+	first = false;
+	w.put_json(token_label(i / tk.nl));
+	w.put(", \"hyp\": ");
+	w.put_json(token_label(i % tk.nl));
+	w.put(", \"count\": ");
+	w.put_int(tk.confusion[i]);
+	w.put('}');
+      }
+      w.put(first ? "]}" : "\n  ]}");
+    }
+    if(opt_details) {
+      w.put(",\n  \"records\": [");
+      emit_records(w, rs, rfname, hfname);
+      w.put(rs.count ? "\n  ]" : "]");
+    }
+    w.put("\n}\n");
+    break;
+
+  case FORMAT_CSV:
+    if(opt_summary || opt_iag || opt_tokens) {
+      w.put("metric,tag,value\n");
+      if(opt_summary) {
+	csv_metric(w, "ser", "", count_ref ? ser/count_ref : 0);
+	csv_metric(w, "ser_cost", "", ser);
+	csv_metric(w, "ref_count", "", count_ref);
+	csv_metric(w, "hyp_count", "", count_hyp);
+	csv_metric(w, "correct", "", count_correct);
+	csv_metric(w, "insert", "", count_insert);
+	csv_metric(w, "delete", "", count_delete);
+	csv_metric(w, "substitution", "", count_subst);
+	csv_metric(w, "total_errors", "", count_total);
+	csv_metric(w, "precision", "", precision);
+	csv_metric(w, "recall", "", recall);
+	csv_metric(w, "f_measure", "", fmeasure);
+	for(int i=0; i != tc; i++) {
+	  if(!(tag_hypcount[i] + tag_refcount[i]))
+	    continue;
+	  double cc = tag_correct[i];
+	  csv_metric(w, "precision", tag_names[i], tag_hypcount[i] ? cc/tag_hypcount[i] : 0);
+	  csv_metric(w, "recall", tag_names[i], tag_refcount[i] ? cc/tag_refcount[i] : 0);
+	  csv_metric(w, "f_measure", tag_names[i], 2*cc/(tag_hypcount[i] + tag_refcount[i]));
+	  csv_metric(w, "hyp_count", tag_names[i], tag_hypcount[i]);
+	  csv_metric(w, "ref_count", tag_names[i], tag_refcount[i]);
+	  csv_metric(w, "correct", tag_names[i], tag_correct[i]);
+	}
+      }
+      if(opt_iag) {
+	csv_metric(w, "iag_total", "", iv.rt);
+	csv_metric(w, "iag_correct", "", iv.count_correct);
+	csv_metric(w, "iag_void_void_corrects", "", iv.ovc);
+	csv_metric(w, "iag_types", "", iv.tc);
+	csv_metric(w, "iag_S", "", iv.r_S);
+	csv_metric(w, "iag_Pi", "", iv.r_pi);
+	csv_metric(w, "iag_Kappa", "", iv.r_kappa);
+	csv_metric(w, "iag_F", "", iv.r_fm);
+      }
+      if(opt_tokens) {
+	csv_metric(w, "token_total", "", tk.total);
+	csv_metric(w, "token_correct", "", tk.correct);
+	csv_metric(w, "token_accuracy", "", tk.total ? tk.correct/double(tk.total) : 0);
+	for(int i=0; i != tk.nl*tk.nl; i++)
+	  if(tk.confusion[i])
+	    csv_metric(w, "token_confusion", string(token_label(i / tk.nl)) + ' ' + token_label(i % tk.nl), tk.confusion[i]);
+      }
+    }
+    if(opt_details) {
+      if(opt_summary || opt_iag || opt_tokens)
+	w.put('\n');
+      w.put("class,errors,cost,"
+	    "ref_file,ref_line,ref_depth,ref_start,ref_end,ref_tag,ref_attrs,ref_value,"
+	    "hyp_file,hyp_line,hyp_depth,hyp_start,hyp_end,hyp_tag,hyp_attrs,hyp_value\n");
+      emit_records(w, rs, rfname, hfname);
+    }
+    break;
+
+  case FORMAT_BIN:
+    w.put("NESB", 4);
+    w.put_u32(2);
+    if(opt_summary) {
+      w.put_u8(1);
+      w.put_f64(ser);
+      w.put_u32(count_ref);
+      w.put_u32(count_hyp);
+      w.put_u32(count_correct);
+      w.put_u32(count_insert);
+      w.put_u32(count_delete);
+      w.put_u32(count_subst);
+      w.put_u8(2);
+      w.put_u32(tc);
+      for(int i=0; i != tc; i++) {
+	w.put_bin(tag_names[i]);
+	w.put_u32(tag_hypcount[i]);
+	w.put_u32(tag_refcount[i]);
+	w.put_u32(tag_correct[i]);
+      }
+    }
+    if(opt_iag) {
+      w.put_u8(3);
+      w.put_f64(iv.rt);
+      w.put_f64(iv.ovc);
+      w.put_u32(iv.count_correct);
+      w.put_u32(iv.tc);
+      w.put_f64(iv.r_S);
+      w.put_f64(iv.r_pi);
+      w.put_f64(iv.r_kappa);
+      w.put_f64(iv.r_fm);
+    }
+    if(opt_tokens) {
+      w.put_u8(5);
+      w.put_u64(tk.total);
+      w.put_u64(tk.correct);
+      w.put_u32(tk.nl);
+      for(int i=0; i != tk.nl; i++)
+	w.put_bin(token_label(i));
+      for(int i=0; i != tk.nl*tk.nl; i++)
+	w.put_u64(tk.confusion[i]);
+    }
+    if(opt_details) {
+      w.put_u8(4);
+      emit_records(w, rs, rfname, hfname);
+      w.put_u8(0);
     }
-    ee += ')';
+    w.put_u8(0);
+    break;
   }
-  printf("%c: %s: %s - %s\n", error, e->hyp ? "hyp" : "ref", ee.c_str(), ebuf);
-  delete[] ebuf;
 }
 
-void show_details(const vector<segment> &segments, const char *data, const map<entity *, frontier_choice> &fm, const char *rfname, const char *hfname)
+void write_conll(const conll_counts &cc, const char *rfname, const char *hfname)
 {
-  for(vector<segment>::const_iterator i = segments.begin(); i != segments.end(); i++) {
-    for(list<entity *>::const_iterator j = i->unmapped_entities.begin(); j != i->unmapped_entities.end(); j++) {
-      const entity *e = *j;
-      char err = e->hyp ? 'I' : 'D';
-      printf("%c: %s (%g): %s:%d\n",
-	     err,
-	     build_error_string(e->miss_errors[0][0]).c_str(),
-	     e->miss_errors[0][0].cost,
-	     e->hyp ? hfname : rfname,
-	     e->line);
-      show_entity(e, data, err, fm);
-      printf("\n");
+  conll_prf v[3];
+  conll_values(cc, v);
+  int counts[3] = { cc.strict, cc.type_hyp, cc.boundary };
+
+  out_writer w(stdout);
+
+  switch(opt_format) {
+  case FORMAT_JSON:
+    w.put("{\n  \"ref_file\": ");
+    w.put_json(rfname, strlen(rfname));
+    w.put(",\n  \"hyp_file\": ");
+    w.put_json(hfname, strlen(hfname));
+    w.put(",\n  \"conll\": {\"ref_count\": ");
+    w.put_int(cc.count_ref);
+    w.put(", \"hyp_count\": ");
+    w.put_int(cc.count_hyp);
+    for(int i=0; i != 3; i++) {
+      w.put(", \"");
+      w.put(v[i].name);
+      w.put("\": {\"precision\": ");
+      w.put_double(v[i].p);
+      w.put(", \"recall\": ");
+      w.put_double(v[i].r);
+      w.put(", \"f_measure\": ");
+      w.put_double(v[i].f);
+      if(i == 1) {
+	w.put(", \"hyp_matched\": ");
+	w.put_int(cc.type_hyp);
+	w.put(", \"ref_matched\": ");
+	w.put_int(cc.type_ref);
+      } else {
+	w.put(", \"correct\": ");
+	w.put_int(counts[i]);
+      }
+      w.put('}');
     }
-
-    for(list<segment::pairinfo>::const_iterator j = i->added_pairs.begin(); j != i->added_pairs.end(); j++) {
-      const entity *e1 = j->er;
-      const entity *e2 = j->eh;
-      char err = 0;
-      if(j->error->error_types.empty()) {
-	if(opt_details_correct)
-	  err = 'C';
-      } else
-	err = 'S';
-
-      if(err) {
-	printf("%c: %s (%g): %s:%d %s:%d\n",
-	       err,
-	       err == 'C' ? "correct" : build_error_string(*j->error).c_str(),
-	       j->error->cost,
-	       rfname, e1->line,
-	       hfname, e2->line);
-	show_entity(e1, data, err, fm);
-	show_entity(e2, data, err, fm);
-	printf("\n");
+    w.put("},\n  \"tags\": [");
+    {
+      bool first = true;
+      for(int i=0; i != cc.tc; i++) {
+	if(!(cc.tag_hypcount[i] + cc.tag_refcount[i]))
+	  continue;
+	double c = cc.tag_strict[i];
+	w.put(first ? "\n    {\"tag\": " : ",\n    {\"tag\": ");
+	first = false;
+	w.put_json(tag_names[i]);
+	w.put(", \"precision\": ");
+	w.put_double(cc.tag_hypcount[i] ? c/cc.tag_hypcount[i] : 0);
+	w.put(", \"recall\": ");
+	w.put_double(cc.tag_refcount[i] ? c/cc.tag_refcount[i] : 0);
+	w.put(", \"f_measure\": ");
+	w.put_double(2*c/(cc.tag_hypcount[i] + cc.tag_refcount[i]));
+	w.put(", \"hyp_count\": ");
+	w.put_int(cc.tag_hypcount[i]);
+	w.put(", \"ref_count\": ");
+	w.put_int(cc.tag_refcount[i]);
+	w.put(", \"correct\": ");
+	w.put_int(cc.tag_strict[i]);
+	w.put('}');
       }
-    }    
-  }    
+      w.put(first ? "]" : "\n  ]");
+    }
+    w.put("\n}\n");
+    break;
+
+  case FORMAT_CSV:
+    w.put("metric,tag,value\n");
+    csv_metric(w, "ref_count", "", cc.count_ref);
+    csv_metric(w, "hyp_count", "", cc.count_hyp);
+    for(int i=0; i != 3; i++) {
+      string m = v[i].name;
+      csv_metric(w, (m + "_precision").c_str(), "", v[i].p);
+      csv_metric(w, (m + "_recall").c_str(), "", v[i].r);
+      csv_metric(w, (m + "_f_measure").c_str(), "", v[i].f);
+    }
+    csv_metric(w, "strict_correct", "", cc.strict);
+    csv_metric(w, "type_hyp_matched", "", cc.type_hyp);
+    csv_metric(w, "type_ref_matched", "", cc.type_ref);
+    csv_metric(w, "boundary_correct", "", cc.boundary);
+    for(int i=0; i != cc.tc; i++) {
+      if(!(cc.tag_hypcount[i] + cc.tag_refcount[i]))
+	continue;
+      double c = cc.tag_strict[i];
+      csv_metric(w, "strict_precision", tag_names[i], cc.tag_hypcount[i] ? c/cc.tag_hypcount[i] : 0);
+      csv_metric(w, "strict_recall", tag_names[i], cc.tag_refcount[i] ? c/cc.tag_refcount[i] : 0);
+      csv_metric(w, "strict_f_measure", tag_names[i], 2*c/(cc.tag_hypcount[i] + cc.tag_refcount[i]));
+      csv_metric(w, "hyp_count", tag_names[i], cc.tag_hypcount[i]);
+      csv_metric(w, "ref_count", tag_names[i], cc.tag_refcount[i]);
+      csv_metric(w, "strict_correct", tag_names[i], cc.tag_strict[i]);
+    }
+    break;
+
+  case FORMAT_BIN:
+    w.put("NESB", 4);
+    w.put_u32(2);
+    w.put_u8(6);
+    w.put_u32(cc.count_ref);
+    w.put_u32(cc.count_hyp);
+    w.put_u32(cc.strict);
+    w.put_u32(cc.type_hyp);
+    w.put_u32(cc.type_ref);
+    w.put_u32(cc.boundary);
+    w.put_u32(cc.tc);
+    for(int i=0; i != cc.tc; i++) {
+      w.put_bin(tag_names[i]);
+      w.put_u32(cc.tag_hypcount[i]);
+      w.put_u32(cc.tag_refcount[i]);
+      w.put_u32(cc.tag_strict[i]);
+    }
+    w.put_u8(0);
+    break;
+  }
 }
 
-void calc_scores(const vector<segment> &segments, int &tc, vector<int> &tag_hypcount, vector<int> &tag_refcount, vector<int> &tag_correct, double &ser, int &count_insert, int &count_delete, int &count_subst, int &count_correct, int &count_total)
+void show_profile(int nsegments, int ngroups)
 {
-  tc = tag_names.size();
-  tag_hypcount.resize(tc);
-  tag_refcount.resize(tc);
-  tag_correct.resize(tc);
+  double tw = 0, tc = 0;
+  fprintf(stderr, "Profile:\n");
+  fprintf(stderr, "  %-16s %10s %10s\n", "phase", "wall (s)", "cpu (s)");
+  for(int i=0; i != PHASE_COUNT; i++) {
+    fprintf(stderr, "  %-16s %10.4f %10.4f\n", phase_names[i], phase_wall[i], phase_cpu[i]);
+    tw += phase_wall[i];
+    tc += phase_cpu[i];
+  }
+  fprintf(stderr, "  %-16s %10.4f %10.4f\n", "total", tw, tc);
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  fprintf(stderr, "  lua calls:        %ld\n", lua_calls);
+  fprintf(stderr, "  segments:         %d in %d groups\n", nsegments, ngroups);
+  fprintf(stderr, "  align nodes:      %d peak, %ld total\n", all_peak_nodes, all_total_nodes);
+  fprintf(stderr, "  max alternatives: %u per segment\n", all_max_nalt);
+  fprintf(stderr, "  peak rss:         %ld kB\n", ru.ru_maxrss);
+}
 
-  ser = 0;
-  count_insert = 0;
-  count_delete = 0;
-  count_subst = 0;
-  count_correct = 0;
-  for(vector<segment>::const_iterator i = segments.begin(); i != segments.end(); i++) {
-    for(list<entity *>::const_iterator j = i->unmapped_entities.begin(); j != i->unmapped_entities.end(); j++) {
-      const entity *e = *j;
-      if(e->hyp) {
-	count_insert++;
-	tag_hypcount[e->tagid]++;
-      } else {
-	count_delete++;
-	tag_refcount[e->tagid]++;
-      }
-      ser += e->miss_errors[0][0].cost;
+
+// Pipelined scoring (--pipeline): a reader thread cuts the ref and
+// hyp files in chunks, worker threads score each chunk on their own
+// lua state, and the main thread reduces the results in input order.
+// The ref is cut at line ends outside of entities, the hyp where the
+// same text has been seen.
+
+struct pipeline_chunk {
+  unsigned int index;
+  int ref_line, hyp_line;                 // First line of the chunk in each file
+  char *ref_data, *hyp_data;
+  entity_store ents;
+  vector<segment> segments;
+  segment_pool seg_pool;
+  vector<segment_group> groups;
+  vector<sweep_step> sweep_steps;
+  vector<error_d> sweep_errors;
+  map<entity_id, frontier_choice> align_frontiers;
+  vector<pending_error> pending;          // Error names, interned by the reducer
+  int count_ref, count_hyp;
+
+  pipeline_chunk() { ref_data = hyp_data = 0; count_ref = count_hyp = 0; }
+  ~pipeline_chunk() { free(ref_data); free(hyp_data); }
+};
+
+// Bounded lock-free queue of chunks, any number of producers and
+// consumers (D. Vyukov's array queue).  A null chunk marks the end.
+class chunk_queue {
+  struct cell {
+    unsigned long seq;
+    pipeline_chunk *chunk;
+  };
+  vector<cell> cells;
+  unsigned long mask, head, tail;
+
+public:
+  chunk_queue(unsigned int size) {
+    unsigned int n = 2;
+    while(n < size)
+      n <<= 1;
+    cells.resize(n);
+    for(unsigned int i = 0; i != n; i++)
+      cells[i].seq = i;
+    mask = n-1;
+    head = tail = 0;
+  }
+
+  bool try_push(pipeline_chunk *c) {
+    unsigned long pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    for(;;) {
+      cell &cl = cells[pos & mask];
+      long dif = long(__atomic_load_n(&cl.seq, __ATOMIC_ACQUIRE)) - long(pos);
+      if(!dif) {
+	if(__atomic_compare_exchange_n(&tail, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	  cl.chunk = c;
+	  __atomic_store_n(&cl.seq, pos+1, __ATOMIC_RELEASE);
+	  return true;
+	}
+      } else if(dif < 0)
+	return false;
+      else
+	pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
     }
+  }
 
-    for(list<segment::pairinfo>::const_iterator j = i->added_pairs.begin(); j != i->added_pairs.end(); j++) {
-      const entity *er = j->er;
-      const entity *eh = j->eh;
-      tag_refcount[er->tagid]++;
-      tag_hypcount[eh->tagid]++;
-      if(j->error->error_types.empty()) {
-	count_correct++;
-	tag_correct[er->tagid]++;
-      } else
-	count_subst++;
-      ser += j->error->cost;
+  bool try_pop(pipeline_chunk *&c) {
+    unsigned long pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    for(;;) {
+      cell &cl = cells[pos & mask];
+      long dif = long(__atomic_load_n(&cl.seq, __ATOMIC_ACQUIRE)) - long(pos+1);
+      if(!dif) {
+	if(__atomic_compare_exchange_n(&head, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	  c = cl.chunk;
+	  __atomic_store_n(&cl.seq, pos + mask + 1, __ATOMIC_RELEASE);
+	  return true;
+	}
+      } else if(dif < 0)
+	return false;
+      else
+	pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
     }
   }
 
-  count_total = count_insert + count_delete + count_subst;
-}
+  void push(pipeline_chunk *c) {
+    while(!try_push(c))
+      sched_yield();
+  }
 
-void show_summary(const vector<segment> &segments, int count_ref, int count_hyp)
-{
-  int tc, count_insert, count_delete, count_subst, count_correct, count_total;
-  double ser;
-  vector<int> tag_hypcount, tag_refcount, tag_correct;
- 
-  calc_scores(segments, tc, tag_hypcount, tag_refcount, tag_correct, ser, count_insert, count_delete, count_subst, count_correct, count_total);
+  pipeline_chunk *pop() {
+    pipeline_chunk *c;
+    while(!try_pop(c))
+      sched_yield();
+    return c;
+  }
+};
 
-  printf("Slot Error Rate: %5.1f%% (%g %d)\n\n", ser*100.0/count_ref, ser, count_ref);
+struct pipeline_ctx {
+  const char *rfname, *hfname;
+  chunk_queue *todo, *done;
+  unsigned int reduced;                   // Chunks reduced so far
+  unsigned int window;                    // Maximum number of chunks in flight
+};
 
-  printf("%6d %5.1f%% corrects\n", count_correct, count_correct*100.0/count_ref);
-  printf("%6d %5.1f%% inserts\n", count_insert, count_insert*100.0/count_ref);
-  printf("%6d %5.1f%% deletes\n", count_delete, count_delete*100.0/count_ref);
-  printf("%6d %5.1f%% substitutions\n", count_subst, count_subst*100.0/count_ref);
-  printf("%6d %5.1f%% total errors\n\n", count_total, count_total*100.0/count_ref);
-  if(count_hyp)
-    printf("%5.1f%% overall precision (%d entities in hypothesis)\n", count_correct*100.0/count_hyp, count_hyp);
-  else
-    printf("   0.0%% overall precision (0 entities in hypothesis)\n");
-  printf("%5.1f%% overall recall (%d entities in reference)\n", count_correct*100.0/count_ref, count_ref);
-  printf("%5.1f%% overall F-measure\n\n", 2*count_correct*100.0/(count_ref+count_hyp));  
+struct pipeline_worker {
+  pipeline_ctx *ctx;
+  unsigned int id;
+};
 
-  printf("   P      R      F   tag\n");
-  for(int i=0; i != tc; i++) {
-    double cc = 100*tag_correct[i];
-    if(tag_hypcount[i] + tag_refcount[i])
-      printf("%5.1f%% %5.1f%% %5.1f%% %s (hyp_count=%d, ref_count=%d, correct=%d)\n",
-	     tag_hypcount[i] ? cc/tag_hypcount[i] : 0,
-	     tag_refcount[i] ? cc/tag_refcount[i] : 0,
-	     tag_hypcount[i] + tag_refcount[i] ? 2*cc/(tag_hypcount[i] + tag_refcount[i]) : 0,
-	     tag_names[i].c_str(),
-	     tag_hypcount[i], tag_refcount[i], tag_correct[i]
-	     );
+// Reader input, read by blocks, pos is the start of the next chunk
+struct chunk_input {
+  input_stream in;
+  string buf;
+  size_t pos;
+  bool eof;
+  int line;
+
+  chunk_input(const char *fname) : in(fname) {
+    pos = 0;
+    eof = false;
+    line = 1;
   }
-}
 
-/*
-
-Coef = (a0-ae)/(1-ae)
-
-A0 = correct / total = (rc + ovc)/(rt + ovc)
+  // Character at pos+i, 0 at the end of the file
+  char at(size_t i) {
+    while(pos + i >= buf.size() && !eof) {
+      size_t size = buf.size();
+      buf.resize(size + INPUT_BLOCK);
+      size_t n = in.get(&buf[size], INPUT_BLOCK);
+      buf.resize(size + n);
+      if(!n)
+	eof = true;
+    }
+    return pos + i < buf.size() ? buf[pos + i] : 0;
+  }
 
-AeS = 1/|T| (-> tend vers 1, rien a faire)
+  // Cut the next n bytes as the chunk text
+  char *take(size_t n, int &first_line) {
+    char *data = (char *)malloc(n+1);
+    memcpy(data, buf.data() + pos, n);
+    data[n] = 0;
+    first_line = line;
+    for(size_t i = 0; i != n; i++)
+      if(data[i] == '\n')
+	line++;
+    pos += n;
+    if(pos > (1 << 20)) {
+      buf.erase(0, pos);
+      pos = 0;
+    }
+    return data;
+  }
+};
 
-AePi = 1/(2*total)^2 * sum((correct(tag, a1) + correct(tag, a2))^2)
+static inline bool is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
 
-AeKappa = 1/(total_a*total_b) * sum(correct(tag,a1)*correct(tag,a2))
+// Length of the tested tag at offset i, 0 if there is none,
+// recognized as xml_extract_tags does
+static size_t chunk_tag_length(chunk_input &in, size_t i, bool &closing)
+{
+  size_t j = i+1;
+  char c = in.at(j);
+  if((c < 'a' || c > 'z') && c != '/')
+    return 0;
+  while(is_space(in.at(j)))
+    j++;
+  closing = in.at(j) == '/';
+  if(closing) {
+    j++;
+    while(is_space(in.at(j)))
+      j++;
+  }
+  size_t ns = j;
+  while((c = in.at(j)) && !is_space(c) && c != '>')
+    j++;
+  if(tag_find(in.buf.data() + in.pos + ns, in.buf.data() + in.pos + j) == -1)
+    return 0;
+  while((c = in.at(j)) && c != '>') {
+    if(c == '"')
+      for(j++; (c = in.at(j)) && c != '"'; j++);
+    if(c)
+      j++;
+  }
+  return c ? j+1-i : j-i;
+}
 
-SumPi = sum((correct(tag, a1) + correct(tag, a2))^2)
-SumKappa = sum(correct(tag,a1)*correct(tag,a2))
+// Cut the next chunk of each file, false when both are finished
+static bool cut_chunk(chunk_input &ref, chunk_input &hyp, pipeline_chunk *c)
+{
+  if(!ref.at(0) && !hyp.at(0))
+    return false;
 
-AePi = 1/(2*total)^2 * (SumPi + (va1+va2+2*ovc)^2)
+  // Up to opt_pipeline line ends in the ref, counting the text
+  // characters, stopping at a line end outside of the entities
+  size_t i = 0, text = 0;
+  int lines = 0, depth = 0;
+  bool closing;
+  for(char ch; (ch = ref.at(i));) {
+    size_t tl = ch == '<' ? chunk_tag_length(ref, i, closing) : 0;
+    if(tl) {
+      depth += closing ? -1 : 1;
+      i += tl;
+      continue;
+    }
+    i++;
+    if(!is_space(ch))
+      text++;
+    else if((ch == '\n' || ch == '\r') && ++lines >= opt_pipeline && depth <= 0)
+      break;
+  }
 
-AeKappa = 1/((rt1+va1+ovc)*(rt2+va2+ovc)) * (SumKappa + (va1+ovc)*(va2+ovc))
+  // The same text in the hyp, then the spaces and closing tags
+  size_t j = 0, htext = 0;
+  for(char ch; htext < text && (ch = hyp.at(j));) {
+    size_t tl = ch == '<' ? chunk_tag_length(hyp, j, closing) : 0;
+    if(tl) {
+      j += tl;
+      continue;
+    }
+    j++;
+    if(!is_space(ch))
+      htext++;
+  }
+  for(char ch; (ch = hyp.at(j));) {
+    if(is_space(ch)) {
+      j++;
+      continue;
+    }
+    size_t tl = ch == '<' ? chunk_tag_length(hyp, j, closing) : 0;
+    if(!tl || !closing)
+      break;
+    j += tl;
+  }
+  // Nothing left in the ref, the rest of the hyp goes with it
+  if(!ref.at(i))
+    while(hyp.at(j))
+      j++;
 
-*/
+  c->ref_data = ref.take(i, c->ref_line);
+  c->hyp_data = hyp.take(j, c->hyp_line);
+  return true;
+}
 
-void show_iag(const vector<segment> &segments, int count_ref, int count_hyp)
+static void *pipeline_reader(void *arg)
 {
-  int tc, count_insert, count_delete, count_subst, count_correct, count_total;
-  double ser;
-  vector<int> tag_hypcount, tag_refcount, tag_correct;
- 
-  calc_scores(segments, tc, tag_hypcount, tag_refcount, tag_correct, ser, count_insert, count_delete, count_subst, count_correct, count_total);
+  pipeline_ctx *ctx = static_cast<pipeline_ctx *>(arg);
+  trace_tid = opt_jobs+1;
+  chunk_input ref(ctx->rfname), hyp(ctx->hfname);
+  for(unsigned int index = 0;; index++) {
+    while(index >= __atomic_load_n(&ctx->reduced, __ATOMIC_ACQUIRE) + ctx->window)
+      sched_yield();
+
+    double start = trace_file ? wall_time() : 0;
+    pipeline_chunk *c = new pipeline_chunk;
+    if(!cut_chunk(ref, hyp, c)) {
+      delete c;
+      break;
+    }
+    c->index = index;
+    if(trace_file) {
+      char args[64];
+      sprintf(args, "\"chunk\":%u", index);
+      trace_event("read", "pipeline", start, wall_time(), trace_tid, args);
+    }
+    ctx->todo->push(c);
+  }
+  for(int i = 0; i != opt_jobs; i++)
+    ctx->todo->push(0);
+  return 0;
+}
 
-  double void_hyp, void_ref, rt;
-  if(opt_open) {
-    void_hyp = count_ref - count_correct;
-    void_ref = count_hyp - count_correct;
-    rt = count_correct + void_hyp + void_ref;
+// Same steps as the serial scoring, on one chunk
+static void pipeline_score_chunk(lua_State *L, pipeline_chunk *c, const char *rfname, const char *hfname)
+{
+  list<simple_tag> ref_tags, hyp_tags;
+  entity_store &es = c->ents;
+
+  xml_extract_tags(hyp_tags, c->hyp_data, hfname, c->hyp_line);
+  xml_extract_tags(ref_tags, c->ref_data, rfname, c->ref_line);
+  build_entities_from_tags(es, ref_tags, rfname, false);
+  align_and_reposition(c->ref_data, c->hyp_data, hyp_tags, c->ref_line, c->hyp_line);
+  entity_id first_hyp = es.size();
+  build_entities_from_tags(es, hyp_tags, hfname, true);
+  refine_entities(es, 0, first_hyp, c->ref_data, rfname);
+  refine_entities(es, first_hyp, es.size(), c->ref_data, hfname);
+  c->count_ref = first_hyp;
+  c->count_hyp = es.size() - first_hyp;
+
+  alloc_miss_costs(es);
+  miss_costs_ctx mctx;
+  mctx.es = &es;
+  mctx.data = c->ref_data;
+  miss_costs_range(L, 0, es.size(), &mctx, &c->pending);
+
+  if(build_sweep(es, first_hyp, c->sweep_steps)) {
+    c->sweep_errors.resize(3*c->sweep_steps.size());
+    sweep_costs_ctx wctx;
+    wctx.es = &es;
+    wctx.steps = &c->sweep_steps;
+    wctx.errors = &c->sweep_errors;
+    wctx.data = c->ref_data;
+    sweep_costs_range(L, 0, c->sweep_steps.size(), &wctx, &c->pending);
+    sweep_align(es, c->sweep_steps, c->segments, c->align_frontiers);
 
   } else {
-    void_hyp = count_ref - count_correct - count_subst;
-    void_ref = count_hyp - count_correct - count_subst;
-    rt = count_correct + count_subst + void_hyp + void_ref;
+    build_segments(c->segments, c->seg_pool, es);
+    build_segment_groups(c->groups, es, c->segments);
+
+    subst_costs_ctx sctx;
+    sctx.es = &es;
+    sctx.segments = &c->segments;
+    sctx.groups = &c->groups;
+    sctx.data = c->ref_data;
+    subst_costs_range(L, 0, c->groups.size(), &sctx, &c->pending);
+    align(es, c->segments, c->groups, c->ref_data, c->align_frontiers, true);
   }
-  double ovc = opt_expected_count - rt;
-  if(ovc<0)
-    ovc = 0;
+  cleanup_unmapped(c->segments, es);
+}
 
-  double A0 = ovc ? (1+count_correct/ovc)/(1+rt/ovc) : count_correct/rt;
-  double AeS = 1/double(tc+1);
-  double r_S = (A0-AeS)/(1-AeS);
+static void *pipeline_worker_run(void *arg)
+{
+  pipeline_worker *w = static_cast<pipeline_worker *>(arg);
+  pipeline_ctx *ctx = w->ctx;
+  trace_tid = w->id+1;
+  for(;;) {
+    pipeline_chunk *c = ctx->todo->pop();
+    if(!c)
+      break;
+    double start = trace_file ? wall_time() : 0;
+    pipeline_score_chunk(lua_pool[w->id], c, ctx->rfname, ctx->hfname);
+    if(trace_file) {
+      char args[128];
+      sprintf(args, "\"chunk\":%u,\"entities\":%u,\"segments\":%u", c->index, c->ents.size(), unsigned(c->segments.size()));
+      trace_event("score", "pipeline", start, wall_time(), trace_tid, args);
+    }
+    ctx->done->push(c);
+  }
+  merge_node_counts();
+  ctx->done->push(0);
+  return 0;
+}
 
-  double SigmaPi = (void_hyp+void_ref)*(void_hyp+void_ref);
-  double SigmaKappa = void_hyp*void_ref;
+// Score the files through the pipeline and write the results
+void pipeline_main(const char *rfname, const char *hfname, int &nsegments, int &ngroups)
+{
+  chunk_queue todo(2*opt_jobs), done(2*opt_jobs);
+  pipeline_ctx ctx;
+  ctx.rfname = rfname;
+  ctx.hfname = hfname;
+  ctx.todo = &todo;
+  ctx.done = &done;
+  ctx.reduced = 0;
+  ctx.window = 4*opt_jobs;
+
+  pthread_t reader;
+  vector<pthread_t> threads(opt_jobs);
+  vector<pipeline_worker> workers(opt_jobs);
+  if(pthread_create(&reader, 0, pipeline_reader, &ctx)) {
+    perror("pthread_create");
+    exit(1);
+  }
+  for(int i = 0; i != opt_jobs; i++) {
+    workers[i].ctx = &ctx;
+    workers[i].id = i;
+    if(pthread_create(&threads[i], 0, pipeline_worker_run, &workers[i])) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
 
-  for(int i=0; i<tc; i++) {
-    double cpi = double(tag_hypcount[i]+tag_refcount[i]);
-    SigmaPi += cpi*cpi;
-    SigmaKappa += double(tag_hypcount[i])*double(tag_refcount[i]);
+  // Details are streamed as the chunks are reduced, records for the
+  // structured formats go to a temporary file until the totals are
+  // known
+  score_counts sc;
+  token_counts tk;
+  records_source rs;
+  FILE *df = 0;
+  if(opt_details) {
+    if(opt_format != FORMAT_TEXT)
+      df = rs.rendered = tmpfile();
+    else if(opt_details_out)
+      df = fopen(opt_details_out, "w");
+    else
+      df = stdout;
+    if(!df) {
+      perror(opt_details_out ? opt_details_out : "tmpfile");
+      exit(1);
+    }
+  }
+  out_writer *dw = df ? new out_writer(df) : 0;
+  vector<pair<text_pos, int> > fr;
+
+  map<unsigned int, pipeline_chunk *> waiting;
+  int count_ref = 0, count_hyp = 0, ended = 0;
+  text_pos base = 0;
+  nsegments = ngroups = 0;
+  while(ended != opt_jobs) {
+    pipeline_chunk *c = done.pop();
+    if(!c) {
+      ended++;
+      continue;
+    }
+    waiting[c->index] = c;
+    for(map<unsigned int, pipeline_chunk *>::iterator i; (i = waiting.find(ctx.reduced)) != waiting.end();) {
+      c = i->second;
+      waiting.erase(i);
+      for(vector<pending_error>::const_iterator j = c->pending.begin(); j != c->pending.end(); j++)
+	intern_error(*j->error, j->names);
+      add_scores(c->ents, c->segments, sc);
+      if(opt_tokens)
+	add_token_counts(c->ents, c->ref_data, c->align_frontiers, tk);
+      count_ref += c->count_ref;
+      count_hyp += c->count_hyp;
+      nsegments += c->segments.size();
+      ngroups += c->groups.size();
+      if(dw) {
+	resolve_details_filters(false);
+	if(opt_format == FORMAT_TEXT)
+	  put_details(*dw, c->ents, c->segments, 0, c->segments.size(), c->ref_data, c->align_frontiers, rfname, hfname, fr);
+	else
+	  write_records(*dw, c->ents, c->segments, c->ref_data, c->align_frontiers, rfname, hfname, rs.count, base);
+      }
+      base += strlen(c->ref_data);
+      delete c;
+      __atomic_store_n(&ctx.reduced, ctx.reduced+1, __ATOMIC_RELEASE);
+    }
   }
 
-  double r_pi, r_kappa;
+  pthread_join(reader, 0);
+  for(int i = 0; i != opt_jobs; i++)
+    pthread_join(threads[i], 0);
+
+  if(dw)
+    resolve_details_filters(true);
+  delete dw;
+  phase(PHASE_OUTPUT);
+
+  if(opt_format != FORMAT_TEXT) {
+    write_results(sc, tk, count_ref, count_hyp, rfname, hfname, rs);
+    if(rs.rendered)
+      fclose(rs.rendered);
 
-  if(ovc) {
-    r_pi = (8*count_correct-4*(rt-count_correct) + (4*count_correct*rt - SigmaPi)/ovc)/(8*count_correct + (4*rt*rt - SigmaPi)/ovc);
-    r_kappa = (2*count_correct + (count_correct*rt - SigmaKappa)/ovc)/(count_correct+rt + (rt*rt - SigmaKappa)/ovc);
   } else {
-    r_pi = (4*count_correct*rt - SigmaPi)/(4*rt*rt - SigmaPi);
-    r_kappa = (count_correct*rt - SigmaKappa)/(rt*rt - SigmaKappa);
-  }
+    if(opt_details_out && fclose(df)) {
+      perror(opt_details_out);
+      exit(1);
+    }
 
-  double r_fm = 2*count_correct/double(count_ref + count_hyp);
+    if(opt_summary)
+      show_summary(sc, count_ref, count_hyp);
 
-  printf("Total entities: %d\n", int(rt));
-  printf("Correct: %d\n", count_correct);
-  printf("Added void/void corrects: %g\n", ovc);
-  printf("Tag types: %d\n", tc);
-  printf("\n");
-  printf("S         = %7.5f\n", r_S);
-  printf("Pi        = %7.5f\n", r_pi);
-  printf("Kappa     = %7.5f\n", r_kappa);
-  printf("F-measure = %7.5f\n", r_fm);
-}
+    if(opt_iag)
+      show_iag(sc, count_ref, count_hyp);
 
+    if(opt_tokens)
+      show_tokens(tk);
+  }
+}
 
 // Option handling
 static void print_usage(ostream &out)
@@ -2004,25 +6150,83 @@ static void print_usage(ostream &out)
       << "  -d                  show detail of errors\n"
       << "  -c                  show detail of errors and corrects\n"
       << "  -i <expected_count> show IAG-type values\n"
+      << "  -t, --tokens        show token accuracy and the token type confusion matrix\n"
       << "  -o                  open - in IAG mode, there are no confusions\n"
+      << "  -r <max_edits>      resynchronize lines where ref and hyp texts differ\n"
+      << "                      by at most max_edits characters instead of failing\n"
+      << "  -j <jobs>           compute the costs with jobs threads, each with its own\n"
+      << "                      lua state (default 1)\n"
+      << "  --profile           report time per phase and search statistics on stderr\n"
+      << "  --trace <file>      write a chrome trace-event timeline of the phases and\n"
+      << "                      group alignments to file\n"
+      << "  --match-above <n>   align flat segment groups as a bipartite matching once\n"
+      << "                      the search keeps more than n nodes alive (default\n"
+      << "                      1000, 0 for all flat groups); groups with nesting,\n"
+      << "                      frontier alternatives or tied optimal matchings\n"
+      << "                      are always left to the search\n"
+      << "  --conll             only compute CoNLL style strict (same span and type), type\n"
+      << "                      (overlapping span) and boundary (same span) P/R/F, with\n"
+      << "                      no alignment\n"
+      << "  --format <fmt>      output format, text (default), json, csv or bin; -s, -d,\n"
+      << "                      -c, -i and -t select what is written\n"
+      << "  --details-out <file>  write the detail of errors to file (text format)\n"
+      << "  --details-class <cl>  only show the detail records of these classes, among\n"
+      << "                      I, D, S and C (default IDS, IDSC with -c)\n"
+      << "  --details-tag <t,...> only show the detail records involving these tags\n"
+      << "  --details-error <e,...> only show the detail records with these error types\n"
+      << "  --pipeline[=lines]  score chunks of lines (default 1024) in a pipeline of\n"
+      << "                      threads, reading, -j scoring workers and output overlap\n"
+      << "                      (xml reference only, not with -r or --verify)\n"
+      << "  --verify            also run the exhaustive alignment on the groups handled\n"
+      << "                      by faster strategies, report differences on stderr and\n"
+      << "                      exit with status 2 if there are any\n"
       << "\n"
       << endl;
 }
 
+static void split_list(const char *p, list<string> &l)
+{
+  for(;;) {
+    const char *q = strchr(p, ',');
+    l.push_back(q ? string(p, q) : string(p));
+    if(!q)
+      break;
+    p = q+1;
+  }
+}
+
 static void options(int argc, char ***argv)
 {
   static option optlist[] = {
-    { "help", 0, 0, 'h' },
+    { "help",   0, 0, 'h' },
+    { "resync", 1, 0, 'r' },
+    { "tokens", 0, 0, 't' },
+    { "conll",  0, 0, 'C' },
+    { "profile", 0, 0, 'P' },
+    { "trace",   1, 0, 'T' },
+    { "verify",  0, 0, 'V' },
+    { "match-above", 1, 0, 'M' },
+    { "format",  1, 0, 'F' },
+    { "pipeline", 2, 0, 'L' },
+    { "details-out",   1, 0, 'O' },
+    { "details-class", 1, 0, 'K' },
+    { "details-tag",   1, 0, 'G' },
+    { "details-error", 1, 0, 'E' },
     { 0,      0, 0,  0  }
   };
 
   int usage = 0, finish = 0, error = 0;
 
-  opt_summary = opt_details = opt_details_correct = opt_iag = opt_ref_aref = opt_open = false;
-  opt_expected_count = 0;
+  opt_summary = opt_details = opt_details_correct = opt_iag = opt_tokens = opt_conll = opt_ref_aref = opt_open = opt_profile = opt_verify = false;
+  opt_expected_count = opt_resync = 0;
+  opt_jobs = 1;
+  opt_pipeline = 0;
+  opt_match_above = 1000;
+  opt_format = FORMAT_TEXT;
+  opt_trace = opt_details_out = opt_details_class = 0;
 
   for(;;) {
-    int opt = getopt_long(argc, *argv, "hasdci:o", optlist, 0);
+    int opt = getopt_long(argc, *argv, "hasdci:tor:j:", optlist, 0);
     if(opt == EOF)
       break;
     switch(opt) {
@@ -2047,9 +6251,74 @@ static void options(int argc, char ***argv)
     case 'c':
       opt_details = opt_details_correct = true;
       break;
+    case 't':
+      opt_tokens = true;
+      break;
+    case 'C':
+      opt_conll = true;
+      break;
     case 'o':
       opt_open = true;
       break;
+    case 'r':
+      opt_resync = strtol(optarg, 0, 10);
+      if(opt_resync < 0) {
+	fprintf(stderr, "Invalid number of edits %s for -r\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'j':
+      opt_jobs = strtol(optarg, 0, 10);
+      if(opt_jobs < 1)
+	opt_jobs = 1;
+      break;
+    case 'P':
+      opt_profile = true;
+      break;
+    case 'T':
+      opt_trace = optarg;
+      break;
+    case 'V':
+      opt_verify = true;
+      break;
+    case 'M':
+      opt_match_above = strtol(optarg, 0, 10);
+      break;
+    case 'L':
+      opt_pipeline = optarg ? strtol(optarg, 0, 10) : 1024;
+      if(opt_pipeline < 1)
+	opt_pipeline = 1;
+      break;
+    case 'O':
+      opt_details = true;
+      opt_details_out = optarg;
+      break;
+    case 'K':
+      opt_details = true;
+      opt_details_class = optarg;
+      break;
+    case 'G':
+      opt_details = true;
+      split_list(optarg, opt_details_tags);
+      break;
+    case 'E':
+      opt_details = true;
+      split_list(optarg, opt_details_errors);
+      break;
+    case 'F':
+      if(!strcmp(optarg, "text"))
+	opt_format = FORMAT_TEXT;
+      else if(!strcmp(optarg, "json"))
+	opt_format = FORMAT_JSON;
+      else if(!strcmp(optarg, "csv"))
+	opt_format = FORMAT_CSV;
+      else if(!strcmp(optarg, "bin"))
+	opt_format = FORMAT_BIN;
+      else {
+	fprintf(stderr, "Unknown output format %s\n", optarg);
+	exit(1);
+      }
+      break;
     case '?':
     case ':':
       usage = 1;
@@ -2067,12 +6336,26 @@ static void options(int argc, char ***argv)
   if(finish)
     exit(error);
 
-  if(!opt_summary && !opt_details && !opt_iag)
+  if(!opt_summary && !opt_details && !opt_iag && !opt_tokens)
     opt_summary = true;
 
   *argv += optind;
 }
 
+static void end_run(lua_State *L, int nsegments, int ngroups)
+{
+  lua_pool_close();
+  lua_close(L);
+
+  phase(-1);
+  if(opt_profile) {
+    merge_node_counts();
+    show_profile(nsegments, ngroups);
+  }
+  if(trace_file)
+    trace_close();
+}
+
 int main(int argc, char **argv)
 {
   progname = argv[0];
@@ -2087,66 +6370,177 @@ int main(int argc, char **argv)
   char *ref_data, *hyp_data;
   list<simple_tag> ref_stags, hyp_tags;
   list<aref_tag> ref_atags;
-  vector<entity> ref_ents, hyp_ents;
-  map<int, list<entity *> > frontiers;
+  entity_store ents;
   vector<segment> segments;
-  map<entity *, frontier_choice> align_frontiers;
+  segment_pool seg_pool;
+  vector<segment_group> groups;
+  vector<sweep_step> sweep_steps;
+  vector<error_d> sweep_errors;
+  map<entity_id, frontier_choice> align_frontiers;
+
+  if(opt_trace)
+    trace_open(opt_trace);
+  phase(PHASE_LOAD);
+  bool pipelined = opt_pipeline && !opt_ref_aref && !opt_resync && !opt_verify && !opt_conll;
+
+  // Read, and decompress, the hypothesis while the description loads
+  background_load hyp_load;
+  if(!pipelined)
+    background_load_start(hyp_load, argv[2]);
 
   lua_State *L = luaL_newstate();
 
   load_lua_description(L, argv[0]);
   load_tag_list(L);
+  lua_pool_init(L, argv[0]);
 
   tag_hypcount.resize(tag_names.size());
   tag_refcount.resize(tag_names.size());
   tag_correct.resize(tag_names.size());
 
-  annotated_file_load(argv[2], hyp_tags, hyp_data);
+  if(pipelined) {
+    int nsegments, ngroups;
+    phase(PHASE_PIPELINE);
+    pipeline_main(argv[1], argv[2], nsegments, ngroups);
+    end_run(L, nsegments, ngroups);
+    return 0;
+  }
+
+  ref_data = file_load(argv[1]);
+  hyp_data = background_load_wait(hyp_load);
+
+  phase(PHASE_EXTRACT);
+  xml_extract_tags(hyp_tags, hyp_data, argv[2]);
 
   if(opt_ref_aref) {
-    aref_file_load(argv[1], ref_atags, ref_data);
-    build_entities_from_tags(ref_ents, ref_atags, argv[1], false);
+    aref_extract_tags(ref_atags, ref_data, argv[1]);
+    phase(PHASE_ENTITIES);
+    build_entities_from_tags(ents, ref_atags, argv[1], false);
   } else {
-    annotated_file_load(argv[1], ref_stags, ref_data);
-    build_entities_from_tags(ref_ents, ref_stags, argv[1], false);
+    xml_extract_tags(ref_stags, ref_data, argv[1]);
+    phase(PHASE_ENTITIES);
+    build_entities_from_tags(ents, ref_stags, argv[1], false);
   }
 
+  phase(PHASE_REPOSITION);
   align_and_reposition(ref_data, hyp_data, hyp_tags);
 
-  // From that point hyp_tags (->hyp_ents) refers to ref_data, *not* hyp_data
+  // From that point hyp_tags (->hyp entities) refers to ref_data, *not* hyp_data
 
-  build_entities_from_tags(hyp_ents, hyp_tags, argv[2], true);
+  phase(PHASE_ENTITIES);
+  entity_id first_hyp = ents.size();
+  build_entities_from_tags(ents, hyp_tags, argv[2], true);
 
-  refine_entities(ref_ents, ref_data, argv[1]);
-  refine_entities(hyp_ents, ref_data, argv[2]); // *not* hyp_data due to align_and_reposition
+  phase(PHASE_REFINE);
+  refine_entities(ents, 0, first_hyp, ref_data, argv[1]);
+  refine_entities(ents, first_hyp, ents.size(), ref_data, argv[2]); // *not* hyp_data due to align_and_reposition
 
-  compute_entities_miss_costs(L, ref_ents, ref_data);
-  compute_entities_miss_costs(L, hyp_ents, ref_data);
+  if(opt_ref_aref)
+    prune_frontiers(ents, first_hyp);
 
-  //  show_entities(ref_ents, ref_data);
-  //  show_entities(hyp_ents, ref_data);
+  int count_ref = first_hyp;
+  int count_hyp = ents.size() - first_hyp;
 
-  add_frontiers(frontiers, ref_ents);
-  add_frontiers(frontiers, hyp_ents);
+  if(opt_conll) {
+    phase(PHASE_OUTPUT);
+    conll_counts cc;
+    add_conll_counts(ents, first_hyp, cc);
+    if(opt_format != FORMAT_TEXT)
+      write_conll(cc, argv[1], argv[2]);
+    else
+      show_conll(cc);
+    end_run(L, 0, 0);
+    return 0;
+  }
 
-  build_segments(segments, frontiers);
-  //  show_segments(segments, ref_data);
+  phase(PHASE_MISS);
+  compute_entities_miss_costs(ents, ref_data);
+
+  //  show_entities(ents, ref_data);
+
+  int mismatches = 0;
+  phase(PHASE_SEGMENTS);
+  if(build_sweep(ents, first_hyp, sweep_steps)) {
+    // Flat annotations, no segments needed
+    phase(PHASE_SUBST);
+    compute_sweep_costs(ents, sweep_steps, sweep_errors, ref_data);
+
+    phase(PHASE_ALIGN);
+    sweep_align(ents, sweep_steps, segments, align_frontiers);
+    if(opt_verify) {
+      vector<segment> vsegments;
+      segment_pool vseg_pool;
+      map<entity_id, frontier_choice> valign_frontiers;
+      build_segments(vsegments, vseg_pool, ents);
+      build_segment_groups(groups, ents, vsegments);
+      compute_substitution_errors_costs(ents, vsegments, groups, ref_data);
+      align(ents, vsegments, groups, ref_data, valign_frontiers, false);
+      cleanup_unmapped(vsegments, ents);
+      cleanup_unmapped(segments, ents);
+      mismatches = verify_sweep(ents, segments, vsegments);
+    } else
+      cleanup_unmapped(segments, ents);
 
-  compute_substitution_errors_costs(L, segments, ref_data);
+  } else {
+    build_segments(segments, seg_pool, ents);
+    build_segment_groups(groups, ents, segments);
+    //  show_segments(ents, segments, ref_data);
+
+    phase(PHASE_SUBST);
+    compute_substitution_errors_costs(ents, segments, groups, ref_data);
+
+    phase(PHASE_ALIGN);
+    if(opt_verify) {
+      vector<segment> vsegments = segments;
+      map<entity_id, frontier_choice> valign_frontiers;
+      align(ents, vsegments, groups, ref_data, valign_frontiers, false);
+      cleanup_unmapped(vsegments, ents);
+      align(ents, segments, groups, ref_data, align_frontiers, true);
+      cleanup_unmapped(segments, ents);
+      mismatches = verify_alignment(ents, segments, vsegments, groups, align_frontiers, valign_frontiers);
+    } else {
+      align(ents, segments, groups, ref_data, align_frontiers, true);
+      cleanup_unmapped(segments, ents);
+    }
+  }
 
-  align(segments, ref_data, align_frontiers);
-  cleanup_unmapped(segments, ref_ents, hyp_ents);
+  phase(PHASE_OUTPUT);
 
   if(opt_details)
-    show_details(segments, ref_data, align_frontiers, argv[1], argv[2]);
+    resolve_details_filters(true);
+
+  score_counts sc;
+  add_scores(ents, segments, sc);
+  token_counts tk;
+  if(opt_tokens)
+    add_token_counts(ents, ref_data, align_frontiers, tk);
+
+  if(opt_format != FORMAT_TEXT) {
+    records_source rs;
+    rs.es = &ents;
+    rs.segments = &segments;
+    rs.data = ref_data;
+    rs.fm = &align_frontiers;
+    write_results(sc, tk, count_ref, count_hyp, argv[1], argv[2], rs);
 
-  if(opt_summary)
-    show_summary(segments, ref_ents.size(), hyp_ents.size());
+  } else {
+    if(opt_details)
+      show_details(ents, segments, ref_data, align_frontiers, argv[1], argv[2]);
 
-  if(opt_iag)
-    show_iag(segments, ref_ents.size(), hyp_ents.size());
+    if(opt_summary)
+      show_summary(sc, count_ref, count_hyp);
 
-  lua_close(L);
+    if(opt_iag)
+      show_iag(sc, count_ref, count_hyp);
+
+    if(opt_tokens)
+      show_tokens(tk);
+  }
+
+  end_run(L, segments.size(), groups.size());
+
+  if(mismatches)
+    return 2;
 
   return 0;
 }
@@ -0,0 +1,89 @@
+#!/bin/sh
+# Check the fast alignment strategies against the exhaustive search
+# with ne-scoring-gen --verify.  Failing inputs are minimized by
+# removing lines from both files while the mismatch persists.
+#
+# usage: verify.sh [-a] descr.lua ref-file hyp-file
+#        verify.sh -r <count>     random corpora from ne-bench-gen
+#
+# SCORER, GEN and DIR can be set in the environment.  The fast
+# strategies are forced on every group they support unless FAST_OPTS
+# says otherwise.
+
+SCORER=${SCORER:-./ne-scoring-gen}
+FAST_OPTS=${FAST_OPTS:---match-above 0}
+GEN=${GEN:-./ne-bench-gen}
+DIR=${DIR:-verify-data}
+
+mkdir -p $DIR || exit 1
+
+# Exit status 2 is a verification mismatch, anything else is another problem
+fails() {
+  $SCORER --verify $FAST_OPTS $aref $config $1 $2 > /dev/null 2>&1
+  [ $? -eq 2 ]
+}
+
+minimize() {
+  ext=${1##*.}
+  cur=$DIR/min
+  try=$DIR/try
+  cp $1 $cur.$ext
+  cp $2 $cur.hyp
+  n=$(wc -l < $cur.$ext)
+  chunk=$n
+  while [ $chunk -ge 1 ]; do
+    start=1
+    while [ $start -le $n ]; do
+      end=$((start+chunk-1))
+      sed "${start},${end}d" $cur.$ext > $try.$ext
+      sed "${start},${end}d" $cur.hyp > $try.hyp
+      if [ -s $try.$ext ] && fails $try.$ext $try.hyp; then
+	mv $try.$ext $cur.$ext
+	mv $try.hyp $cur.hyp
+	n=$(wc -l < $cur.$ext)
+      else
+	start=$((end+1))
+      fi
+    done
+    chunk=$((chunk/2))
+  done
+  rm -f $try.$ext $try.hyp
+  echo "Minimized counterexample ($n lines): $cur.$ext $cur.hyp"
+  $SCORER --verify $FAST_OPTS $aref $config $cur.$ext $cur.hyp 2>&1 >/dev/null | grep '^ *\(Verify\|only\|frontier\)'
+}
+
+check() {
+  if fails $1 $2; then
+    echo "MISMATCH on $1 $2"
+    minimize $1 $2
+    exit 2
+  fi
+}
+
+aref=
+if [ "$1" = "-r" ]; then
+  config=config.lua
+  count=$2
+  i=1
+  while [ $i -le $count ]; do
+    set -- "-D 1" "-D 2" "-D 3 -p 0.5" "-D 2 -a -A 0.5" "-D 1 -e 0.6" "-D 2 -w 40"
+    eval opts=\${$((i % 6 + 1))}
+    $GEN -S $i -n 200 $opts $DIR/rand || exit 1
+    case " $opts " in
+      *" -a "*) aref=-a; ref=$DIR/rand.aref ;;
+      *) aref=; ref=$DIR/rand.ref ;;
+    esac
+    check $ref $DIR/rand.hyp
+    i=$((i+1))
+  done
+  echo "$count random corpora verified"
+  exit 0
+fi
+
+if [ "$1" = "-a" ]; then
+  aref=-a
+  shift
+fi
+config=$1
+check $2 $3
+echo "verified"